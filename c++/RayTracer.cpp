@@ -4,9 +4,103 @@
 #include <memory>
 #include <fstream>
 #include <chrono>
-#include <optional>
+#include <algorithm>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <random>
+#include <limits>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+#include <map>
+#include <queue>
+#include <type_traits>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#include <windows.h>
+#include <psapi.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/un.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RAYTRACER_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// Lets single functions use AVX2 while the rest of the file keeps the
+// baseline instruction set; MSVC accepts the intrinsics without it.
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+// Constants that depend on the precision the pipeline is instantiated with.
+template <typename Real>
+struct RealTraits;
+
+template <>
+struct RealTraits<double>
+{
+    static constexpr const char* Name = "double";
+    // Distance reported for a miss.
+    static constexpr double FarAway = 1000000.0;
+    // Secondary rays start this far off the surface they leave, along its
+    // normal and relative to the size of the hit point's coordinates. Double
+    // precision hit points land close enough to the surface for the sign tests
+    // of the intersection routines, so none is needed.
+    static constexpr double RayOffset = 0.0;
+    // Relative and absolute padding of primitive bounds.
+    static constexpr double BoundsPadding = 1e-9;
+};
+
+template <>
+struct RealTraits<float>
+{
+    static constexpr const char* Name = "float";
+    static constexpr float FarAway = 1000000.0f;
+    // Float hit points can land an ulp or two inside the surface, where
+    // grazing shadow and reflection rays hit the surface they start on. Four
+    // ulps clear that without visibly shifting the shading.
+    static constexpr float RayOffset = 4 * std::numeric_limits<float>::epsilon();
+    static constexpr float BoundsPadding = 1e-5f;
+};
+
+template <typename Real>
+constexpr Real FarAway = RealTraits<Real>::FarAway;
 
-const double FarAway = 1000000.0;
 using UInt8 = unsigned char;
 
 struct RgbColor
@@ -14,448 +108,7677 @@ struct RgbColor
     UInt8 b, g, r, a;
 };
 
+// A pixel of linear radiance as traced, before exposure and quantization.
+// It has the layout of a PFM pixel, so float frames are written as they are.
+// A double radiance rounded to float can land one 8-bit level off.
+struct LinearRgb
+{
+    float r, g, b;
+};
+static_assert(sizeof(LinearRgb) == 3 * sizeof(float), "rows of LinearRgb are read as packed floats");
+
+// Scales a linear channel by scale, which is 255 times the exposure, clamps
+// it to [0, 255] and truncates it; NaN becomes 0. The SIMD conversions of
+// whole rows compute exactly this.
+inline UInt8 QuantizeChannel(float c, float scale)
+{
+    return (UInt8)(int)std::min(std::max(0.0f, c * scale), 255.0f);
+}
+
+inline RgbColor QuantizePixel(const LinearRgb& c, float scale)
+{
+    return RgbColor{ QuantizeChannel(c.b, scale), QuantizeChannel(c.g, scale), QuantizeChannel(c.r, scale), 255 };
+}
+
+// Ray statistics, compiled in with -DRAYTRACER_STATS. Each thread counts into
+// its own RayStats, so the hot paths take no atomics; the per-thread counts
+// are merged after the frame. Without the define every counting call below
+// compiles to nothing.
+#if defined(RAYTRACER_STATS)
+const bool StatsEnabled = true;
+#else
+const bool StatsEnabled = false;
+#endif
+
+enum RayKind
+{
+    PrimaryRay,
+    ReflectionRay,
+    ShadowRay,
+    RayKindCount
+};
+
+enum TestKind
+{
+    PlaneTest,
+    SphereTest,
+    BoxTest,
+    CellTest,  // grid cells walked
+    TestKindCount
+};
+
+// Rays deeper than this are counted in the last depth slot.
+const int StatsDepthCount = 8;
+
+struct TileTime
+{
+    int x0, y0, x1, y1;
+    double ms;
+};
+
+struct RayStats
+{
+    uint64_t rays[RayKindCount][StatsDepthCount] = {};
+    uint64_t hits[RayKindCount] = {};  // closest hit found, or shadow ray blocked
+    uint64_t tests[TestKindCount] = {};
+    std::vector<TileTime> tiles;
+
+    uint64_t Rays(int kind) const
+    {
+        uint64_t total = 0;
+        for (int depth = 0; depth < StatsDepthCount; ++depth) total += rays[kind][depth];
+        return total;
+    }
+
+    uint64_t TotalRays() const
+    {
+        return Rays(PrimaryRay) + Rays(ReflectionRay) + Rays(ShadowRay);
+    }
+
+    uint64_t TotalTests() const
+    {
+        return tests[PlaneTest] + tests[SphereTest] + tests[BoxTest] + tests[CellTest];
+    }
+
+    void Add(const RayStats& other)
+    {
+        for (int kind = 0; kind < RayKindCount; ++kind) {
+            for (int depth = 0; depth < StatsDepthCount; ++depth) rays[kind][depth] += other.rays[kind][depth];
+            hits[kind] += other.hits[kind];
+        }
+        for (int kind = 0; kind < TestKindCount; ++kind) tests[kind] += other.tests[kind];
+        tiles.insert(tiles.end(), other.tiles.begin(), other.tiles.end());
+    }
+};
+
+// Owns the RayStats of every thread that has counted anything. Reset and
+// Threads must only be called while no thread is rendering.
+class RayStatsRegistry
+{
+    static std::mutex mutex;
+    static std::vector<std::unique_ptr<RayStats>> threads;
+
+public:
+    static RayStats& Local()
+    {
+        thread_local RayStats* local = nullptr;
+        if (!local) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::make_unique<RayStats>());
+            local = threads.back().get();
+        }
+        return *local;
+    }
+
+    static void Reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& stats : threads) *stats = RayStats();
+    }
+
+    static const std::vector<std::unique_ptr<RayStats>>& Threads() { return threads; }
+};
+
+std::mutex RayStatsRegistry::mutex;
+std::vector<std::unique_ptr<RayStats>> RayStatsRegistry::threads;
+
+inline void CountRay(RayKind kind, int depth, bool hit)
+{
+    if constexpr (StatsEnabled) {
+        RayStats& stats = RayStatsRegistry::Local();
+        ++stats.rays[kind][std::min(depth, StatsDepthCount - 1)];
+        if (hit) ++stats.hits[kind];
+    }
+}
+
+inline void CountTests(TestKind kind, uint64_t count = 1)
+{
+    if constexpr (StatsEnabled) {
+        RayStatsRegistry::Local().tests[kind] += count;
+    }
+}
+
+// Records the wall time of a tile from construction to destruction.
+class TileTimer
+{
+    std::chrono::steady_clock::time_point start;
+    TileTime tile;
+
+public:
+    TileTimer(int x0, int y0, int x1, int y1) : tile{ x0, y0, x1, y1, 0.0 }
+    {
+        if constexpr (StatsEnabled) start = std::chrono::steady_clock::now();
+    }
+
+    ~TileTimer()
+    {
+        if constexpr (StatsEnabled) {
+            tile.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            RayStatsRegistry::Local().tiles.push_back(tile);
+        }
+    }
+
+    TileTimer(const TileTimer&) = delete;
+    TileTimer& operator=(const TileTimer&) = delete;
+};
+
+template <typename Real>
 struct Vector
 {
-    double x, y, z;
+    Real x, y, z;
 
     Vector() : x(0), y(0), z(0) {}
 
-    Vector(double x, double y, double z) : x(x), y(y), z(z) { }
+    Vector(Real x, Real y, Real z) : x(x), y(y), z(z) { }
 
-    double Length() const
+    template <typename Other>
+    explicit Vector(const Vector<Other>& v) : x((Real)v.x), y((Real)v.y), z((Real)v.z) { }
+
+    Real operator[](int axis) const
+    {
+        return (axis == 0) ? x : ((axis == 1) ? y : z);
+    }
+
+    Real Length() const
     {
-        return sqrt(x * x + y * y + z * z);
+        return std::sqrt(x * x + y * y + z * z);
     }
 
-    Vector Norm() const
+    Vector<Real> Norm() const
     {
-        double mag = Length();
-        double div = (mag == 0) ? FarAway : 1.0 / mag;
+        Real mag = Length();
+        Real div = (mag == 0) ? FarAway<Real> : Real(1) / mag;
         return *this * div;
     }
 
-    Vector Cross(const Vector& v) const
+    Vector<Real> Cross(const Vector<Real>& v) const
     {
-        return Vector(
+        return Vector<Real>(
             y * v.z - z * v.y,
             z * v.x - x * v.z,
             x * v.y - y * v.x
         );
     }
 
-    Vector operator*(double k) const
+    Vector<Real> operator*(Real k) const
     {
-        return Vector(k * x, k * y, k * z);
+        return Vector<Real>(k * x, k * y, k * z);
     }
 
-    double operator*(const Vector& v) const
+    Real operator*(const Vector<Real>& v) const
     {
         return x * v.x + y * v.y + z * v.z;
     }
 
-    Vector operator+(const Vector& v) const
+    Vector<Real> operator+(const Vector<Real>& v) const
     {
-        return Vector(x + v.x, y + v.y, z + v.z);
+        return Vector<Real>(x + v.x, y + v.y, z + v.z);
     }
 
-    Vector operator-(const Vector& v) const
+    Vector<Real> operator-(const Vector<Real>& v) const
     {
-        return Vector(x - v.x, y - v.y, z - v.z);
+        return Vector<Real>(x - v.x, y - v.y, z - v.z);
     }
 };
 
+template <typename Real>
 struct Color
 {
-    double r, g, b;
+    Real r, g, b;
 
-    static Color White;
-    static Color Grey;
-    static Color Black;
-    static Color Background;
-    static Color DefaultColor;
+    static Color<Real> White;
+    static Color<Real> Grey;
+    static Color<Real> Black;
+    static Color<Real> Background;
+    static Color<Real> DefaultColor;
 
     Color() : r(0.0), g(0.0), b(0.0) {}
 
-    Color(double r, double g, double b) : r(r), g(g), b(b) { }
+    Color(Real r, Real g, Real b) : r(r), g(g), b(b) { }
 
-    Color Scale(double k) const
-    {
-        return Color(k * r, k * g, k * b);
-    }
+    template <typename Other>
+    explicit Color(const Color<Other>& c) : r((Real)c.r), g((Real)c.g), b((Real)c.b) { }
 
-    Color operator * (const Color& c) const
+    Color<Real> Scale(Real k) const
     {
-        return Color(r * c.r, g * c.g, b * c.b);
+        return Color<Real>(k * r, k * g, k * b);
     }
 
-    Color operator + (const Color& c) const
+    Color<Real> operator * (const Color<Real>& c) const
     {
-        return Color(r + c.r, g + c.g, b + c.b);
+        return Color<Real>(r * c.r, g * c.g, b * c.b);
     }
 
-    RgbColor ToDrawingColor() const
+    Color<Real> operator + (const Color<Real>& c) const
     {
-        return RgbColor{ Clamp(b), Clamp(g), Clamp(r), 255 };
+        return Color<Real>(r + c.r, g + c.g, b + c.b);
     }
 
-    static UInt8 Clamp(double c)
+    LinearRgb ToLinear() const
     {
-        int x = (int)(c * 255);
-        if (x < 0)   x = 0;
-        if (x > 255) x = 255;
-        return (UInt8)x;
+        return LinearRgb{ (float)r, (float)g, (float)b };
     }
 };
 
-Color Color::White = Color(1.0, 1.0, 1.0);
-Color Color::Grey = Color(0.5, 0.5, 0.5);
-Color Color::Black = Color(0.0, 0.0, 0.0);
-Color Color::Background = Color::Black;
-Color Color::DefaultColor = Color::Black;
+template <typename Real> Color<Real> Color<Real>::White = Color<Real>(1.0, 1.0, 1.0);
+template <typename Real> Color<Real> Color<Real>::Grey = Color<Real>(0.5, 0.5, 0.5);
+template <typename Real> Color<Real> Color<Real>::Black = Color<Real>(0.0, 0.0, 0.0);
+template <typename Real> Color<Real> Color<Real>::Background = Color<Real>(0.0, 0.0, 0.0);
+template <typename Real> Color<Real> Color<Real>::DefaultColor = Color<Real>(0.0, 0.0, 0.0);
 
+template <typename Real>
 struct Camera
 {
-    Vector forward;
-    Vector right;
-    Vector up;
-    Vector pos;
+    Vector<Real> forward;
+    Vector<Real> right;
+    Vector<Real> up;
+    Vector<Real> pos;
 
     Camera() {}
-    Camera(Vector pos, Vector lookAt)
+    Camera(Vector<Real> pos, Vector<Real> lookAt)
     {
-        Vector Down = Vector(0.0, -1.0, 0.0);
-        Vector Forward = lookAt - pos;
+        Vector<Real> Down = Vector<Real>(0.0, -1.0, 0.0);
+        Vector<Real> Forward = lookAt - pos;
         this->pos = pos;
         this->forward = Forward.Norm();
         this->right = this->forward.Cross(Down).Norm() * 1.5;
         this->up = this->forward.Cross(this->right).Norm() * 1.5;
     }
 
-    Vector GetPoint(int x, int y, int screenWidth, int screenHeight) const
+    // Cameras are set up in double and rounded to the tracing precision.
+    template <typename Other>
+    explicit Camera(const Camera<Other>& other) :
+        forward(other.forward), right(other.right), up(other.up), pos(other.pos)
+    {}
+
+    // Takes fractional pixel coordinates for sub-pixel samples; integer
+    // coordinates give the usual one-ray-per-pixel directions.
+    Vector<Real> GetPoint(Real x, Real y, int screenWidth, int screenHeight) const
     {
-        double recenterX = (x - (screenWidth / 2.0)) / 2.0 / screenWidth;
-        double recenterY = -(y - (screenHeight / 2.0)) / 2.0 / screenHeight;
+        Real recenterX = (x - (screenWidth / Real(2))) / Real(2) / screenWidth;
+        Real recenterY = -(y - (screenHeight / Real(2))) / Real(2) / screenHeight;
         return (this->forward + ((this->right * recenterX) + (this->up * recenterY))).Norm();
     }
 };
 
+template <typename Real>
 struct Ray
 {
-    Vector start;
-    Vector dir;
+    Vector<Real> start;
+    Vector<Real> dir;
+
+    Ray(Vector<Real> start, Vector<Real> dir) : start(start), dir(dir) { }
+};
+
+// Axis-aligned box used by the acceleration structures.
+template <typename Real>
+struct BoundingBox
+{
+    Vector<Real> min;
+    Vector<Real> max;
+
+    BoundingBox() :
+        min(FarAway<Real>, FarAway<Real>, FarAway<Real>),
+        max(-FarAway<Real>, -FarAway<Real>, -FarAway<Real>)
+    {}
+
+    BoundingBox(Vector<Real> min, Vector<Real> max) : min(min), max(max) {}
+
+    void Extend(const Vector<Real>& p)
+    {
+        min = Vector<Real>(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+        max = Vector<Real>(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+    }
+
+    // An empty box leaves this one as it is.
+    void Extend(const BoundingBox<Real>& box)
+    {
+        if (box.min.x > box.max.x) return;
+        Extend(box.min);
+        Extend(box.max);
+    }
+
+    Vector<Real> Center() const
+    {
+        return (min + max) * 0.5;
+    }
+
+    // Surface area, for the cost estimates of the BVH build.
+    Real Area() const
+    {
+        Vector<Real> size = max - min;
+        return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    int LongestAxis() const
+    {
+        Vector<Real> size = max - min;
+        if (size.x >= size.y && size.x >= size.z) return 0;
+        return (size.y >= size.z) ? 1 : 2;
+    }
+
+    // Slab test. Returns the entry distance, which is negative when the ray
+    // starts inside the box, or FarAway when the box is missed or lies
+    // entirely behind the ray or beyond maxDist.
+    Real Intersect(const Ray<Real>& ray, const Vector<Real>& invDir, Real maxDist) const
+    {
+        Real t0 = (min.x - ray.start.x) * invDir.x;
+        Real t1 = (max.x - ray.start.x) * invDir.x;
+        Real tNear = std::min(t0, t1);
+        Real tFar = std::max(t0, t1);
 
-    Ray(Vector start, Vector dir) : start(start), dir(dir) { }
+        t0 = (min.y - ray.start.y) * invDir.y;
+        t1 = (max.y - ray.start.y) * invDir.y;
+        tNear = std::max(tNear, std::min(t0, t1));
+        tFar = std::min(tFar, std::max(t0, t1));
+
+        t0 = (min.z - ray.start.z) * invDir.z;
+        t1 = (max.z - ray.start.z) * invDir.z;
+        tNear = std::max(tNear, std::min(t0, t1));
+        tFar = std::min(tFar, std::max(t0, t1));
+
+        if (tNear > tFar || tFar < 0.0 || tNear > maxDist) return FarAway<Real>;
+        return tNear;
+    }
 };
 
+template <typename Real>
 struct Thing;
+template <typename Real>
+class ScenePools;
 
+// Closest hit of a ray in the object layout. The ray stays with the caller;
+// position, normal and surface are derived from it once, when shading.
+template <typename Real>
 struct Intersection
 {
-    const Thing* thing;
-    Ray ray;
-    double dist;
-
-    Intersection(const Thing* thing, Ray ray, double dist) :
-        thing(thing), ray(ray), dist(dist)
-    {}
+    Real dist;
+    int part;  // which primitive of a thing made of several, such as an instance
+    const Thing<Real>* thing;
 };
 
+template <typename Real>
 struct SurfacePropreties
 {
-    Color Diffuse;
-    Color Specular;
-    double Reflect = 0.0;
-    double Roughness = 0.0;
+    Color<Real> Diffuse;
+    Color<Real> Specular;
+    Real Reflect = 0.0;
+    Real Roughness = 0.0;
 
     SurfacePropreties() {}
-    SurfacePropreties(Color diffuse, Color specular, double reflect, double roughness) :
+    SurfacePropreties(Color<Real> diffuse, Color<Real> specular, Real reflect, Real roughness) :
         Diffuse(diffuse), Specular(specular), Reflect(reflect), Roughness(roughness)
     {}
 };
 
+// Materials a scene file can name. Each kind is a Material specialization,
+// so a new procedural material is a new kind plus its Evaluate.
+enum class MaterialKind : uint32_t
+{
+    Shiny,
+    Checkerboard,
+    Count
+};
+
+template <typename Real>
 struct Surface
 {
-    virtual SurfacePropreties GetSurfaceProperties(const Vector& pos) const = 0;
+    virtual SurfacePropreties<Real> GetSurfaceProperties(const Vector<Real>& pos) const = 0;
+    virtual MaterialKind GetKind() const = 0;
+};
+
+// Shading of each material kind, without virtual calls, for code that
+// dispatches on MaterialKind itself.
+template <typename Real, MaterialKind Kind>
+struct Material;
+
+template <typename Real>
+struct Material<Real, MaterialKind::Shiny>
+{
+    static SurfacePropreties<Real> Evaluate(const Vector<Real>&)
+    {
+        return SurfacePropreties<Real>(Color<Real>::White, Color<Real>::Grey, 0.7, 250.0);
+    }
+};
+
+// Squares alternate on the parity of floor(x) + floor(z). Truncation is
+// floor for non-negative values and one too high for negative non-integers.
+template <typename Real>
+struct Material<Real, MaterialKind::Checkerboard>
+{
+    static int FloorToInt(Real v)
+    {
+        int i = (int)v;
+        return i - (v < (Real)i);
+    }
+
+    static SurfacePropreties<Real> Evaluate(const Vector<Real>& pos)
+    {
+        if ((FloorToInt(pos.z) ^ FloorToInt(pos.x)) & 1) {
+            return SurfacePropreties<Real>(Color<Real>::White, Color<Real>::White, 0.1, 150.0);
+        }
+        return SurfacePropreties<Real>(Color<Real>::Black, Color<Real>::White, 0.7, 150.0);
+    }
 };
 
+template <typename Real>
+SurfacePropreties<Real> EvaluateMaterial(MaterialKind kind, const Vector<Real>& pos)
+{
+    switch (kind) {
+    case MaterialKind::Checkerboard: return Material<Real, MaterialKind::Checkerboard>::Evaluate(pos);
+    default: return Material<Real, MaterialKind::Shiny>::Evaluate(pos);
+    }
+}
+
+template <typename Real>
 struct Light
 {
-    Vector pos;
-    Color color;
-    Light(Vector pos, Color color) : pos(pos), color(color) { }
+    Vector<Real> pos;
+    Color<Real> color;
+    Light(Vector<Real> pos, Color<Real> color) : pos(pos), color(color) { }
 };
 
+template <typename Real>
 struct Thing
 {
-    virtual Vector GetNormal(const Vector& pos) const = 0;
-    virtual std::optional<Intersection> GetIntersection(const Ray& ray) const = 0;
-    virtual Surface& GetSurface() const = 0;
-    virtual ~Thing() = default;
+    // True if the ray hits the thing; dist is then the distance along it.
+    virtual bool Intersect(const Ray<Real>& ray, Real& dist) const = 0;
+    // Makes hit this thing if the ray hits it closer than hit.dist.
+    virtual void IntersectCloser(const Ray<Real>& ray, Intersection<Real>& hit) const = 0;
+    // True if the ray hits the thing no further than maxDist.
+    virtual bool IsOccluded(const Ray<Real>& ray, Real maxDist) const = 0;
+    // Normal and surface at pos, the point of a hit IntersectCloser recorded.
+    virtual void Describe(const Intersection<Real>& hit, const Vector<Real>& pos, Vector<Real>& normal, SurfacePropreties<Real>& surface) const = 0;
+    // Returns false for unbounded things, which are tested outside the BVH.
+    virtual bool GetBounds(BoundingBox<Real>&) const { return false; }
+    // Appends the thing to the structure-of-arrays pools; false if the pools
+    // have no representation for it.
+    virtual bool AddTo(ScenePools<Real>&) const { return false; }
+    virtual ~Thing<Real>() = default;
 };
 
-class Sphere : public Thing {
-    Surface& surface;
-    Vector   center;
-    double   radius2;
+template <typename Real>
+class Sphere : public Thing<Real> {
+    Surface<Real>& surface;
+    Vector<Real>   center;
+    Real   radius2;
 public:
-    Sphere(Vector center, double radius, Surface& surface) : surface(surface), center(center), radius2(radius* radius) {}
+    Sphere(Vector<Real> center, Real radius, Surface<Real>& surface) : surface(surface), center(center), radius2(radius* radius) {}
+
+    const Vector<Real>& Center() const { return center; }
+    Real Radius2() const { return radius2; }
 
-    Vector GetNormal(const Vector& pos) const override {
+    Vector<Real> GetNormal(const Vector<Real>& pos) const {
         return (pos - center).Norm();
     }
 
-    std::optional<Intersection> GetIntersection(const Ray& ray) const override {
-        Vector eo = center - ray.start;
-        double v = eo * ray.dir;
+    void SetCenter(const Vector<Real>& position) { center = position; }
+
+    bool Intersect(const Ray<Real>& ray, Real& dist) const override {
+        CountTests(SphereTest);
+        Vector<Real> eo = center - ray.start;
+        Real v = eo * ray.dir;
         if (v >= 0.0) {
-            double disc = radius2 - ((eo * eo) - (v * v));
+            Real disc = radius2 - ((eo * eo) - (v * v));
             if (disc >= 0.0) {
-                double dist = v - sqrt(disc);
-                return Intersection(this, ray, dist);
+                dist = v - std::sqrt(disc);
+                return true;
             }
         }
-        return std::nullopt;
+        return false;
+    }
+
+    void IntersectCloser(const Ray<Real>& ray, Intersection<Real>& hit) const override {
+        Real dist;
+        if (Sphere::Intersect(ray, dist) && dist < hit.dist) hit = Intersection<Real>{ dist, 0, this };
+    }
+
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist) const override {
+        CountTests(SphereTest);
+        Vector<Real> eo = center - ray.start;
+        Real v = eo * ray.dir;
+        if (v < 0.0) return false;
+        Real disc = radius2 - ((eo * eo) - (v * v));
+        return disc >= 0.0 && v - std::sqrt(disc) <= maxDist;
+    }
+
+    Surface<Real>& GetSurface() const { return surface; };
+
+    void Describe(const Intersection<Real>&, const Vector<Real>& pos, Vector<Real>& normal, SurfacePropreties<Real>& properties) const override {
+        normal = GetNormal(pos);
+        properties = surface.GetSurfaceProperties(pos);
     }
 
-    Surface& GetSurface() const override { return surface; };
+    bool GetBounds(BoundingBox<Real>& box) const override {
+        // Padded so a ray starting on the surface is never culled by the box.
+        Real r = std::sqrt(radius2) * (1 + RealTraits<Real>::BoundsPadding) + RealTraits<Real>::BoundsPadding;
+        box = BoundingBox<Real>(center - Vector<Real>(r, r, r), center + Vector<Real>(r, r, r));
+        return true;
+    }
+
+    bool AddTo(ScenePools<Real>& pools) const override;
 };
 
-class Plane : public Thing {
-    Surface& surface;
-    Vector   normal;
-    double   offset;
+template <typename Real>
+class Plane : public Thing<Real> {
+    Surface<Real>& surface;
+    Vector<Real>   normal;
+    Real   offset;
 public:
-    Plane(Vector normal, double offset, Surface& surface) : surface(surface), normal(normal), offset(offset) {}
+    Plane(Vector<Real> normal, Real offset, Surface<Real>& surface) : surface(surface), normal(normal), offset(offset) {}
 
-    Vector GetNormal(const Vector& pos) const override {
+    const Vector<Real>& Normal() const { return normal; }
+    Real Offset() const { return offset; }
+
+    Vector<Real> GetNormal(const Vector<Real>& pos) const {
         return normal;
     }
 
-    std::optional<Intersection> GetIntersection(const Ray& ray) const override {
-        double denom = normal * ray.dir;
+    bool Intersect(const Ray<Real>& ray, Real& dist) const override {
+        CountTests(PlaneTest);
+        Real denom = normal * ray.dir;
         if (denom > 0.0) {
-            return std::nullopt;
+            return false;
         }
-        double dist = ((normal * ray.start) + offset) / (-denom);
-        return Intersection(this, ray, dist);
+        dist = ((normal * ray.start) + offset) / (-denom);
+        return true;
+    }
+
+    void IntersectCloser(const Ray<Real>& ray, Intersection<Real>& hit) const override {
+        Real dist;
+        if (Plane::Intersect(ray, dist) && dist < hit.dist) hit = Intersection<Real>{ dist, 0, this };
+    }
+
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist) const override {
+        CountTests(PlaneTest);
+        Real denom = normal * ray.dir;
+        return !(denom > 0.0) && ((normal * ray.start) + offset) / (-denom) <= maxDist;
+    }
+
+    Surface<Real>& GetSurface() const { return surface; };
+
+    void Describe(const Intersection<Real>&, const Vector<Real>& pos, Vector<Real>& normal, SurfacePropreties<Real>& properties) const override {
+        normal = GetNormal(pos);
+        properties = surface.GetSurfaceProperties(pos);
     }
 
-    Surface& GetSurface() const override { return surface; };
+    bool AddTo(ScenePools<Real>& pools) const override;
 };
 
-struct ShinySurface : public Surface
+// The virtual face of a Material, for things in the object layout.
+template <typename Real, MaterialKind Kind>
+struct MaterialSurface : public Surface<Real>
 {
-    SurfacePropreties GetSurfaceProperties(const Vector& pos) const override
+    SurfacePropreties<Real> GetSurfaceProperties(const Vector<Real>& pos) const override
     {
-        return SurfacePropreties(Color::White, Color::Grey, 0.7, 250.0);
+        return Material<Real, Kind>::Evaluate(pos);
     }
+
+    MaterialKind GetKind() const override { return Kind; }
 };
 
-struct CheckerboardSurface : public Surface
+template <typename Real>
+using ShinySurface = MaterialSurface<Real, MaterialKind::Shiny>;
+
+template <typename Real>
+using CheckerboardSurface = MaterialSurface<Real, MaterialKind::Checkerboard>;
+
+// Array that either owns its elements or views memory owned elsewhere, such
+// as a mapped scene file. Reads go through one pointer either way.
+template <typename T>
+class PoolArray
 {
-    SurfacePropreties GetSurfaceProperties(const Vector& pos) const override
+    std::vector<T> owned;
+    T* items = nullptr;
+    size_t count = 0;
+
+    void Rebind()
     {
-        Color diffuse = Color::Black;
-        double reflect = 0.7;
-        if (((int)(floor(pos.z) + floor(pos.x))) % 2 != 0)
-        {
-            diffuse = Color::White;
-            reflect = 0.1;
-        }
-        return SurfacePropreties(diffuse, Color::White, reflect, 150.0);
+        items = owned.data();
+        count = owned.size();
     }
-};
 
-class Scene {
-private:
-    ShinySurface        shiny;
-    CheckerboardSurface checkerboard;
 public:
-    std::vector<std::unique_ptr<Thing>> things;
-    std::vector<Light> lights;
-    Camera    camera;
+    PoolArray() {}
+    PoolArray(const PoolArray& other) : owned(other.owned), items(other.items), count(other.count)
+    {
+        if (other.Owning()) Rebind();
+    }
+    PoolArray(PoolArray&& other) noexcept : owned(std::move(other.owned)), items(other.items), count(other.count)
+    {
+        other.items = nullptr;
+        other.count = 0;
+    }
+    PoolArray& operator=(PoolArray other) noexcept
+    {
+        owned.swap(other.owned);
+        std::swap(items, other.items);
+        std::swap(count, other.count);
+        return *this;
+    }
 
-    Scene()
+    bool Owning() const { return items == owned.data(); }
+
+    // Drops owned elements and reads count elements from data instead.
+    void View(const T* data, size_t n)
+    {
+        owned.clear();
+        owned.shrink_to_fit();
+        items = const_cast<T*>(data);
+        count = n;
+    }
+
+    void push_back(const T& value)
+    {
+        owned.push_back(value);
+        Rebind();
+    }
+
+    void reserve(size_t n)
     {
-        things.push_back(std::make_unique<Plane>(Vector(0.0, 1.0, 0.0), 0.0, checkerboard));
-        things.push_back(std::make_unique<Sphere>(Vector(0.0, 1.0, -0.25), 1.0, shiny));
-        things.push_back(std::make_unique<Sphere>(Vector(-1.0, 0.5, 1.5), 0.5, shiny));
+        owned.reserve(n);
+        Rebind();
+    }
 
-        lights.push_back(Light(Vector(-2.0, 2.5, 0.0), Color(0.49, 0.07, 0.07)));
-        lights.push_back(Light(Vector(1.5, 2.5, 1.5), Color(0.07, 0.07, 0.49)));
-        lights.push_back(Light(Vector(1.5, 2.5, -1.5), Color(0.07, 0.49, 0.071)));
-        lights.push_back(Light(Vector(0.0, 3.5, 0.0), Color(0.21, 0.21, 0.35)));
-        camera = Camera(Vector(3.0, 2.0, 4.0), Vector(-1.0, 0.5, 0.0));
+    void clear()
+    {
+        owned.clear();
+        Rebind();
     }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* data() const { return items; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+
+    const T& operator[](size_t i) const { return items[i]; }
+    // Only for arrays being built, never for views.
+    T& operator[](size_t i) { return items[i]; }
 };
 
-class RayTracerEngine
+class ThreadPool;
+
+template <typename Real>
+class BvhBuilder;
+
+// How a BVH build splits its ranges. Median builds fastest; the surface area
+// heuristic builds several times slower and pays off on uneven scenes.
+enum class BvhSplit
 {
-    static const int maxDepth = 5;
-    Scene& scene;
+    Median,
+    Sah
+};
+
+const char* BvhSplitName(BvhSplit split)
+{
+    return (split == BvhSplit::Sah) ? "sah" : "median";
+}
 
-    std::optional<Intersection> GetClosestIntersection(const Ray& ray)
+// Bounding volume hierarchy over a list of primitive boxes. Nodes are
+// stored depth-first, so the left child of an interior node directly follows
+// it and only the right child index is kept. Leaves cover ranges of leaf
+// slots; Order maps each slot back to the primitive it holds, so owners
+// store their primitives in leaf order and test a leaf range directly.
+template <typename Real>
+class Bvh
+{
+public:
+    struct Node
     {
-        double closest = FarAway;
-        std::optional<Intersection> closestInter = std::nullopt;
+        BoundingBox<Real> box;
+        int start;  // first leaf slot (leaf) or right child (interior)
+        int count;  // number of primitives, 0 for interior nodes
+    };
 
-        for (auto& thing : scene.things)
-        {
-            auto inter = thing->GetIntersection(ray);
-            if (inter && inter->dist < closest) {
-                closestInter = inter;
-                closest = inter->dist;
+    // Traversal stacks are sized for this depth.
+    static const int MaxDepth = 60;
+
+private:
+    friend class BvhBuilder<Real>;
+
+    PoolArray<Node> nodes;
+    PoolArray<int> order;
+
+public:
+    // Defined with BvhBuilder. With a pool of several threads the top levels
+    // split in parallel and the subtrees below are built as tasks; the tree
+    // is the same for any number of threads. No leaf is deeper than
+    // MaxDepth.
+    void Build(const std::vector<BoundingBox<Real>>& boxes, ThreadPool* pool = nullptr, BvhSplit split = BvhSplit::Median);
+
+    // Recomputes every box bottom-up for primitives that moved, keeping the
+    // topology. slotBoxes holds the new box of the primitive in each leaf
+    // slot, that is of primitive Order()[slot].
+    void Refit(const std::vector<BoundingBox<Real>>& slotBoxes)
+    {
+        for (int i = (int)nodes.size() - 1; i >= 0; --i) {
+            Node& node = nodes[i];
+            BoundingBox<Real> box;
+            if (node.count > 0) {
+                for (int slot = node.start; slot < node.start + node.count; ++slot) box.Extend(slotBoxes[slot]);
+            } else {
+                box = nodes[i + 1].box;
+                box.Extend(nodes[node.start].box);
             }
+            node.box = box;
         }
-        return closestInter;
     }
 
-    Color TraceRay(const Ray& ray, int depth)
+    bool Empty() const { return nodes.empty(); }
+
+    size_t NodeCount() const { return nodes.size(); }
+
+    const PoolArray<Node>& Nodes() const { return nodes; }
+
+    const PoolArray<int>& Order() const { return order; }
+
+    // Uses nodes stored elsewhere, e.g. in a mapped scene file. The leaf
+    // order is not kept: the owner already stores primitives in that order.
+    void View(const Node* data, size_t count)
+    {
+        nodes.View(data, count);
+        order.clear();
+    }
+
+    // Closest-hit traversal. Children are visited nearest first and boxes
+    // further away than closest are skipped. leaf(start, count) tests a range
+    // of leaf slots and lowers closest when it finds a nearer hit.
+    template <typename LeafTest>
+    void Intersect(const Ray<Real>& ray, const Real& closest, LeafTest&& leaf) const
     {
-        auto isect = GetClosestIntersection(ray);
-        if (isect) {
-            return Shade(*isect, depth);
+        if (nodes.empty()) return;
+
+        Vector<Real> invDir(Real(1) / ray.dir.x, Real(1) / ray.dir.y, Real(1) / ray.dir.z);
+        struct Entry { int node; Real dist; };
+        Entry stack[64];
+        int top = 0;
+
+        Real rootDist = nodes[0].box.Intersect(ray, invDir, closest);
+        CountTests(BoxTest);
+        if (rootDist == FarAway<Real>) return;
+        stack[top++] = Entry{ 0, rootDist };
+
+        while (top > 0) {
+            Entry entry = stack[--top];
+            if (entry.dist > closest) continue;
+
+            const Node& node = nodes[entry.node];
+            if (node.count > 0) {
+                leaf(node.start, node.count);
+                continue;
+            }
+
+            int left = entry.node + 1;
+            int right = node.start;
+            Real leftDist = nodes[left].box.Intersect(ray, invDir, closest);
+            Real rightDist = nodes[right].box.Intersect(ray, invDir, closest);
+            CountTests(BoxTest, 2);
+            if (leftDist > rightDist) {
+                std::swap(left, right);
+                std::swap(leftDist, rightDist);
+            }
+            if (rightDist != FarAway<Real>) stack[top++] = Entry{ right, rightDist };
+            if (leftDist != FarAway<Real>) stack[top++] = Entry{ left, leftDist };
         }
-        return Color::Background;
     }
 
-    Color Shade(const Intersection& isect, int depth)
+    // Any-hit traversal for shadow rays: no ordering, and it stops as soon
+    // as leaf(start, count) reports a hit within maxDist.
+    template <typename LeafTest>
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist, LeafTest&& leaf) const
     {
-        Vector d = isect.ray.dir;
-        Vector pos = (d * isect.dist) + isect.ray.start;
-        Vector normal = isect.thing->GetNormal(pos);
-        Vector reflectDir = (d - ((normal * (normal * d)) * 2)).Norm();
+        if (nodes.empty()) return false;
 
-        SurfacePropreties surface = isect.thing->GetSurface().GetSurfaceProperties(pos);
+        Vector<Real> invDir(Real(1) / ray.dir.x, Real(1) / ray.dir.y, Real(1) / ray.dir.z);
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
 
-        Color naturalColor = Color::Background + GetNaturalColor(surface, pos, normal, reflectDir);
-        Color reflectedColor = (depth >= maxDepth) ? Color::Grey : GetReflectionColor(surface, pos, reflectDir, depth);
+        while (top > 0) {
+            int index = stack[--top];
+            const Node& node = nodes[index];
+            CountTests(BoxTest);
+            if (node.box.Intersect(ray, invDir, maxDist) == FarAway<Real>) continue;
 
-        return naturalColor + reflectedColor;
+            if (node.count > 0) {
+                if (leaf(node.start, node.count)) return true;
+                continue;
+            }
+            stack[top++] = node.start;
+            stack[top++] = index + 1;
+        }
+        return false;
+    }
+};
+
+// Uniform grid over a list of primitive boxes, for dense, even scenes where
+// it builds much faster than a Bvh. Each cell lists the primitives whose
+// boxes overlap it, so a primitive spanning several cells is listed in each.
+// Rays walk the cells they pass through front to back (3D-DDA).
+template <typename Real>
+class UniformGrid
+{
+    // Cells per primitive the resolution aims for.
+    static constexpr double cellsPerPrimitive = 2.0;
+    static const int maxCellsPerAxis = 512;
+
+    BoundingBox<Real> bounds;
+    Vector<Real> cellSize;
+    int dims[3] = { 0, 0, 0 };
+    std::vector<int> cellStart;  // cell c lists items[cellStart[c]] up to items[cellStart[c + 1]]
+    std::vector<int> items;
+
+    void CellRange(const BoundingBox<Real>& box, int lo[3], int hi[3]) const
+    {
+        for (int axis = 0; axis < 3; ++axis) {
+            lo[axis] = CellOf(box.min[axis], axis);
+            hi[axis] = CellOf(box.max[axis], axis);
+        }
     }
 
-    Color GetReflectionColor(const SurfacePropreties& surface, const Vector& pos, const Vector& reflectDir, int depth)
+    int CellOf(Real x, int axis) const
     {
-        Ray    ray(pos, reflectDir);
-        Color  color = TraceRay(ray, depth + 1);
-        return color.Scale(surface.Reflect);
+        int cell = (int)((x - bounds.min[axis]) / cellSize[axis]);
+        return std::min(std::max(cell, 0), dims[axis] - 1);
     }
 
-    Color GetNaturalColor(const SurfacePropreties& surface, const Vector& pos, const Vector& norm, const Vector& reflectDir)
+    int CellIndex(int x, int y, int z) const
     {
-        Color result = Color::Black;
-        for (auto& light : scene.lights)
-        {
-            Vector ldis = light.pos - pos;
-            Vector livec = ldis.Norm();
-            Ray ray{ pos, livec };
+        return (z * dims[1] + y) * dims[0] + x;
+    }
 
-            auto neatIsect = GetClosestIntersection(ray);
-            bool isInShadow = neatIsect.has_value() ? (neatIsect->dist <= ldis.Length()) : false;
+    // Calls cell(begin, end) for every cell the ray passes through, nearest
+    // first, until it returns true or the next cell starts beyond limit.
+    // cell may lower limit as it goes.
+    template <typename CellVisit>
+    void Walk(const Ray<Real>& ray, const Real& limit, CellVisit&& cell) const
+    {
+        if (items.empty()) return;
 
-            if (!isInShadow) {
-                double illum = livec * norm;
-                double specular = livec * reflectDir;
+        Real tEnter = 0;
+        Real tExit = limit;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (ray.dir[axis] == 0) {
+                if (ray.start[axis] < bounds.min[axis] || ray.start[axis] > bounds.max[axis]) return;
+                continue;
+            }
+            Real t0 = (bounds.min[axis] - ray.start[axis]) / ray.dir[axis];
+            Real t1 = (bounds.max[axis] - ray.start[axis]) / ray.dir[axis];
+            tEnter = std::max(tEnter, std::min(t0, t1));
+            tExit = std::min(tExit, std::max(t0, t1));
+        }
+        if (tEnter > tExit) return;
 
-                Color lcolor = (illum > 0) ? (light.color.Scale(illum)) : Color::DefaultColor;
-                Color scolor = (specular > 0) ? (light.color.Scale(pow(specular, surface.Roughness))) : Color::DefaultColor;
-                result = result + lcolor * surface.Diffuse + scolor * surface.Specular;
+        const Real never = std::numeric_limits<Real>::infinity();
+        Vector<Real> entry = ray.start + ray.dir * tEnter;
+        int c[3], step[3], end[3];
+        Real next[3], delta[3];  // distance to the next cell boundary, and between boundaries
+        for (int axis = 0; axis < 3; ++axis) {
+            c[axis] = CellOf(entry[axis], axis);
+            Real dir = ray.dir[axis];
+            if (dir > 0) {
+                step[axis] = 1;
+                end[axis] = dims[axis];
+                next[axis] = (bounds.min[axis] + (c[axis] + 1) * cellSize[axis] - ray.start[axis]) / dir;
+                delta[axis] = cellSize[axis] / dir;
+            } else if (dir < 0) {
+                step[axis] = -1;
+                end[axis] = -1;
+                next[axis] = (bounds.min[axis] + c[axis] * cellSize[axis] - ray.start[axis]) / dir;
+                delta[axis] = -cellSize[axis] / dir;
+            } else {
+                step[axis] = 0;
+                end[axis] = -1;
+                next[axis] = never;
+                delta[axis] = never;
             }
         }
-        return result;
+
+        for (;;) {
+            int index = CellIndex(c[0], c[1], c[2]);
+            CountTests(CellTest);
+            if (cell(items.data() + cellStart[index], items.data() + cellStart[index + 1])) return;
+
+            // A hit no further than the cell's exit lies in a cell already walked.
+            int axis = (next[0] < next[1]) ? ((next[0] < next[2]) ? 0 : 2) : ((next[1] < next[2]) ? 1 : 2);
+            if (next[axis] >= limit || next[axis] > tExit) return;
+            c[axis] += step[axis];
+            if (c[axis] == end[axis]) return;
+            next[axis] += delta[axis];
+        }
     }
 
 public:
-    RayTracerEngine(Scene& scene) : scene(scene) {}
-
-    void render(RgbColor* image, int w, int h)
+    // The resolution follows the primitive count, with cells as close to
+    // cubes as the bounds allow.
+    void Build(const std::vector<BoundingBox<Real>>& boxes)
     {
-        Ray ray(scene.camera.pos, Vector());
-        auto& camera = scene.camera;
-        int pos = 0;
+        cellStart.clear();
+        items.clear();
+        bounds = BoundingBox<Real>();
+        if (boxes.empty()) return;
 
-        for (int y = 0; y < h; ++y) {
-            pos = y * h;
-            for (int x = 0; x < w; ++x) {
-                ray.dir = camera.GetPoint(x, y, w, h);
-                image[pos + x] = TraceRay(ray, 0).ToDrawingColor();
-            }
+        for (auto& box : boxes) bounds.Extend(box);
+        Vector<Real> size = bounds.max - bounds.min;
+        Real longest = std::max(size.x, std::max(size.y, size.z));
+        // Flat scenes still get a sensible volume to spread cells over.
+        Real floor = longest * Real(1e-3) + RealTraits<Real>::BoundsPadding;
+        Vector<Real> extent(std::max(size.x, floor), std::max(size.y, floor), std::max(size.z, floor));
+        double perUnit = std::cbrt(cellsPerPrimitive * boxes.size() / ((double)extent.x * extent.y * extent.z));
+        for (int axis = 0; axis < 3; ++axis) {
+            dims[axis] = std::min(std::max((int)std::ceil(extent[axis] * perUnit), 1), maxCellsPerAxis);
+        }
+        cellSize = Vector<Real>(extent.x / dims[0], extent.y / dims[1], extent.z / dims[2]);
+
+        // Counting sort of the (cell, primitive) pairs by cell.
+        cellStart.assign((size_t)dims[0] * dims[1] * dims[2] + 1, 0);
+        int lo[3], hi[3];
+        for (auto& box : boxes) {
+            CellRange(box, lo, hi);
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x) ++cellStart[CellIndex(x, y, z) + 1];
+        }
+        for (size_t i = 1; i < cellStart.size(); ++i) cellStart[i] += cellStart[i - 1];
+        items.resize(cellStart.back());
+        std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+        for (int i = 0; i < (int)boxes.size(); ++i) {
+            CellRange(boxes[i], lo, hi);
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x) items[fill[CellIndex(x, y, z)]++] = i;
         }
     }
+
+    size_t CellCount() const { return cellStart.empty() ? 0 : cellStart.size() - 1; }
+
+    size_t MemoryBytes() const { return (cellStart.size() + items.size()) * sizeof(int); }
+
+    // Closest-hit walk. cell(begin, end) tests the primitives listed for a
+    // cell and lowers closest when it finds a nearer hit; a primitive in
+    // several cells may be tested more than once.
+    template <typename CellVisit>
+    void Intersect(const Ray<Real>& ray, const Real& closest, CellVisit&& cell) const
+    {
+        Walk(ray, closest, [&](const int* begin, const int* end) {
+            cell(begin, end);
+            return false;
+        });
+    }
+
+    // Any-hit walk for shadow rays: stops as soon as cell(begin, end)
+    // reports a hit within maxDist.
+    template <typename CellVisit>
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist, CellVisit&& cell) const
+    {
+        bool occluded = false;
+        Walk(ray, maxDist, [&](const int* begin, const int* end) {
+            occluded = cell(begin, end);
+            return occluded;
+        });
+        return occluded;
+    }
 };
 
-void SaveImage(RgbColor* bitmapBits, int width, int height, const char* fileName)
+enum class PrimitiveKind
+{
+    Plane,
+    Sphere
+};
+
+template <typename Real>
+struct PoolHit
+{
+    Real dist;
+    int index;
+    PrimitiveKind kind;
+};
+
+template <typename Real>
+struct PlanePool
+{
+    PoolArray<Real> nx, ny, nz, offset;
+    PoolArray<int> material;
+
+    int Size() const { return (int)nx.size(); }
+
+    void Add(const Vector<Real>& normal, Real planeOffset, int materialId)
+    {
+        nx.push_back(normal.x);
+        ny.push_back(normal.y);
+        nz.push_back(normal.z);
+        offset.push_back(planeOffset);
+        material.push_back(materialId);
+    }
+
+    // Same arithmetic as Plane::Intersect.
+    void Intersect(const Ray<Real>& ray, PoolHit<Real>& hit) const
+    {
+        CountTests(PlaneTest, Size());
+        for (int i = 0; i < Size(); ++i) {
+            Real denom = nx[i] * ray.dir.x + ny[i] * ray.dir.y + nz[i] * ray.dir.z;
+            Real dist = ((nx[i] * ray.start.x + ny[i] * ray.start.y + nz[i] * ray.start.z) + offset[i]) / (-denom);
+            if (!(denom > 0.0) && dist < hit.dist) {
+                hit = PoolHit<Real>{ dist, i, PrimitiveKind::Plane };
+            }
+        }
+    }
+
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist) const
+    {
+        for (int i = 0; i < Size(); ++i) {
+            Real denom = nx[i] * ray.dir.x + ny[i] * ray.dir.y + nz[i] * ray.dir.z;
+            Real dist = ((nx[i] * ray.start.x + ny[i] * ray.start.y + nz[i] * ray.start.z) + offset[i]) / (-denom);
+            if (!(denom > 0.0) && dist <= maxDist) {
+                CountTests(PlaneTest, i + 1);
+                return true;
+            }
+        }
+        CountTests(PlaneTest, Size());
+        return false;
+    }
+};
+
+template <typename Real>
+struct SpherePool
+{
+    PoolArray<Real> cx, cy, cz, radius2;
+    PoolArray<int> material;
+
+    int Size() const { return (int)cx.size(); }
+
+    void Add(const Vector<Real>& center, Real r2, int materialId)
+    {
+        cx.push_back(center.x);
+        cy.push_back(center.y);
+        cz.push_back(center.z);
+        radius2.push_back(r2);
+        material.push_back(materialId);
+    }
+
+    Vector<Real> Center(int i) const { return Vector<Real>(cx[i], cy[i], cz[i]); }
+
+    // Padded so a ray starting on the surface is never culled by the box.
+    BoundingBox<Real> Bounds(int i) const
+    {
+        Real r = std::sqrt(radius2[i]) * (1 + RealTraits<Real>::BoundsPadding) + RealTraits<Real>::BoundsPadding;
+        return BoundingBox<Real>(Center(i) - Vector<Real>(r, r, r), Center(i) + Vector<Real>(r, r, r));
+    }
+
+    void Reorder(const PoolArray<int>& order)
+    {
+        SpherePool<Real> sorted;
+        for (int i : order) {
+            sorted.Add(Center(i), radius2[i], material[i]);
+        }
+        *this = std::move(sorted);
+    }
+
+    // Same arithmetic as Sphere::Intersect. Every candidate is
+    // evaluated and the result selected, which keeps the loop free of
+    // unpredictable branches.
+    void Intersect(const Ray<Real>& ray, int begin, int end, PoolHit<Real>& hit) const
+    {
+        CountTests(SphereTest, end - begin);
+        for (int i = begin; i < end; ++i) {
+            Real ex = cx[i] - ray.start.x;
+            Real ey = cy[i] - ray.start.y;
+            Real ez = cz[i] - ray.start.z;
+            Real v = ex * ray.dir.x + ey * ray.dir.y + ez * ray.dir.z;
+            Real disc = radius2[i] - ((ex * ex + ey * ey + ez * ez) - (v * v));
+            Real dist = v - std::sqrt(std::max(disc, Real(0)));
+            if (v >= 0.0 && disc >= 0.0 && dist < hit.dist) {
+                hit = PoolHit<Real>{ dist, i, PrimitiveKind::Sphere };
+            }
+        }
+    }
+
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist, int begin, int end) const
+    {
+        for (int i = begin; i < end; ++i) {
+            Real ex = cx[i] - ray.start.x;
+            Real ey = cy[i] - ray.start.y;
+            Real ez = cz[i] - ray.start.z;
+            Real v = ex * ray.dir.x + ey * ray.dir.y + ez * ray.dir.z;
+            Real disc = radius2[i] - ((ex * ex + ey * ey + ez * ez) - (v * v));
+            if (v >= 0.0 && disc >= 0.0 && v - std::sqrt(disc) <= maxDist) {
+                CountTests(SphereTest, i + 1 - begin);
+                return true;
+            }
+        }
+        CountTests(SphereTest, end - begin);
+        return false;
+    }
+};
+
+// Scene compiled into one contiguous structure-of-arrays pool per primitive
+// type, so intersection needs neither pointer chasing nor virtual calls.
+// Materials are referenced by id into a flat table of material kinds; with a
+// BVH the spheres are stored in leaf order.
+template <typename Real>
+class ScenePools
+{
+public:
+    PlanePool<Real> planes;
+    SpherePool<Real> spheres;
+    std::vector<const Surface<Real>*> materials;
+    std::vector<MaterialKind> materialKinds;  // kind of each material id
+    Bvh<Real> bvh;
+    bool hasBvh = false;
+
+    int AddMaterial(const Surface<Real>& surface)
+    {
+        for (int i = 0; i < (int)materials.size(); ++i) {
+            if (materials[i] == &surface) return i;
+        }
+        materials.push_back(&surface);
+        materialKinds.push_back(surface.GetKind());
+        return (int)materials.size() - 1;
+    }
+
+    void BuildBvh(ThreadPool* pool = nullptr, BvhSplit split = BvhSplit::Median)
+    {
+        std::vector<BoundingBox<Real>> boxes;
+        boxes.reserve(spheres.Size());
+        for (int i = 0; i < spheres.Size(); ++i) {
+            boxes.push_back(spheres.Bounds(i));
+        }
+        bvh.Build(boxes, pool, split);
+        spheres.Reorder(bvh.Order());
+        hasBvh = true;
+    }
+
+    // Takes over previous, built for the same spheres before they moved,
+    // and refits it; false if it does not fit these spheres.
+    bool RefitBvh(Bvh<Real>&& previous)
+    {
+        if (previous.Empty() || previous.Order().size() != (size_t)spheres.Size()) return false;
+        bvh = std::move(previous);
+        spheres.Reorder(bvh.Order());
+        std::vector<BoundingBox<Real>> boxes;
+        boxes.reserve(spheres.Size());
+        for (int i = 0; i < spheres.Size(); ++i) {
+            boxes.push_back(spheres.Bounds(i));
+        }
+        bvh.Refit(boxes);
+        hasBvh = true;
+        return true;
+    }
+
+    bool Intersect(const Ray<Real>& ray, PoolHit<Real>& hit) const
+    {
+        hit = PoolHit<Real>{ FarAway<Real>, -1, PrimitiveKind::Plane };
+        return IntersectCloser(ray, hit);
+    }
+
+    // Only finds hits nearer than hit.dist; hit.index must be -1 on entry.
+    bool IntersectCloser(const Ray<Real>& ray, PoolHit<Real>& hit) const
+    {
+        planes.Intersect(ray, hit);
+        if (hasBvh) {
+            bvh.Intersect(ray, hit.dist, [&](int start, int count) {
+                spheres.Intersect(ray, start, start + count, hit);
+            });
+        } else {
+            spheres.Intersect(ray, 0, spheres.Size(), hit);
+        }
+        return hit.index >= 0;
+    }
+
+    // Any hit within maxDist; never builds a hit record.
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist) const
+    {
+        if (planes.IsOccluded(ray, maxDist)) return true;
+        if (hasBvh) {
+            return bvh.IsOccluded(ray, maxDist, [&](int start, int count) {
+                return spheres.IsOccluded(ray, maxDist, start, start + count);
+            });
+        }
+        return spheres.IsOccluded(ray, maxDist, 0, spheres.Size());
+    }
+
+    Vector<Real> GetNormal(const PoolHit<Real>& hit, const Vector<Real>& pos) const
+    {
+        if (hit.kind == PrimitiveKind::Plane) {
+            return Vector<Real>(planes.nx[hit.index], planes.ny[hit.index], planes.nz[hit.index]);
+        }
+        return (pos - spheres.Center(hit.index)).Norm();
+    }
+
+    MaterialKind GetMaterialKind(const PoolHit<Real>& hit) const
+    {
+        int id = (hit.kind == PrimitiveKind::Plane) ? planes.material[hit.index] : spheres.material[hit.index];
+        return materialKinds[id];
+    }
+
+    SurfacePropreties<Real> GetSurfaceProperties(const PoolHit<Real>& hit, const Vector<Real>& pos) const
+    {
+        return EvaluateMaterial(GetMaterialKind(hit), pos);
+    }
+};
+
+// Spheres defined once, in the group's own space, and placed any number of
+// times by instances. They are held in pools with their own BVH.
+template <typename Real>
+struct Group
+{
+    std::string name;
+    ScenePools<Real> pools;
+    BoundingBox<Real> bounds;
+
+    explicit Group(const std::string& name) : name(name) {}
+
+    void Add(const Vector<Real>& center, Real radius, const Surface<Real>& surface)
+    {
+        pools.spheres.Add(center, radius * radius, pools.AddMaterial(surface));
+    }
+
+    // Builds the BVH once every sphere is added.
+    void Finish()
+    {
+        pools.BuildBvh();
+        bounds = BoundingBox<Real>();
+        for (int i = 0; i < pools.spheres.Size(); ++i) {
+            bounds.Extend(pools.spheres.Bounds(i));
+        }
+    }
+};
+
+// A group scaled by scale and moved by offset. Rays are moved into group
+// space instead and traced through the group's BVH; the scene's BVH over
+// its things is the top level above the instances. Hits are shaded in group
+// space, so procedural materials move and scale with the instance.
+template <typename Real>
+class Instance : public Thing<Real> {
+    const Group<Real>& group;
+    Vector<Real> offset;
+    Real scale;
+    Real invScale;
+
+    Ray<Real> ToGroup(const Ray<Real>& ray) const
+    {
+        return Ray<Real>((ray.start - offset) * invScale, ray.dir);
+    }
+
+public:
+    Instance(const Group<Real>& group, Vector<Real> offset, Real scale) :
+        group(group), offset(offset), scale(scale), invScale(Real(1) / scale)
+    {}
+
+    const Group<Real>& GetGroup() const { return group; }
+    const Vector<Real>& Offset() const { return offset; }
+    Real Scale() const { return scale; }
+
+    bool Intersect(const Ray<Real>& ray, Real& dist) const override {
+        Intersection<Real> hit{ FarAway<Real>, 0, nullptr };
+        IntersectCloser(ray, hit);
+        dist = hit.dist;
+        return hit.thing != nullptr;
+    }
+
+    void IntersectCloser(const Ray<Real>& ray, Intersection<Real>& hit) const override {
+        PoolHit<Real> local{ hit.dist * invScale, -1, PrimitiveKind::Sphere };
+        if (!group.pools.IntersectCloser(ToGroup(ray), local)) return;
+        Real dist = local.dist * scale;
+        if (dist < hit.dist) hit = Intersection<Real>{ dist, local.index, this };
+    }
+
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist) const override {
+        return group.pools.IsOccluded(ToGroup(ray), maxDist * invScale);
+    }
+
+    void Describe(const Intersection<Real>& hit, const Vector<Real>& pos, Vector<Real>& normal, SurfacePropreties<Real>& surface) const override {
+        PoolHit<Real> local{ hit.dist * invScale, hit.part, PrimitiveKind::Sphere };
+        Vector<Real> localPos = (pos - offset) * invScale;
+        normal = group.pools.GetNormal(local, localPos);
+        surface = group.pools.GetSurfaceProperties(local, localPos);
+    }
+
+    bool GetBounds(BoundingBox<Real>& box) const override {
+        Real pad = RealTraits<Real>::BoundsPadding;
+        Vector<Real> padding(pad, pad, pad);
+        box = BoundingBox<Real>(group.bounds.min * scale + offset - padding, group.bounds.max * scale + offset + padding);
+        return true;
+    }
+};
+
+template <typename Real>
+bool Sphere<Real>::AddTo(ScenePools<Real>& pools) const
+{
+    pools.spheres.Add(center, radius2, pools.AddMaterial(surface));
+    return true;
+}
+
+template <typename Real>
+bool Plane<Real>::AddTo(ScenePools<Real>& pools) const
+{
+    pools.planes.Add(normal, offset, pools.AddMaterial(surface));
+    return true;
+}
+
+// Read-only memory mapping of a whole file, or bytes that arrived some other
+// way and are held in memory instead.
+class MappedFile
+{
+    const char* bytes = nullptr;
+    size_t length = 0;
+    std::vector<char> buffer;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    void Close()
+    {
+        if (!buffer.empty()) {
+            buffer.clear();
+            bytes = nullptr;
+            return;
+        }
+#if defined(_WIN32)
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) munmap((void*)bytes, length);
+#endif
+        bytes = nullptr;
+    }
+
+public:
+    explicit MappedFile(const std::string& path)
+    {
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) throw std::runtime_error(path + ": cannot open");
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        length = (size_t)size.QuadPart;
+        if (length == 0) return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!bytes) {
+            Close();
+            throw std::runtime_error(path + ": cannot map");
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error(path + ": cannot open");
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error(path + ": cannot stat");
+        }
+        length = (size_t)info.st_size;
+        if (length > 0) {
+            void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error(path + ": cannot map");
+            }
+            bytes = (const char*)address;
+        }
+        close(fd);
+#endif
+    }
+
+    explicit MappedFile(std::vector<char>&& data) : length(data.size()), buffer(std::move(data))
+    {
+        if (length > 0) bytes = buffer.data();
+    }
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* Data() const { return bytes; }
+    size_t Size() const { return length; }
+};
+
+template <typename Real>
+class Scene {
+private:
+    ShinySurface<Real>        shiny;
+    CheckerboardSurface<Real> checkerboard;
+public:
+    std::vector<std::unique_ptr<Thing<Real>>> things;
+    std::vector<Light<Real>> lights;
+    Camera<Real>    camera;
+    std::vector<std::unique_ptr<Group<Real>>> groups;  // placed by Instance things
+
+    // Filled by BuildBvh: things without bounds are kept out of the
+    // hierarchy, bvhThings holds the rest in leaf order.
+    std::vector<const Thing<Real>*> unbounded;
+    std::vector<const Thing<Real>*> bvhThings;
+    Bvh<Real> bvh;
+
+    // Filled by BuildGrid, which splits off unbounded the same way; the
+    // grid's cells list indices into gridThings.
+    std::vector<const Thing<Real>*> gridThings;
+    UniformGrid<Real> grid;
+
+    // Filled by Compile, or mapped straight from a scene cache file, in
+    // which case the scene has no things and can only be traced from pools.
+    ScenePools<Real> pools;
+    std::unique_ptr<MappedFile> mapping;
+
+    struct EmptyTag {};
+
+    // A scene with no camera, lights or things, to be filled by a loader.
+    explicit Scene(EmptyTag) {}
+
+    Scene()
+    {
+        things.push_back(std::make_unique<Plane<Real>>(Vector<Real>(0.0, 1.0, 0.0), 0.0, checkerboard));
+        things.push_back(std::make_unique<Sphere<Real>>(Vector<Real>(0.0, 1.0, -0.25), 1.0, shiny));
+        things.push_back(std::make_unique<Sphere<Real>>(Vector<Real>(-1.0, 0.5, 1.5), 0.5, shiny));
+
+        lights.push_back(Light<Real>(Vector<Real>(-2.0, 2.5, 0.0), Color<Real>(0.49, 0.07, 0.07)));
+        lights.push_back(Light<Real>(Vector<Real>(1.5, 2.5, 1.5), Color<Real>(0.07, 0.07, 0.49)));
+        lights.push_back(Light<Real>(Vector<Real>(1.5, 2.5, -1.5), Color<Real>(0.07, 0.49, 0.071)));
+        lights.push_back(Light<Real>(Vector<Real>(0.0, 3.5, 0.0), Color<Real>(0.21, 0.21, 0.35)));
+        camera = Camera<Real>(Vector<Real>(3.0, 2.0, 4.0), Vector<Real>(-1.0, 0.5, 0.0));
+    }
+
+    // Benchmark scene: the default lights and floor with sphereCount shiny
+    // spheres scattered over a fixed volume, shrinking as the count grows so
+    // the picture stays comparably busy at every size.
+    explicit Scene(int sphereCount, unsigned seed = 1)
+    {
+        things.push_back(std::make_unique<Plane<Real>>(Vector<Real>(0.0, 1.0, 0.0), 0.0, checkerboard));
+
+        const double extent = 4.0;
+        const double height = 3.0;
+        double volume = 2.0 * extent * 2.0 * extent * height;
+        double radius = 0.35 * cbrt(volume / std::max(sphereCount, 1));
+
+        std::mt19937 random(seed);
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        for (int i = 0; i < sphereCount; ++i) {
+            Vector<Real> center(
+                (unit(random) * 2.0 - 1.0) * extent,
+                radius + unit(random) * height,
+                (unit(random) * 2.0 - 1.0) * extent);
+            double r = radius * (0.5 + unit(random));
+            things.push_back(std::make_unique<Sphere<Real>>(center, r, shiny));
+        }
+
+        lights.push_back(Light<Real>(Vector<Real>(-2.0, 2.5 + height, 0.0), Color<Real>(0.49, 0.07, 0.07)));
+        lights.push_back(Light<Real>(Vector<Real>(1.5, 2.5 + height, 1.5), Color<Real>(0.07, 0.07, 0.49)));
+        lights.push_back(Light<Real>(Vector<Real>(1.5, 2.5 + height, -1.5), Color<Real>(0.07, 0.49, 0.071)));
+        lights.push_back(Light<Real>(Vector<Real>(0.0, 3.5 + height, 0.0), Color<Real>(0.21, 0.21, 0.35)));
+        camera = Camera<Real>(Vector<Real>(7.0, 5.0, 9.0), Vector<Real>(-1.0, 0.5, 0.0));
+    }
+
+    void BuildBvh(ThreadPool* pool = nullptr, BvhSplit split = BvhSplit::Median)
+    {
+        std::vector<const Thing<Real>*> bounded;
+        std::vector<BoundingBox<Real>> boxes;
+        SplitBounded(bounded, boxes);
+        bvh.Build(boxes, pool, split);
+
+        bvhThings.clear();
+        for (int i : bvh.Order()) {
+            bvhThings.push_back(bounded[i]);
+        }
+    }
+
+    // Refits the BVH to things that moved since BuildBvh; false if things
+    // were added or removed since.
+    bool RefitBvh()
+    {
+        if (bvh.Empty() || bvhThings.size() + unbounded.size() != things.size()) return false;
+        std::vector<BoundingBox<Real>> boxes(bvhThings.size());
+        for (size_t slot = 0; slot < bvhThings.size(); ++slot) {
+            if (!bvhThings[slot]->GetBounds(boxes[slot])) return false;
+        }
+        bvh.Refit(boxes);
+        return true;
+    }
+
+    void BuildGrid()
+    {
+        std::vector<BoundingBox<Real>> boxes;
+        SplitBounded(gridThings, boxes);
+        grid.Build(boxes);
+    }
+
+    // Sorts the things into unbounded and bounded, with the bounds of each.
+    void SplitBounded(std::vector<const Thing<Real>*>& bounded, std::vector<BoundingBox<Real>>& boxes)
+    {
+        bounded.clear();
+        unbounded.clear();
+        BoundingBox<Real> box;
+        for (auto& thing : things) {
+            if (thing->GetBounds(box)) {
+                bounded.push_back(thing.get());
+                boxes.push_back(box);
+            } else {
+                unbounded.push_back(thing.get());
+            }
+        }
+    }
+
+    bool IsMapped() const { return mapping != nullptr; }
+
+    Surface<Real>& GetSurface(MaterialKind kind)
+    {
+        if (kind == MaterialKind::Checkerboard) return checkerboard;
+        return shiny;
+    }
+
+    MaterialKind GetMaterialKind(const Surface<Real>* surface) const
+    {
+        return surface->GetKind();
+    }
+
+    Group<Real>& AddGroup(const std::string& name)
+    {
+        groups.push_back(std::make_unique<Group<Real>>(name));
+        return *groups.back();
+    }
+
+    // Scenes with instances have no pool or scene cache form.
+    bool HasInstances() const
+    {
+        return std::any_of(things.begin(), things.end(),
+            [](const std::unique_ptr<Thing<Real>>& thing) { return dynamic_cast<const Instance<Real>*>(thing.get()) != nullptr; });
+    }
+
+    // Lowers the things into pools; returns false if any thing has no pool
+    // representation, in which case only the object layout can be used.
+    // Instances have none; withoutInstances leaves them out, for callers
+    // that handle groups and instances themselves.
+    // Mapped scenes are compiled already and always carry their BVH.
+    bool Compile(bool buildBvh, bool withoutInstances = false)
+    {
+        if (IsMapped()) return true;
+        pools = ScenePools<Real>();
+        for (auto& thing : things) {
+            if (withoutInstances && dynamic_cast<const Instance<Real>*>(thing.get())) continue;
+            if (!thing->AddTo(pools)) return false;
+        }
+        if (buildBvh) pools.BuildBvh();
+        return true;
+    }
+};
+
+// Benchmark scene of instanceCount copies of one group of groupSpheres shiny
+// spheres, on a square grid over the floor of Scene(0). Every copy is
+// scaled a little differently so the top-level BVH sees uneven boxes.
+template <typename Real>
+std::unique_ptr<Scene<Real>> MakeInstancedScene(int groupSpheres, int instanceCount, unsigned seed = 1)
+{
+    auto scene = std::make_unique<Scene<Real>>(0, seed);
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    // The group fills [-1, 1] x [0, 2] x [-1, 1].
+    auto& group = scene->AddGroup("cluster");
+    double radius = 0.35 * cbrt(8.0 / std::max(groupSpheres, 1));
+    for (int i = 0; i < groupSpheres; ++i) {
+        double r = radius * (0.5 + unit(random));
+        Vector<Real> center(unit(random) * 2.0 - 1.0, r + unit(random) * (2.0 - r), unit(random) * 2.0 - 1.0);
+        group.Add(center, (Real)r, scene->GetSurface(MaterialKind::Shiny));
+    }
+    group.Finish();
+
+    const double extent = 4.0;
+    int side = (int)std::ceil(std::sqrt((double)instanceCount));
+    double cell = 2.0 * extent / std::max(side, 1);
+    for (int i = 0; i < instanceCount; ++i) {
+        Vector<Real> offset(-extent + (i % side + 0.5) * cell, 0.0, -extent + (i / side + 0.5) * cell);
+        Real scale = (Real)(cell * 0.4 * (0.75 + 0.25 * unit(random)));
+        scene->things.push_back(std::make_unique<Instance<Real>>(group, offset, scale));
+    }
+    return scene;
+}
+
+// Benchmark scene like Scene(sphereCount) with the spheres gathered in a few
+// tight clusters, leaving most of the volume empty.
+template <typename Real>
+std::unique_ptr<Scene<Real>> MakeClusteredScene(int sphereCount, unsigned seed = 1)
+{
+    const int clusterCount = 8;
+    const double extent = 4.0;
+    const double spread = 0.3;
+
+    auto scene = std::make_unique<Scene<Real>>(0, seed);
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, spread);
+    std::vector<Vector<double>> centers;
+    for (int i = 0; i < clusterCount; ++i) {
+        centers.push_back(Vector<double>((unit(random) * 2.0 - 1.0) * extent, 1.0 + unit(random) * 2.0, (unit(random) * 2.0 - 1.0) * extent));
+    }
+
+    double volume = clusterCount * std::pow(4.0 * spread, 3.0);
+    double radius = 0.35 * cbrt(volume / std::max(sphereCount, 1));
+    for (int i = 0; i < sphereCount; ++i) {
+        const Vector<double>& center = centers[i % clusterCount];
+        Vector<Real> position(center.x + normal(random), std::max(center.y + normal(random), radius), center.z + normal(random));
+        double r = radius * (0.5 + unit(random));
+        scene->things.push_back(std::make_unique<Sphere<Real>>(position, r, scene->GetSurface(MaterialKind::Shiny)));
+    }
+    return scene;
+}
+
+enum class Acceleration
+{
+    Linear,
+    Bvh,
+    Grid  // object layout only
+};
+
+const char* AccelerationName(Acceleration acceleration)
+{
+    switch (acceleration) {
+    case Acceleration::Bvh:  return "bvh";
+    case Acceleration::Grid: return "grid";
+    default:                 return "linear";
+    }
+}
+
+// Objects traces through the Thing interface, Pools through the compiled
+// ScenePools of Scene::Compile.
+enum class SceneLayout
+{
+    Objects,
+    Pools
+};
+
+
+// Instruction sets the packet kernels are compiled for.
+enum class SimdIsa
+{
+    None,    // packets disabled, primary rays are traced one at a time
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+const char* SimdIsaName(SimdIsa isa)
+{
+    switch (isa) {
+    case SimdIsa::Scalar: return "scalar";
+    case SimdIsa::Sse2:   return "sse2";
+    case SimdIsa::Avx2:   return "avx2";
+    default:              return "none";
+    }
+}
+
+SimdIsa DetectSimdIsa()
+{
+#if defined(RAYTRACER_X86) && defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SimdIsa::Avx2 : SimdIsa::Sse2;
+#elif defined(RAYTRACER_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    return (avx2 && osxsave && (_xgetbv(0) & 6) == 6) ? SimdIsa::Avx2 : SimdIsa::Sse2;
+#else
+    return SimdIsa::Scalar;
+#endif
+}
+
+// Downgrades a requested ISA to the best one this CPU can run.
+SimdIsa SupportedSimdIsa(SimdIsa requested)
+{
+    if (requested == SimdIsa::None || requested == SimdIsa::Scalar) return requested;
+    SimdIsa available = DetectSimdIsa();
+    return (requested > available) ? available : requested;
+}
+
+// A packet fills one AVX register: four doubles or eight floats.
+template <typename Real>
+constexpr int PacketSize = 32 / sizeof(Real);
+
+// A packet of rays in structure-of-arrays form.
+template <typename Real>
+struct RayPacket
+{
+    alignas(32) Real ox[PacketSize<Real>], oy[PacketSize<Real>], oz[PacketSize<Real>];
+    alignas(32) Real dx[PacketSize<Real>], dy[PacketSize<Real>], dz[PacketSize<Real>];
+    alignas(32) Real ix[PacketSize<Real>], iy[PacketSize<Real>], iz[PacketSize<Real>];  // inverse directions for box tests
+};
+
+// Closest hit per lane. Indices below the plane count are planes, the rest
+// are spheres offset by the plane count; -1 is a miss.
+template <typename Real>
+struct PacketHit
+{
+    alignas(32) Real dist[PacketSize<Real>];
+    alignas(32) long long index[PacketSize<Real>];
+};
+
+// The kernels reproduce the operation order of Sphere::Intersect and
+// Plane::Intersect exactly, so every ISA finds bit-identical hits.
+template <typename Real>
+struct PacketKernels
+{
+    void (*intersectPlanes)(const RayPacket<Real>& rays, const PlanePool<Real>& planes, PacketHit<Real>& hit);
+    void (*intersectSpheres)(const RayPacket<Real>& rays, const SpherePool<Real>& spheres, int base, int begin, int end, PacketHit<Real>& hit);
+    // Returns a lane mask of rays entering the box before their closest hit.
+    int (*intersectBox)(const RayPacket<Real>& rays, const BoundingBox<Real>& box, const PacketHit<Real>& hit);
+};
+
+template <typename Real>
+void IntersectPlanesScalar(const RayPacket<Real>& rays, const PlanePool<Real>& g, PacketHit<Real>& hit)
+{
+    for (int i = 0; i < g.Size(); ++i) {
+        for (int k = 0; k < PacketSize<Real>; ++k) {
+            Real denom = g.nx[i] * rays.dx[k] + g.ny[i] * rays.dy[k] + g.nz[i] * rays.dz[k];
+            if (denom > 0.0) continue;
+            Real dist = ((g.nx[i] * rays.ox[k] + g.ny[i] * rays.oy[k] + g.nz[i] * rays.oz[k]) + g.offset[i]) / (-denom);
+            if (dist < hit.dist[k]) {
+                hit.dist[k] = dist;
+                hit.index[k] = i;
+            }
+        }
+    }
+}
+
+template <typename Real>
+void IntersectSpheresScalar(const RayPacket<Real>& rays, const SpherePool<Real>& g, int base, int begin, int end, PacketHit<Real>& hit)
+{
+    for (int i = begin; i < end; ++i) {
+        for (int k = 0; k < PacketSize<Real>; ++k) {
+            Real ex = g.cx[i] - rays.ox[k];
+            Real ey = g.cy[i] - rays.oy[k];
+            Real ez = g.cz[i] - rays.oz[k];
+            Real v = ex * rays.dx[k] + ey * rays.dy[k] + ez * rays.dz[k];
+            if (v < 0.0) continue;
+            Real disc = g.radius2[i] - ((ex * ex + ey * ey + ez * ez) - (v * v));
+            if (disc < 0.0) continue;
+            Real dist = v - std::sqrt(disc);
+            if (dist < hit.dist[k]) {
+                hit.dist[k] = dist;
+                hit.index[k] = base + i;
+            }
+        }
+    }
+}
+
+template <typename Real>
+int IntersectBoxScalar(const RayPacket<Real>& rays, const BoundingBox<Real>& box, const PacketHit<Real>& hit)
+{
+    int mask = 0;
+    for (int k = 0; k < PacketSize<Real>; ++k) {
+        Ray<Real> ray(Vector<Real>(rays.ox[k], rays.oy[k], rays.oz[k]), Vector<Real>(rays.dx[k], rays.dy[k], rays.dz[k]));
+        if (box.Intersect(ray, Vector<Real>(rays.ix[k], rays.iy[k], rays.iz[k]), hit.dist[k]) != FarAway<Real>) {
+            mask |= 1 << k;
+        }
+    }
+    return mask;
+}
+
+#if defined(RAYTRACER_X86)
+
+// SSE2 is part of x86-64, so these need no runtime check. Each packet is
+// processed as two halves of two lanes.
+void IntersectPlanesSse2(const RayPacket<double>& rays, const PlanePool<double>& g, PacketHit<double>& hit)
+{
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d signBit = _mm_set1_pd(-0.0);
+    for (int h = 0; h < PacketSize<double>; h += 2) {
+        __m128d ox = _mm_load_pd(rays.ox + h), oy = _mm_load_pd(rays.oy + h), oz = _mm_load_pd(rays.oz + h);
+        __m128d dx = _mm_load_pd(rays.dx + h), dy = _mm_load_pd(rays.dy + h), dz = _mm_load_pd(rays.dz + h);
+        __m128d closest = _mm_load_pd(hit.dist + h);
+        __m128i index = _mm_load_si128((const __m128i*)(hit.index + h));
+
+        for (int i = 0; i < g.Size(); ++i) {
+            __m128d nx = _mm_set1_pd(g.nx[i]), ny = _mm_set1_pd(g.ny[i]), nz = _mm_set1_pd(g.nz[i]);
+            __m128d denom = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, dx), _mm_mul_pd(ny, dy)), _mm_mul_pd(nz, dz));
+            __m128d start = _mm_add_pd(_mm_add_pd(_mm_mul_pd(nx, ox), _mm_mul_pd(ny, oy)), _mm_mul_pd(nz, oz));
+            __m128d dist = _mm_div_pd(_mm_add_pd(start, _mm_set1_pd(g.offset[i])), _mm_xor_pd(denom, signBit));
+            __m128d mask = _mm_andnot_pd(_mm_cmpgt_pd(denom, zero), _mm_cmplt_pd(dist, closest));
+            closest = _mm_or_pd(_mm_and_pd(mask, dist), _mm_andnot_pd(mask, closest));
+            __m128i maski = _mm_castpd_si128(mask);
+            index = _mm_or_si128(_mm_and_si128(maski, _mm_set1_epi64x(i)), _mm_andnot_si128(maski, index));
+        }
+        _mm_store_pd(hit.dist + h, closest);
+        _mm_store_si128((__m128i*)(hit.index + h), index);
+    }
+}
+
+void IntersectSpheresSse2(const RayPacket<double>& rays, const SpherePool<double>& g, int base, int begin, int end, PacketHit<double>& hit)
+{
+    const __m128d zero = _mm_setzero_pd();
+    for (int h = 0; h < PacketSize<double>; h += 2) {
+        __m128d ox = _mm_load_pd(rays.ox + h), oy = _mm_load_pd(rays.oy + h), oz = _mm_load_pd(rays.oz + h);
+        __m128d dx = _mm_load_pd(rays.dx + h), dy = _mm_load_pd(rays.dy + h), dz = _mm_load_pd(rays.dz + h);
+        __m128d closest = _mm_load_pd(hit.dist + h);
+        __m128i index = _mm_load_si128((const __m128i*)(hit.index + h));
+
+        for (int i = begin; i < end; ++i) {
+            __m128d ex = _mm_sub_pd(_mm_set1_pd(g.cx[i]), ox);
+            __m128d ey = _mm_sub_pd(_mm_set1_pd(g.cy[i]), oy);
+            __m128d ez = _mm_sub_pd(_mm_set1_pd(g.cz[i]), oz);
+            __m128d v = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ex, dx), _mm_mul_pd(ey, dy)), _mm_mul_pd(ez, dz));
+            __m128d ee = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ex, ex), _mm_mul_pd(ey, ey)), _mm_mul_pd(ez, ez));
+            __m128d disc = _mm_sub_pd(_mm_set1_pd(g.radius2[i]), _mm_sub_pd(ee, _mm_mul_pd(v, v)));
+            __m128d dist = _mm_sub_pd(v, _mm_sqrt_pd(disc));
+            __m128d mask = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(v, zero), _mm_cmpge_pd(disc, zero)), _mm_cmplt_pd(dist, closest));
+            if (_mm_movemask_pd(mask) == 0) continue;
+            closest = _mm_or_pd(_mm_and_pd(mask, dist), _mm_andnot_pd(mask, closest));
+            __m128i maski = _mm_castpd_si128(mask);
+            index = _mm_or_si128(_mm_and_si128(maski, _mm_set1_epi64x(base + i)), _mm_andnot_si128(maski, index));
+        }
+        _mm_store_pd(hit.dist + h, closest);
+        _mm_store_si128((__m128i*)(hit.index + h), index);
+    }
+}
+
+TARGET_AVX2 void IntersectPlanesAvx2(const RayPacket<double>& rays, const PlanePool<double>& g, PacketHit<double>& hit)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d signBit = _mm256_set1_pd(-0.0);
+    __m256d ox = _mm256_load_pd(rays.ox), oy = _mm256_load_pd(rays.oy), oz = _mm256_load_pd(rays.oz);
+    __m256d dx = _mm256_load_pd(rays.dx), dy = _mm256_load_pd(rays.dy), dz = _mm256_load_pd(rays.dz);
+    __m256d closest = _mm256_load_pd(hit.dist);
+    __m256d index = _mm256_load_pd((const double*)hit.index);
+
+    for (int i = 0; i < g.Size(); ++i) {
+        __m256d nx = _mm256_set1_pd(g.nx[i]), ny = _mm256_set1_pd(g.ny[i]), nz = _mm256_set1_pd(g.nz[i]);
+        __m256d denom = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, dx), _mm256_mul_pd(ny, dy)), _mm256_mul_pd(nz, dz));
+        __m256d start = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(nx, ox), _mm256_mul_pd(ny, oy)), _mm256_mul_pd(nz, oz));
+        __m256d dist = _mm256_div_pd(_mm256_add_pd(start, _mm256_set1_pd(g.offset[i])), _mm256_xor_pd(denom, signBit));
+        __m256d mask = _mm256_andnot_pd(_mm256_cmp_pd(denom, zero, _CMP_GT_OQ), _mm256_cmp_pd(dist, closest, _CMP_LT_OQ));
+        closest = _mm256_blendv_pd(closest, dist, mask);
+        index = _mm256_blendv_pd(index, _mm256_castsi256_pd(_mm256_set1_epi64x(i)), mask);
+    }
+    _mm256_store_pd(hit.dist, closest);
+    _mm256_store_pd((double*)hit.index, index);
+}
+
+TARGET_AVX2 void IntersectSpheresAvx2(const RayPacket<double>& rays, const SpherePool<double>& g, int base, int begin, int end, PacketHit<double>& hit)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    __m256d ox = _mm256_load_pd(rays.ox), oy = _mm256_load_pd(rays.oy), oz = _mm256_load_pd(rays.oz);
+    __m256d dx = _mm256_load_pd(rays.dx), dy = _mm256_load_pd(rays.dy), dz = _mm256_load_pd(rays.dz);
+    __m256d closest = _mm256_load_pd(hit.dist);
+    __m256d index = _mm256_load_pd((const double*)hit.index);
+
+    for (int i = begin; i < end; ++i) {
+        __m256d ex = _mm256_sub_pd(_mm256_set1_pd(g.cx[i]), ox);
+        __m256d ey = _mm256_sub_pd(_mm256_set1_pd(g.cy[i]), oy);
+        __m256d ez = _mm256_sub_pd(_mm256_set1_pd(g.cz[i]), oz);
+        __m256d v = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ex, dx), _mm256_mul_pd(ey, dy)), _mm256_mul_pd(ez, dz));
+        __m256d ee = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ex, ex), _mm256_mul_pd(ey, ey)), _mm256_mul_pd(ez, ez));
+        __m256d disc = _mm256_sub_pd(_mm256_set1_pd(g.radius2[i]), _mm256_sub_pd(ee, _mm256_mul_pd(v, v)));
+        __m256d dist = _mm256_sub_pd(v, _mm256_sqrt_pd(disc));
+        __m256d mask = _mm256_and_pd(
+            _mm256_and_pd(_mm256_cmp_pd(v, zero, _CMP_GE_OQ), _mm256_cmp_pd(disc, zero, _CMP_GE_OQ)),
+            _mm256_cmp_pd(dist, closest, _CMP_LT_OQ));
+        if (_mm256_movemask_pd(mask) == 0) continue;
+        closest = _mm256_blendv_pd(closest, dist, mask);
+        index = _mm256_blendv_pd(index, _mm256_castsi256_pd(_mm256_set1_epi64x(base + i)), mask);
+    }
+    _mm256_store_pd(hit.dist, closest);
+    _mm256_store_pd((double*)hit.index, index);
+}
+
+TARGET_AVX2 int IntersectBoxAvx2(const RayPacket<double>& rays, const BoundingBox<double>& box, const PacketHit<double>& hit)
+{
+    __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.min.x), _mm256_load_pd(rays.ox)), _mm256_load_pd(rays.ix));
+    __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.max.x), _mm256_load_pd(rays.ox)), _mm256_load_pd(rays.ix));
+    __m256d tNear = _mm256_min_pd(t0, t1);
+    __m256d tFar = _mm256_max_pd(t0, t1);
+
+    t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.min.y), _mm256_load_pd(rays.oy)), _mm256_load_pd(rays.iy));
+    t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.max.y), _mm256_load_pd(rays.oy)), _mm256_load_pd(rays.iy));
+    tNear = _mm256_max_pd(tNear, _mm256_min_pd(t0, t1));
+    tFar = _mm256_min_pd(tFar, _mm256_max_pd(t0, t1));
+
+    t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.min.z), _mm256_load_pd(rays.oz)), _mm256_load_pd(rays.iz));
+    t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.max.z), _mm256_load_pd(rays.oz)), _mm256_load_pd(rays.iz));
+    tNear = _mm256_max_pd(tNear, _mm256_min_pd(t0, t1));
+    tFar = _mm256_min_pd(tFar, _mm256_max_pd(t0, t1));
+
+    __m256d mask = _mm256_and_pd(
+        _mm256_and_pd(_mm256_cmp_pd(tNear, tFar, _CMP_LE_OQ), _mm256_cmp_pd(tFar, _mm256_setzero_pd(), _CMP_GE_OQ)),
+        _mm256_cmp_pd(tNear, _mm256_load_pd(hit.dist), _CMP_LE_OQ));
+    return _mm256_movemask_pd(mask);
+}
+
+// A packet of floats is processed as two halves of four lanes. The 32-bit
+// lane masks are widened to select the 64-bit hit indices, two lanes at a
+// time.
+inline void SelectIndices(__m128 mask, long long value, __m128i& low, __m128i& high)
+{
+    __m128i lanes = _mm_castps_si128(mask);
+    __m128i lowMask = _mm_unpacklo_epi32(lanes, lanes);
+    __m128i highMask = _mm_unpackhi_epi32(lanes, lanes);
+    __m128i v = _mm_set1_epi64x(value);
+    low = _mm_or_si128(_mm_and_si128(lowMask, v), _mm_andnot_si128(lowMask, low));
+    high = _mm_or_si128(_mm_and_si128(highMask, v), _mm_andnot_si128(highMask, high));
+}
+
+void IntersectPlanesSse2(const RayPacket<float>& rays, const PlanePool<float>& g, PacketHit<float>& hit)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    for (int h = 0; h < PacketSize<float>; h += 4) {
+        __m128 ox = _mm_load_ps(rays.ox + h), oy = _mm_load_ps(rays.oy + h), oz = _mm_load_ps(rays.oz + h);
+        __m128 dx = _mm_load_ps(rays.dx + h), dy = _mm_load_ps(rays.dy + h), dz = _mm_load_ps(rays.dz + h);
+        __m128 closest = _mm_load_ps(hit.dist + h);
+        __m128i low = _mm_load_si128((const __m128i*)(hit.index + h));
+        __m128i high = _mm_load_si128((const __m128i*)(hit.index + h + 2));
+
+        for (int i = 0; i < g.Size(); ++i) {
+            __m128 nx = _mm_set1_ps(g.nx[i]), ny = _mm_set1_ps(g.ny[i]), nz = _mm_set1_ps(g.nz[i]);
+            __m128 denom = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, dx), _mm_mul_ps(ny, dy)), _mm_mul_ps(nz, dz));
+            __m128 start = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, ox), _mm_mul_ps(ny, oy)), _mm_mul_ps(nz, oz));
+            __m128 dist = _mm_div_ps(_mm_add_ps(start, _mm_set1_ps(g.offset[i])), _mm_xor_ps(denom, signBit));
+            __m128 mask = _mm_andnot_ps(_mm_cmpgt_ps(denom, zero), _mm_cmplt_ps(dist, closest));
+            closest = _mm_or_ps(_mm_and_ps(mask, dist), _mm_andnot_ps(mask, closest));
+            SelectIndices(mask, i, low, high);
+        }
+        _mm_store_ps(hit.dist + h, closest);
+        _mm_store_si128((__m128i*)(hit.index + h), low);
+        _mm_store_si128((__m128i*)(hit.index + h + 2), high);
+    }
+}
+
+void IntersectSpheresSse2(const RayPacket<float>& rays, const SpherePool<float>& g, int base, int begin, int end, PacketHit<float>& hit)
+{
+    const __m128 zero = _mm_setzero_ps();
+    for (int h = 0; h < PacketSize<float>; h += 4) {
+        __m128 ox = _mm_load_ps(rays.ox + h), oy = _mm_load_ps(rays.oy + h), oz = _mm_load_ps(rays.oz + h);
+        __m128 dx = _mm_load_ps(rays.dx + h), dy = _mm_load_ps(rays.dy + h), dz = _mm_load_ps(rays.dz + h);
+        __m128 closest = _mm_load_ps(hit.dist + h);
+        __m128i low = _mm_load_si128((const __m128i*)(hit.index + h));
+        __m128i high = _mm_load_si128((const __m128i*)(hit.index + h + 2));
+
+        for (int i = begin; i < end; ++i) {
+            __m128 ex = _mm_sub_ps(_mm_set1_ps(g.cx[i]), ox);
+            __m128 ey = _mm_sub_ps(_mm_set1_ps(g.cy[i]), oy);
+            __m128 ez = _mm_sub_ps(_mm_set1_ps(g.cz[i]), oz);
+            __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, dx), _mm_mul_ps(ey, dy)), _mm_mul_ps(ez, dz));
+            __m128 ee = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)), _mm_mul_ps(ez, ez));
+            __m128 disc = _mm_sub_ps(_mm_set1_ps(g.radius2[i]), _mm_sub_ps(ee, _mm_mul_ps(v, v)));
+            __m128 dist = _mm_sub_ps(v, _mm_sqrt_ps(disc));
+            __m128 mask = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmpge_ps(disc, zero)), _mm_cmplt_ps(dist, closest));
+            if (_mm_movemask_ps(mask) == 0) continue;
+            closest = _mm_or_ps(_mm_and_ps(mask, dist), _mm_andnot_ps(mask, closest));
+            SelectIndices(mask, base + i, low, high);
+        }
+        _mm_store_ps(hit.dist + h, closest);
+        _mm_store_si128((__m128i*)(hit.index + h), low);
+        _mm_store_si128((__m128i*)(hit.index + h + 2), high);
+    }
+}
+
+// Eight float lanes fill an AVX register. The lane masks are widened to
+// select the 64-bit hit indices, four lanes at a time.
+TARGET_AVX2 inline void SelectIndices(__m256 mask, long long value, __m256d& low, __m256d& high)
+{
+    __m256i lanes = _mm256_castps_si256(mask);
+    __m256d lowMask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(lanes)));
+    __m256d highMask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(lanes, 1)));
+    __m256d v = _mm256_castsi256_pd(_mm256_set1_epi64x(value));
+    low = _mm256_blendv_pd(low, v, lowMask);
+    high = _mm256_blendv_pd(high, v, highMask);
+}
+
+TARGET_AVX2 void IntersectPlanesAvx2(const RayPacket<float>& rays, const PlanePool<float>& g, PacketHit<float>& hit)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    __m256 ox = _mm256_load_ps(rays.ox), oy = _mm256_load_ps(rays.oy), oz = _mm256_load_ps(rays.oz);
+    __m256 dx = _mm256_load_ps(rays.dx), dy = _mm256_load_ps(rays.dy), dz = _mm256_load_ps(rays.dz);
+    __m256 closest = _mm256_load_ps(hit.dist);
+    __m256d low = _mm256_load_pd((const double*)hit.index);
+    __m256d high = _mm256_load_pd((const double*)(hit.index + 4));
+
+    for (int i = 0; i < g.Size(); ++i) {
+        __m256 nx = _mm256_set1_ps(g.nx[i]), ny = _mm256_set1_ps(g.ny[i]), nz = _mm256_set1_ps(g.nz[i]);
+        __m256 denom = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, dx), _mm256_mul_ps(ny, dy)), _mm256_mul_ps(nz, dz));
+        __m256 start = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, ox), _mm256_mul_ps(ny, oy)), _mm256_mul_ps(nz, oz));
+        __m256 dist = _mm256_div_ps(_mm256_add_ps(start, _mm256_set1_ps(g.offset[i])), _mm256_xor_ps(denom, signBit));
+        __m256 mask = _mm256_andnot_ps(_mm256_cmp_ps(denom, zero, _CMP_GT_OQ), _mm256_cmp_ps(dist, closest, _CMP_LT_OQ));
+        closest = _mm256_blendv_ps(closest, dist, mask);
+        SelectIndices(mask, i, low, high);
+    }
+    _mm256_store_ps(hit.dist, closest);
+    _mm256_store_pd((double*)hit.index, low);
+    _mm256_store_pd((double*)(hit.index + 4), high);
+}
+
+TARGET_AVX2 void IntersectSpheresAvx2(const RayPacket<float>& rays, const SpherePool<float>& g, int base, int begin, int end, PacketHit<float>& hit)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 ox = _mm256_load_ps(rays.ox), oy = _mm256_load_ps(rays.oy), oz = _mm256_load_ps(rays.oz);
+    __m256 dx = _mm256_load_ps(rays.dx), dy = _mm256_load_ps(rays.dy), dz = _mm256_load_ps(rays.dz);
+    __m256 closest = _mm256_load_ps(hit.dist);
+    __m256d low = _mm256_load_pd((const double*)hit.index);
+    __m256d high = _mm256_load_pd((const double*)(hit.index + 4));
+
+    for (int i = begin; i < end; ++i) {
+        __m256 ex = _mm256_sub_ps(_mm256_set1_ps(g.cx[i]), ox);
+        __m256 ey = _mm256_sub_ps(_mm256_set1_ps(g.cy[i]), oy);
+        __m256 ez = _mm256_sub_ps(_mm256_set1_ps(g.cz[i]), oz);
+        __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ex, dx), _mm256_mul_ps(ey, dy)), _mm256_mul_ps(ez, dz));
+        __m256 ee = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ex, ex), _mm256_mul_ps(ey, ey)), _mm256_mul_ps(ez, ez));
+        __m256 disc = _mm256_sub_ps(_mm256_set1_ps(g.radius2[i]), _mm256_sub_ps(ee, _mm256_mul_ps(v, v)));
+        __m256 dist = _mm256_sub_ps(v, _mm256_sqrt_ps(disc));
+        __m256 mask = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(disc, zero, _CMP_GE_OQ)),
+            _mm256_cmp_ps(dist, closest, _CMP_LT_OQ));
+        if (_mm256_movemask_ps(mask) == 0) continue;
+        closest = _mm256_blendv_ps(closest, dist, mask);
+        SelectIndices(mask, base + i, low, high);
+    }
+    _mm256_store_ps(hit.dist, closest);
+    _mm256_store_pd((double*)hit.index, low);
+    _mm256_store_pd((double*)(hit.index + 4), high);
+}
+
+TARGET_AVX2 int IntersectBoxAvx2(const RayPacket<float>& rays, const BoundingBox<float>& box, const PacketHit<float>& hit)
+{
+    __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.x), _mm256_load_ps(rays.ox)), _mm256_load_ps(rays.ix));
+    __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.x), _mm256_load_ps(rays.ox)), _mm256_load_ps(rays.ix));
+    __m256 tNear = _mm256_min_ps(t0, t1);
+    __m256 tFar = _mm256_max_ps(t0, t1);
+
+    t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.y), _mm256_load_ps(rays.oy)), _mm256_load_ps(rays.iy));
+    t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.y), _mm256_load_ps(rays.oy)), _mm256_load_ps(rays.iy));
+    tNear = _mm256_max_ps(tNear, _mm256_min_ps(t0, t1));
+    tFar = _mm256_min_ps(tFar, _mm256_max_ps(t0, t1));
+
+    t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.min.z), _mm256_load_ps(rays.oz)), _mm256_load_ps(rays.iz));
+    t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.max.z), _mm256_load_ps(rays.oz)), _mm256_load_ps(rays.iz));
+    tNear = _mm256_max_ps(tNear, _mm256_min_ps(t0, t1));
+    tFar = _mm256_min_ps(tFar, _mm256_max_ps(t0, t1));
+
+    __m256 mask = _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ), _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ)),
+        _mm256_cmp_ps(tNear, _mm256_load_ps(hit.dist), _CMP_LE_OQ));
+    return _mm256_movemask_ps(mask);
+}
+
+#endif
+
+// Returns the kernels for isa and lowers isa to the instruction set they
+// actually use.
+template <typename Real>
+PacketKernels<Real> GetPacketKernels(SimdIsa& isa);
+
+template <>
+PacketKernels<double> GetPacketKernels(SimdIsa& isa)
+{
+#if defined(RAYTRACER_X86)
+    if (isa == SimdIsa::Avx2) return PacketKernels<double>{ IntersectPlanesAvx2, IntersectSpheresAvx2, IntersectBoxAvx2 };
+    if (isa == SimdIsa::Sse2) return PacketKernels<double>{ IntersectPlanesSse2, IntersectSpheresSse2, IntersectBoxScalar<double> };
+#endif
+    isa = SimdIsa::Scalar;
+    return PacketKernels<double>{ IntersectPlanesScalar<double>, IntersectSpheresScalar<double>, IntersectBoxScalar<double> };
+}
+
+template <>
+PacketKernels<float> GetPacketKernels(SimdIsa& isa)
+{
+#if defined(RAYTRACER_X86)
+    if (isa == SimdIsa::Avx2) return PacketKernels<float>{ IntersectPlanesAvx2, IntersectSpheresAvx2, IntersectBoxAvx2 };
+    if (isa == SimdIsa::Sse2) return PacketKernels<float>{ IntersectPlanesSse2, IntersectSpheresSse2, IntersectBoxScalar<float> };
+#endif
+    isa = SimdIsa::Scalar;
+    return PacketKernels<float>{ IntersectPlanesScalar<float>, IntersectSpheresScalar<float>, IntersectBoxScalar<float> };
+}
+
+// Converts count linear pixels to 8-bit ones with QuantizePixel. The SIMD
+// versions give identical bytes.
+using PixelConverter = void (*)(const LinearRgb* in, RgbColor* out, int count, float scale);
+
+void ConvertPixelsScalar(const LinearRgb* in, RgbColor* out, int count, float scale)
+{
+    for (int i = 0; i < count; ++i) out[i] = QuantizePixel(in[i], scale);
+}
+
+#if defined(RAYTRACER_X86)
+
+// Twelve channels of four pixels, r g b r g b ..., scaled, clamped and
+// truncated to 32-bit integers, then narrowed to bytes in the same order.
+inline __m128i QuantizeChannels(const float* in, __m128 scale)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 max = _mm_set1_ps(255.0f);
+    __m128i a = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in), scale), zero), max));
+    __m128i b = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + 4), scale), zero), max));
+    __m128i c = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + 8), scale), zero), max));
+    return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, c));
+}
+
+// SSE2 cannot shuffle bytes, so the four pixels are reordered to b g r a
+// from a spill of the narrowed channels.
+void ConvertPixelsSse2(const LinearRgb* in, RgbColor* out, int count, float scale)
+{
+    __m128 scales = _mm_set1_ps(scale);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        alignas(16) UInt8 rgb[16];
+        _mm_store_si128((__m128i*)rgb, QuantizeChannels(&in[i].r, scales));
+        for (int k = 0; k < 4; ++k) out[i + k] = RgbColor{ rgb[3 * k + 2], rgb[3 * k + 1], rgb[3 * k], 255 };
+    }
+    ConvertPixelsScalar(in + i, out + i, count - i, scale);
+}
+
+// Eight pixels at a time: the channels are quantized in 256-bit registers
+// and shuffled into b g r a with an opaque alpha.
+TARGET_AVX2 void ConvertPixelsAvx2(const LinearRgb* in, RgbColor* out, int count, float scale)
+{
+    const __m256 scales = _mm256_set1_ps(scale);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 max = _mm256_set1_ps(255.0f);
+    const __m128i toBgra = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const float* channels = &in[i].r;
+        __m256i a = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(channels), scales), zero), max));
+        __m256i b = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(channels + 8), scales), zero), max));
+        __m256i c = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(channels + 16), scales), zero), max));
+        // Bytes 0 to 15 and 16 to 23 of the 24 channels.
+        __m128i low = _mm_packus_epi16(
+            _mm_packs_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)),
+            _mm_packs_epi32(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b, 1)));
+        __m128i high = _mm_packus_epi16(
+            _mm_packs_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1)), _mm_setzero_si128());
+        __m128i first = _mm_or_si128(_mm_shuffle_epi8(low, toBgra), alpha);
+        __m128i second = _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(high, low, 12), toBgra), alpha);
+        _mm_storeu_si128((__m128i*)(out + i), first);
+        _mm_storeu_si128((__m128i*)(out + i + 4), second);
+    }
+    // The tail and all tracing after it run legacy SSE code, which is slow
+    // while the upper halves of the registers are dirty. The compiler does
+    // not clear them before the tail call, so it is done here.
+    _mm256_zeroupper();
+    ConvertPixelsSse2(in + i, out + i, count - i, scale);
+}
+
+#endif
+
+// Returns the conversion for isa and lowers isa to the one it uses.
+PixelConverter GetPixelConverter(SimdIsa& isa)
+{
+#if defined(RAYTRACER_X86)
+    if (isa == SimdIsa::Avx2) return ConvertPixelsAvx2;
+    if (isa == SimdIsa::Sse2) return ConvertPixelsSse2;
+#endif
+    isa = SimdIsa::Scalar;
+    return ConvertPixelsScalar;
+}
+
+// Closest hit for each lane of a packet: planes are tested directly, spheres
+// either all at once or through the BVH, descending while any lane still
+// enters a node before its closest hit.
+template <typename Real>
+void IntersectPacket(const PacketKernels<Real>& kernels, const ScenePools<Real>& pools, const RayPacket<Real>& rays, PacketHit<Real>& hit)
+{
+    for (int k = 0; k < PacketSize<Real>; ++k) {
+        hit.dist[k] = FarAway<Real>;
+        hit.index[k] = -1;
+    }
+    kernels.intersectPlanes(rays, pools.planes, hit);
+    CountTests(PlaneTest, (uint64_t)pools.planes.Size() * PacketSize<Real>);
+
+    int base = pools.planes.Size();
+    if (!pools.hasBvh) {
+        kernels.intersectSpheres(rays, pools.spheres, base, 0, pools.spheres.Size(), hit);
+        CountTests(SphereTest, (uint64_t)pools.spheres.Size() * PacketSize<Real>);
+        return;
+    }
+    auto& nodes = pools.bvh.Nodes();
+    if (nodes.empty()) return;
+
+    // Children are ordered front to back along the first ray of the packet.
+    Vector<Real> origin(rays.ox[0], rays.oy[0], rays.oz[0]);
+    Vector<Real> dir(rays.dx[0], rays.dy[0], rays.dz[0]);
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int index = stack[--top];
+        const typename Bvh<Real>::Node& node = nodes[index];
+        CountTests(BoxTest, PacketSize<Real>);
+        if (kernels.intersectBox(rays, node.box, hit) == 0) continue;
+
+        if (node.count > 0) {
+            kernels.intersectSpheres(rays, pools.spheres, base, node.start, node.start + node.count, hit);
+            CountTests(SphereTest, (uint64_t)node.count * PacketSize<Real>);
+            continue;
+        }
+
+        int left = index + 1;
+        int right = node.start;
+        Real leftKey = (nodes[left].box.Center() - origin) * dir;
+        Real rightKey = (nodes[right].box.Center() - origin) * dir;
+        if (leftKey > rightKey) std::swap(left, right);
+        stack[top++] = right;
+        stack[top++] = left;
+    }
+}
+
+// Per-engine choices of how rays are traced; none of them change the image.
+struct TraceSettings
+{
+    Acceleration acceleration = Acceleration::Linear;
+    SceneLayout layout = SceneLayout::Objects;
+    SimdIsa packets = SimdIsa::None;  // packets imply SceneLayout::Pools
+    bool wavefront = false;           // trace tiles a bounce at a time through ray queues
+    bool reorder = false;             // sort wavefront reflection rays by direction and origin
+    bool refit = false;               // PrepareScene refits an existing BVH instead of building one
+    BvhSplit split = BvhSplit::Median;  // how PrepareScene builds BVHs
+    float exposure = 1.0f;            // scales linear radiance before it is quantized to 8 bits
+};
+
+// Builds the structures the settings trace through. Falls back to the object
+// layout when the scene holds things the pools cannot represent. BVHs are
+// built on pool when one is given. With settings.refit, a BVH left by an
+// earlier call is refitted to objects that moved since, if it still fits.
+template <typename Real>
+void PrepareScene(Scene<Real>& scene, TraceSettings& settings, ThreadPool* pool = nullptr)
+{
+    if (scene.IsMapped()) {
+        settings.layout = SceneLayout::Pools;
+        return;
+    }
+    if (settings.acceleration == Acceleration::Grid) {
+        settings.layout = SceneLayout::Objects;
+        settings.packets = SimdIsa::None;
+    }
+    if (settings.packets != SimdIsa::None) {
+        settings.layout = SceneLayout::Pools;
+    }
+    bool bvh = settings.acceleration == Acceleration::Bvh;
+    if (settings.layout == SceneLayout::Pools) {
+        Bvh<Real> previous = std::move(scene.pools.bvh);
+        if (!scene.Compile(false)) {
+            settings.layout = SceneLayout::Objects;
+            settings.packets = SimdIsa::None;
+        } else if (bvh && !(settings.refit && scene.pools.RefitBvh(std::move(previous)))) {
+            scene.pools.BuildBvh(pool, settings.split);
+        }
+    }
+    if (settings.layout == SceneLayout::Objects && bvh && !(settings.refit && scene.RefitBvh())) {
+        scene.BuildBvh(pool, settings.split);
+    }
+    if (settings.acceleration == Acceleration::Grid) {
+        scene.BuildGrid();
+    }
+}
+
+// Text scene format, one item per line, '#' starts a comment:
+//
+//   camera  <pos x y z> <look-at x y z>
+//   light   <pos x y z> <color r g b>
+//   plane   <normal x y z> <offset> <material>
+//   sphere  <center x y z> <radius> <material>
+//   group   <name>
+//   end
+//   instance <name> <offset x y z> <scale>
+//
+// where <material> is shiny or checkerboard. The sphere lines between group
+// and end define a group; each instance line places a copy of a group
+// defined above it, scaled and then moved by the offset.
+const char* MaterialName(MaterialKind kind)
+{
+    return (kind == MaterialKind::Checkerboard) ? "checkerboard" : "shiny";
+}
+
+std::unique_ptr<Scene<double>> LoadSceneText(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error(path + ": cannot open");
+
+    auto scene = std::make_unique<Scene<double>>(Scene<double>::EmptyTag());
+    bool hasCamera = false;
+    Group<double>* group = nullptr;  // the group being defined
+    auto findGroup = [&](const std::string& name) -> const Group<double>* {
+        for (auto& g : scene->groups) {
+            if (g->name == name) return g.get();
+        }
+        return nullptr;
+    };
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        auto fail = [&](const std::string& message) {
+            return std::runtime_error(path + ":" + std::to_string(lineNumber) + ": " + message);
+        };
+        auto readMaterial = [&](std::istream& in) -> Surface<double>& {
+            std::string name;
+            in >> name;
+            if (name == MaterialName(MaterialKind::Shiny)) return scene->GetSurface(MaterialKind::Shiny);
+            if (name == MaterialName(MaterialKind::Checkerboard)) return scene->GetSurface(MaterialKind::Checkerboard);
+            throw fail("unknown material '" + name + "'");
+        };
+
+        std::istringstream in(line.substr(0, line.find('#')));
+        std::string keyword;
+        if (!(in >> keyword)) continue;
+
+        double a, b, c, d, e, f;
+        std::string name;
+        if (group && keyword != "sphere" && keyword != "end") {
+            throw fail("only spheres can be in group '" + group->name + "'");
+        }
+        if (keyword == "group" && (in >> name)) {
+            if (findGroup(name)) throw fail("group '" + name + "' is already defined");
+            group = &scene->AddGroup(name);
+        } else if (keyword == "end" && group) {
+            if (group->pools.spheres.Size() == 0) throw fail("group '" + group->name + "' is empty");
+            group->Finish();
+            group = nullptr;
+        } else if (keyword == "instance" && (in >> name >> a >> b >> c >> d)) {
+            const Group<double>* instanced = findGroup(name);
+            if (!instanced) throw fail("no group '" + name + "'");
+            if (!(d > 0)) throw fail("instance scale must be positive");
+            scene->things.push_back(std::make_unique<Instance<double>>(*instanced, Vector<double>(a, b, c), d));
+        } else if (keyword == "camera" && (in >> a >> b >> c >> d >> e >> f)) {
+            scene->camera = Camera<double>(Vector<double>(a, b, c), Vector<double>(d, e, f));
+            hasCamera = true;
+        } else if (keyword == "light" && (in >> a >> b >> c >> d >> e >> f)) {
+            scene->lights.push_back(Light<double>(Vector<double>(a, b, c), Color<double>(d, e, f)));
+        } else if (keyword == "plane" && (in >> a >> b >> c >> d)) {
+            auto& surface = readMaterial(in);
+            scene->things.push_back(std::make_unique<Plane<double>>(Vector<double>(a, b, c), d, surface));
+        } else if (keyword == "sphere" && (in >> a >> b >> c >> d)) {
+            auto& surface = readMaterial(in);
+            if (group) {
+                group->Add(Vector<double>(a, b, c), d, surface);
+            } else {
+                scene->things.push_back(std::make_unique<Sphere<double>>(Vector<double>(a, b, c), d, surface));
+            }
+        } else {
+            throw fail("cannot parse '" + line + "'");
+        }
+
+        if (in >> keyword) throw fail("unexpected '" + keyword + "'");
+    }
+    if (group) throw std::runtime_error(path + ": group '" + group->name + "' has no end");
+    if (!hasCamera) throw std::runtime_error(path + ": no camera");
+    return scene;
+}
+
+void SaveSceneText(Scene<double>& scene, const std::string& path)
+{
+    if (!scene.Compile(false, true)) throw std::runtime_error(path + ": scene has things the text format cannot describe");
+
+    std::ofstream file(path, std::ios::trunc);
+    if (!file) throw std::runtime_error(path + ": cannot create");
+    file.precision(17);
+
+    auto& camera = scene.camera;
+    Vector<double> lookAt = camera.pos + camera.forward;
+    file << "camera " << camera.pos.x << " " << camera.pos.y << " " << camera.pos.z << " "
+         << lookAt.x << " " << lookAt.y << " " << lookAt.z << "\n";
+    for (auto& light : scene.lights) {
+        file << "light " << light.pos.x << " " << light.pos.y << " " << light.pos.z << " "
+             << light.color.r << " " << light.color.g << " " << light.color.b << "\n";
+    }
+
+    auto& pools = scene.pools;
+    auto materialName = [&](int id) { return MaterialName(scene.GetMaterialKind(pools.materials[id])); };
+    for (int i = 0; i < pools.planes.Size(); ++i) {
+        file << "plane " << pools.planes.nx[i] << " " << pools.planes.ny[i] << " " << pools.planes.nz[i] << " "
+             << pools.planes.offset[i] << " " << materialName(pools.planes.material[i]) << "\n";
+    }
+    for (int i = 0; i < pools.spheres.Size(); ++i) {
+        file << "sphere " << pools.spheres.cx[i] << " " << pools.spheres.cy[i] << " " << pools.spheres.cz[i] << " "
+             << sqrt(pools.spheres.radius2[i]) << " " << materialName(pools.spheres.material[i]) << "\n";
+    }
+
+    for (auto& group : scene.groups) {
+        auto& spheres = group->pools.spheres;
+        file << "group " << group->name << "\n";
+        for (int i = 0; i < spheres.Size(); ++i) {
+            file << "sphere " << spheres.cx[i] << " " << spheres.cy[i] << " " << spheres.cz[i] << " " << sqrt(spheres.radius2[i]) << " "
+                 << MaterialName(scene.GetMaterialKind(group->pools.materials[spheres.material[i]])) << "\n";
+        }
+        file << "end\n";
+    }
+    for (auto& thing : scene.things) {
+        if (auto instance = dynamic_cast<const Instance<double>*>(thing.get())) {
+            auto& offset = instance->Offset();
+            file << "instance " << instance->GetGroup().name << " " << offset.x << " " << offset.y << " " << offset.z << " "
+                 << instance->Scale() << "\n";
+        }
+    }
+}
+
+// Compiled scene cache. The file is the ScenePools arrays (spheres in BVH
+// leaf order) and the BVH nodes laid out back to back, each section 64-byte
+// aligned, behind a fixed header. Loading maps the file and points the pools
+// at it, so nothing is parsed and no per-object memory is allocated.
+const char SceneCacheMagic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+const uint32_t SceneCacheVersion = 1;
+const uint32_t SceneCacheByteOrder = 0x01020304;
+
+enum SceneCacheSection
+{
+    LightSection,       // 6 doubles per light: position, color
+    MaterialSection,    // MaterialKind per material id
+    PlaneNxSection,
+    PlaneNySection,
+    PlaneNzSection,
+    PlaneOffsetSection,
+    PlaneMaterialSection,
+    SphereCxSection,
+    SphereCySection,
+    SphereCzSection,
+    SphereRadius2Section,
+    SphereMaterialSection,
+    BvhNodeSection,
+    SceneCacheSectionCount
+};
+
+const size_t SceneCacheElementSize[SceneCacheSectionCount] = {
+    6 * sizeof(double), sizeof(uint32_t),
+    sizeof(double), sizeof(double), sizeof(double), sizeof(double), sizeof(int),
+    sizeof(double), sizeof(double), sizeof(double), sizeof(double), sizeof(int),
+    sizeof(Bvh<double>::Node)
+};
+
+struct SceneCacheHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t fileSize;
+    uint64_t sourceSize;   // size and modification time of the text file the
+    int64_t  sourceTime;   // cache was compiled from, to detect stale caches
+    uint32_t nodeSize;
+    uint32_t reserved;
+    double   camera[12];   // forward, right, up, pos
+    struct
+    {
+        uint64_t offset;
+        uint64_t count;
+    } sections[SceneCacheSectionCount];
+};
+
+struct SceneSource
+{
+    uint64_t size = 0;
+    int64_t time = 0;
+};
+
+SceneSource GetSceneSource(const std::string& path)
+{
+    SceneSource source;
+    source.size = (uint64_t)std::filesystem::file_size(path);
+    source.time = (int64_t)std::filesystem::last_write_time(path).time_since_epoch().count();
+    return source;
+}
+
+const uint64_t SceneCacheAlignment = 64;
+
+// Places the sections of header one after another at aligned offsets, by
+// their counts, and sets the file size to the end of the last one.
+void LayOutSceneCache(SceneCacheHeader& header)
+{
+    uint64_t offset = sizeof(header);
+    for (int i = 0; i < SceneCacheSectionCount; ++i) {
+        offset = (offset + SceneCacheAlignment - 1) / SceneCacheAlignment * SceneCacheAlignment;
+        header.sections[i].offset = offset;
+        offset += header.sections[i].count * SceneCacheElementSize[i];
+    }
+    header.fileSize = offset;
+}
+
+// Whether header is that of a cache image of size bytes written by this
+// build: sections laid out as LayOutSceneCache places them, with no more
+// elements than the pools index with int. Checked on the header alone, so
+// a received image can be refused before the rest of it arrives.
+bool IsSceneCacheLayout(const SceneCacheHeader& header, uint64_t size)
+{
+    if (std::memcmp(header.magic, SceneCacheMagic, sizeof(header.magic)) != 0 || header.version != SceneCacheVersion ||
+        header.byteOrder != SceneCacheByteOrder || header.nodeSize != sizeof(Bvh<double>::Node) || header.fileSize != size) {
+        return false;
+    }
+    SceneCacheHeader layout = header;
+    for (int i = 0; i < SceneCacheSectionCount; ++i) {
+        if (header.sections[i].count > (uint64_t)std::numeric_limits<int>::max()) return false;
+    }
+    LayOutSceneCache(layout);
+    return std::memcmp(&layout, &header, sizeof(header)) == 0;
+}
+
+// Writes the cache image of scene to file; name is only used in errors.
+void WriteSceneCache(Scene<double>& scene, std::ostream& file, const std::string& name, const SceneSource& source)
+{
+    if (scene.HasInstances()) throw std::runtime_error(name + ": scene caches hold no instances");
+    if (!scene.Compile(true)) throw std::runtime_error(name + ": scene has things the cache cannot describe");
+    auto& pools = scene.pools;
+
+    std::vector<double> lights;
+    for (auto& light : scene.lights) {
+        double values[] = { light.pos.x, light.pos.y, light.pos.z, light.color.r, light.color.g, light.color.b };
+        lights.insert(lights.end(), values, values + 6);
+    }
+    std::vector<uint32_t> materials;
+    for (auto surface : pools.materials) {
+        materials.push_back((uint32_t)scene.GetMaterialKind(surface));
+    }
+
+    struct Section { const void* data; size_t count; };
+    Section sections[SceneCacheSectionCount] = {
+        { lights.data(), scene.lights.size() },
+        { materials.data(), materials.size() },
+        { pools.planes.nx.data(), pools.planes.nx.size() },
+        { pools.planes.ny.data(), pools.planes.ny.size() },
+        { pools.planes.nz.data(), pools.planes.nz.size() },
+        { pools.planes.offset.data(), pools.planes.offset.size() },
+        { pools.planes.material.data(), pools.planes.material.size() },
+        { pools.spheres.cx.data(), pools.spheres.cx.size() },
+        { pools.spheres.cy.data(), pools.spheres.cy.size() },
+        { pools.spheres.cz.data(), pools.spheres.cz.size() },
+        { pools.spheres.radius2.data(), pools.spheres.radius2.size() },
+        { pools.spheres.material.data(), pools.spheres.material.size() },
+        { pools.bvh.Nodes().data(), pools.bvh.Nodes().size() },
+    };
+
+    SceneCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SceneCacheMagic, sizeof(header.magic));
+    header.version = SceneCacheVersion;
+    header.byteOrder = SceneCacheByteOrder;
+    header.sourceSize = source.size;
+    header.sourceTime = source.time;
+    header.nodeSize = sizeof(Bvh<double>::Node);
+    const Vector<double>* cameraVectors[] = { &scene.camera.forward, &scene.camera.right, &scene.camera.up, &scene.camera.pos };
+    for (int i = 0; i < 4; ++i) {
+        header.camera[3 * i] = cameraVectors[i]->x;
+        header.camera[3 * i + 1] = cameraVectors[i]->y;
+        header.camera[3 * i + 2] = cameraVectors[i]->z;
+    }
+
+    for (int i = 0; i < SceneCacheSectionCount; ++i) header.sections[i].count = sections[i].count;
+    LayOutSceneCache(header);
+
+    file.write((const char*)&header, sizeof(header));
+    uint64_t written = sizeof(header);
+    const char padding[SceneCacheAlignment] = {};
+    for (int i = 0; i < SceneCacheSectionCount; ++i) {
+        file.write(padding, header.sections[i].offset - written);
+        file.write((const char*)sections[i].data, sections[i].count * SceneCacheElementSize[i]);
+        written = header.sections[i].offset + sections[i].count * SceneCacheElementSize[i];
+    }
+    if (!file) throw std::runtime_error(name + ": write failed");
+}
+
+void SaveSceneCache(Scene<double>& scene, const std::string& path, const SceneSource& source)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) throw std::runtime_error(path + ": cannot create");
+    WriteSceneCache(scene, file, path, source);
+}
+
+// Opens a scene cache image and validates it: header, section bounds and
+// every index stored in it, so a corrupt image cannot send traversal out of
+// bounds. name is only used in errors.
+std::unique_ptr<Scene<double>> OpenSceneCache(std::unique_ptr<MappedFile> mapping, const std::string& name, const SceneSource* expectedSource = nullptr)
+{
+    auto fail = [&](const std::string& message) { return std::runtime_error(name + ": " + message); };
+
+    if (mapping->Size() < sizeof(SceneCacheHeader)) throw fail("not a scene cache");
+    SceneCacheHeader header;
+    std::memcpy(&header, mapping->Data(), sizeof(header));
+    if (std::memcmp(header.magic, SceneCacheMagic, sizeof(header.magic)) != 0) throw fail("not a scene cache");
+    if (header.version != SceneCacheVersion) throw fail("scene cache version " + std::to_string(header.version) + ", expected " + std::to_string(SceneCacheVersion));
+    if (header.byteOrder != SceneCacheByteOrder || header.nodeSize != sizeof(Bvh<double>::Node)) throw fail("scene cache written by an incompatible build");
+    if (header.fileSize != mapping->Size()) throw fail("truncated scene cache");
+    if (expectedSource && (header.sourceSize != expectedSource->size || header.sourceTime != expectedSource->time)) throw fail("stale scene cache");
+
+    for (int i = 0; i < SceneCacheSectionCount; ++i) {
+        auto& section = header.sections[i];
+        if (section.offset % 8 != 0 || section.offset > header.fileSize ||
+            section.count > (header.fileSize - section.offset) / SceneCacheElementSize[i]) {
+            throw fail("corrupt section table");
+        }
+    }
+    auto at = [&](int section) { return mapping->Data() + header.sections[section].offset; };
+    auto count = [&](int section) { return (size_t)header.sections[section].count; };
+
+    size_t planeCount = count(PlaneNxSection);
+    size_t sphereCount = count(SphereCxSection);
+    for (int i = PlaneNxSection; i <= PlaneMaterialSection; ++i) {
+        if (count(i) != planeCount) throw fail("corrupt plane pool");
+    }
+    for (int i = SphereCxSection; i <= SphereMaterialSection; ++i) {
+        if (count(i) != sphereCount) throw fail("corrupt sphere pool");
+    }
+
+    auto scene = std::make_unique<Scene<double>>(Scene<double>::EmptyTag());
+    auto& camera = scene->camera;
+    Vector<double>* cameraVectors[] = { &camera.forward, &camera.right, &camera.up, &camera.pos };
+    for (int i = 0; i < 4; ++i) {
+        *cameraVectors[i] = Vector<double>(header.camera[3 * i], header.camera[3 * i + 1], header.camera[3 * i + 2]);
+    }
+
+    const double* lights = (const double*)at(LightSection);
+    for (size_t i = 0; i < count(LightSection); ++i) {
+        const double* l = lights + 6 * i;
+        scene->lights.push_back(Light<double>(Vector<double>(l[0], l[1], l[2]), Color<double>(l[3], l[4], l[5])));
+    }
+
+    auto& pools = scene->pools;
+    const uint32_t* materials = (const uint32_t*)at(MaterialSection);
+    for (size_t i = 0; i < count(MaterialSection); ++i) {
+        if (materials[i] >= (uint32_t)MaterialKind::Count) throw fail("unknown material kind");
+        pools.AddMaterial(scene->GetSurface((MaterialKind)materials[i]));
+    }
+
+    pools.planes.nx.View((const double*)at(PlaneNxSection), planeCount);
+    pools.planes.ny.View((const double*)at(PlaneNySection), planeCount);
+    pools.planes.nz.View((const double*)at(PlaneNzSection), planeCount);
+    pools.planes.offset.View((const double*)at(PlaneOffsetSection), planeCount);
+    pools.planes.material.View((const int*)at(PlaneMaterialSection), planeCount);
+    pools.spheres.cx.View((const double*)at(SphereCxSection), sphereCount);
+    pools.spheres.cy.View((const double*)at(SphereCySection), sphereCount);
+    pools.spheres.cz.View((const double*)at(SphereCzSection), sphereCount);
+    pools.spheres.radius2.View((const double*)at(SphereRadius2Section), sphereCount);
+    pools.spheres.material.View((const int*)at(SphereMaterialSection), sphereCount);
+
+    int materialCount = (int)pools.materials.size();
+    for (int id : pools.planes.material) {
+        if (id < 0 || id >= materialCount) throw fail("material id out of range");
+    }
+    for (int id : pools.spheres.material) {
+        if (id < 0 || id >= materialCount) throw fail("material id out of range");
+    }
+
+    // Children must follow their parent, which rules out cycles, every node
+    // but the root must have exactly one parent, which rules out shared
+    // subtrees that traversal would visit once per path, and the depth must
+    // fit the fixed traversal stacks. All parents of a node come before it,
+    // so it is known to be referenced by the time it is checked.
+    size_t nodeCount = count(BvhNodeSection);
+    const Bvh<double>::Node* nodes = (const Bvh<double>::Node*)at(BvhNodeSection);
+    if ((nodeCount == 0) != (sphereCount == 0)) throw fail("missing BVH");
+    std::vector<uint8_t> depth(nodeCount, 0);
+    std::vector<bool> referenced(nodeCount, false);
+    for (size_t i = 0; i < nodeCount; ++i) {
+        auto& node = nodes[i];
+        if (i > 0 && !referenced[i]) throw fail("corrupt BVH node");
+        if (node.count > 0) {
+            if (node.start < 0 || (size_t)node.start + node.count > sphereCount) throw fail("corrupt BVH leaf");
+            continue;
+        }
+        if ((size_t)node.start <= i + 1 || (size_t)node.start >= nodeCount || depth[i] >= Bvh<double>::MaxDepth
+            || referenced[i + 1] || referenced[node.start]) {
+            throw fail("corrupt BVH node");
+        }
+        referenced[i + 1] = referenced[node.start] = true;
+        depth[i + 1] = depth[node.start] = depth[i] + 1;
+    }
+    pools.bvh.View(nodes, nodeCount);
+    pools.hasBvh = true;
+
+    scene->mapping = std::move(mapping);
+    return scene;
+}
+
+std::unique_ptr<Scene<double>> MapSceneCache(const std::string& path, const SceneSource* expectedSource = nullptr)
+{
+    return OpenSceneCache(std::make_unique<MappedFile>(path), path, expectedSource);
+}
+
+bool IsSceneCache(const std::string& path)
+{
+    char magic[sizeof(SceneCacheMagic)] = {};
+    std::ifstream file(path, std::ios::binary);
+    file.read(magic, sizeof(magic));
+    return file && std::memcmp(magic, SceneCacheMagic, sizeof(magic)) == 0;
+}
+
+// Loads a scene file. A compiled cache is mapped directly. A text file is
+// mapped from its "<path>.cache" when that is up to date; otherwise it is
+// parsed and the cache is written first.
+std::unique_ptr<Scene<double>> LoadScene(const std::string& path, bool& fromCache)
+{
+    fromCache = true;
+    if (IsSceneCache(path)) return MapSceneCache(path);
+
+    SceneSource source = GetSceneSource(path);
+    std::string cachePath = path + ".cache";
+    if (std::filesystem::exists(cachePath)) {
+        try {
+            return MapSceneCache(cachePath, &source);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << ", rebuilding" << std::endl;
+        }
+    }
+
+    // The fresh cache is mapped too, so the first run traces exactly what
+    // later runs will.
+    fromCache = false;
+    auto scene = LoadSceneText(path);
+    if (!scene->groups.empty()) return scene;  // the cache has no instances
+    try {
+        SaveSceneCache(*scene, cachePath, source);
+        return MapSceneCache(cachePath, &source);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return scene;
+}
+
+// Copies a scene into another precision. It goes through the compiled pools,
+// so generated, parsed and mapped scenes all convert the same way.
+template <typename Real>
+std::unique_ptr<Scene<Real>> ConvertScene(Scene<double>& source)
+{
+    if (!source.Compile(false, true)) {
+        throw std::runtime_error(std::string("scene has things that cannot be converted to ") + RealTraits<Real>::Name);
+    }
+
+    auto scene = std::make_unique<Scene<Real>>(typename Scene<Real>::EmptyTag());
+    scene->camera = Camera<Real>(source.camera);
+    for (auto& light : source.lights) {
+        scene->lights.push_back(Light<Real>(Vector<Real>(light.pos), Color<Real>(light.color)));
+    }
+
+    auto& pools = source.pools;
+    auto surface = [&](int id) -> Surface<Real>& {
+        return scene->GetSurface(source.GetMaterialKind(pools.materials[id]));
+    };
+    for (int i = 0; i < pools.planes.Size(); ++i) {
+        Vector<double> normal(pools.planes.nx[i], pools.planes.ny[i], pools.planes.nz[i]);
+        scene->things.push_back(std::make_unique<Plane<Real>>(
+            Vector<Real>(normal), (Real)pools.planes.offset[i], surface(pools.planes.material[i])));
+    }
+    for (int i = 0; i < pools.spheres.Size(); ++i) {
+        scene->things.push_back(std::make_unique<Sphere<Real>>(
+            Vector<Real>(pools.spheres.Center(i)), (Real)std::sqrt(pools.spheres.radius2[i]), surface(pools.spheres.material[i])));
+    }
+
+    std::map<const Group<double>*, const Group<Real>*> groups;
+    for (auto& group : source.groups) {
+        auto& spheres = group->pools.spheres;
+        auto& copy = scene->AddGroup(group->name);
+        for (int i = 0; i < spheres.Size(); ++i) {
+            copy.Add(Vector<Real>(spheres.Center(i)), (Real)std::sqrt(spheres.radius2[i]),
+                scene->GetSurface(source.GetMaterialKind(group->pools.materials[spheres.material[i]])));
+        }
+        copy.Finish();
+        groups[group.get()] = &copy;
+    }
+    for (auto& thing : source.things) {
+        if (auto instance = dynamic_cast<const Instance<double>*>(thing.get())) {
+            scene->things.push_back(std::make_unique<Instance<Real>>(
+                *groups[&instance->GetGroup()], Vector<Real>(instance->Offset()), (Real)instance->Scale()));
+        }
+    }
+    return scene;
+}
+
+using Task = std::function<void()>;
+
+class TaskGroup
+{
+    friend class ThreadPool;
+    std::atomic<int> pending{ 0 };
+};
+
+// Double-ended task queue: the owning thread pushes and pops at the back,
+// idle threads steal from the front.
+class WorkStealingQueue
+{
+public:
+    struct Job
+    {
+        Task task;
+        TaskGroup* group;
+    };
+
+    void Push(Job job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+
+    bool Pop(Job& job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.empty()) return false;
+        job = std::move(jobs.back());
+        jobs.pop_back();
+        return true;
+    }
+
+    bool Steal(Job& job)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.empty()) return false;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    std::deque<Job> jobs;
+};
+
+// Fixed pool of worker threads with one work-stealing queue per thread.
+// The thread that calls Wait counts as one of the threads: it executes
+// queued tasks until its group is done, so a pool of 1 runs everything inline.
+// Idle threads, waiting ones included, sleep on sleepCondition until a task
+// is queued or a group finishes.
+class ThreadPool
+{
+    using Job = WorkStealingQueue::Job;
+
+    std::vector<std::unique_ptr<WorkStealingQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+    std::atomic<int> queued{ 0 };
+    std::atomic<unsigned> nextQueue{ 0 };
+    bool stopping = false;
+
+    static thread_local const ThreadPool* currentPool;
+    static thread_local int currentIndex;
+
+    int OwnQueue() const
+    {
+        return (currentPool == this) ? currentIndex : 0;
+    }
+
+    bool TakeJob(int index, Job& job)
+    {
+        if (queues[index]->Pop(job)) {
+            --queued;
+            return true;
+        }
+        int count = (int)queues.size();
+        for (int i = 1; i < count; ++i) {
+            if (queues[(index + i) % count]->Steal(job)) {
+                --queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Execute(Job& job)
+    {
+        job.task();
+        if (--job.group->pending == 0) {
+            // Locking orders this with the check of a Wait about to sleep.
+            { std::lock_guard<std::mutex> lock(sleepMutex); }
+            sleepCondition.notify_all();
+        }
+    }
+
+    void WorkerLoop(int index)
+    {
+        currentPool = this;
+        currentIndex = index;
+        Job job;
+        for (;;) {
+            if (TakeJob(index, job)) {
+                Execute(job);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepCondition.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping) return;
+        }
+    }
+
+public:
+    explicit ThreadPool(int threadCount)
+    {
+        if (threadCount < 1) threadCount = 1;
+        for (int i = 0; i < threadCount; ++i) {
+            queues.push_back(std::make_unique<WorkStealingQueue>());
+        }
+        for (int i = 1; i < threadCount; ++i) {
+            workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        sleepCondition.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int ThreadCount() const { return (int)queues.size(); }
+
+    // Index of the calling thread within the pool, 0 for threads outside it.
+    int CurrentThreadIndex() const { return OwnQueue(); }
+
+    // Tasks queued from a worker go to its own queue; tasks queued from outside
+    // the pool are dealt round-robin so every worker starts with local work.
+    void Run(TaskGroup& group, Task task)
+    {
+        int index = (currentPool == this) ? currentIndex : (int)(nextQueue++ % queues.size());
+        ++group.pending;
+        queues[index]->Push(Job{ std::move(task), &group });
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            ++queued;
+        }
+        sleepCondition.notify_one();
+    }
+
+    void Wait(TaskGroup& group)
+    {
+        int index = OwnQueue();
+        Job job;
+        while (group.pending > 0) {
+            if (TakeJob(index, job)) {
+                Execute(job);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepCondition.wait(lock, [&] { return group.pending == 0 || queued > 0; });
+        }
+    }
+
+    static int HardwareThreads()
+    {
+        unsigned n = std::thread::hardware_concurrency();
+        return n == 0 ? 1 : (int)n;
+    }
+};
+
+thread_local const ThreadPool* ThreadPool::currentPool = nullptr;
+thread_local int ThreadPool::currentIndex = 0;
+
+// Builds a Bvh. Median splits halve a range at the median center along the
+// axis its centers spread most on. Binned surface area heuristic splits bin
+// the primitives of a range by the centers of their boxes along every axis
+// and split at the bin boundary with the lowest estimated cost, or keep a
+// leaf when that is cheaper. Large ranges partition stably and small ones in
+// place, the same way on any number of threads, so the tree depends only on
+// the boxes and the split.
+template <typename Real>
+class BvhBuilder
+{
+    using Node = typename Bvh<Real>::Node;
+
+    static const int binCount = 16;
+    static const int maxLeafSize = 4;
+    static const int chunkSize = 16384;  // primitives per parallel task; larger ranges partition stably
+    static constexpr double traversalCost = 3.0;  // of visiting a node, relative to testing a primitive
+
+    struct Item
+    {
+        BoundingBox<Real> box;
+        int primitive;
+
+        // Twice the center of the box, which bins just as well.
+        Real Center(int axis) const { return box.min[axis] + box.max[axis]; }
+        Vector<Real> Center() const { return box.min + box.max; }
+    };
+
+    struct Bin
+    {
+        BoundingBox<Real> box;
+        int count = 0;
+
+        void Add(const Bin& other)
+        {
+            box.Extend(other.box);
+            count += other.count;
+        }
+    };
+
+    struct Bins
+    {
+        Bin axes[3][binCount];
+
+        void Add(const Bins& other)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+                for (int i = 0; i < binCount; ++i) axes[axis][i].Add(other.axes[axis][i]);
+        }
+    };
+
+    // Bounds of a set of primitives and of their (doubled) centers.
+    struct Bounds
+    {
+        BoundingBox<Real> box;
+        BoundingBox<Real> centers;
+        int count = 0;
+
+        void Add(const Item& item)
+        {
+            box.Extend(item.box);
+            AddCenter(item);
+        }
+
+        // Only counts the item and extends the centers; the box is then
+        // set from the bins.
+        void AddCenter(const Item& item)
+        {
+            centers.Extend(item.Center());
+            ++count;
+        }
+
+        void Add(const Bounds& other)
+        {
+            box.Extend(other.box);
+            centers.Extend(other.centers);
+            count += other.count;
+        }
+    };
+
+    struct Range
+    {
+        int begin, end;
+        Bounds bounds;
+    };
+
+    // Primitives whose centers fall in bins below bin go left.
+    struct Split
+    {
+        int axis, bin;
+    };
+
+    // The tree above the subtrees built as tasks: inner nodes, and leaves
+    // holding a subtree with node indices relative to its own root.
+    struct TopNode
+    {
+        BoundingBox<Real> box;
+        int left = -1, right = -1;
+        std::unique_ptr<std::vector<Node>> subtree;
+    };
+
+    BvhSplit split;
+    std::vector<Item> items;
+    std::vector<Item> scratch;  // stable partitions go through the same range of it
+    ThreadPool* pool;           // null unless it has several threads
+    std::vector<TopNode> top;
+
+    // Calls chunk(begin, end) over [begin, end) in pieces of chunkSize, on
+    // the pool when parallel.
+    template <typename Chunk>
+    void ForChunks(int begin, int end, bool parallel, Chunk&& chunk)
+    {
+        if (!parallel || end - begin <= chunkSize) {
+            for (int b = begin; b < end; b += chunkSize) chunk(b, std::min(b + chunkSize, end));
+            return;
+        }
+        TaskGroup group;
+        for (int b = begin; b < end; b += chunkSize) {
+            int e = std::min(b + chunkSize, end);
+            pool->Run(group, [&chunk, b, e] { chunk(b, e); });
+        }
+        pool->Wait(group);
+    }
+
+    static int ChunkCount(int begin, int end)
+    {
+        return (end - begin + chunkSize - 1) / chunkSize;
+    }
+
+    // Maps centers to bins along the axes the centers of a range spread on.
+    struct Binning
+    {
+        Vector<Real> min;
+        Real scale[3];
+        bool spread[3];
+
+        explicit Binning(const BoundingBox<Real>& centers) : min(centers.min)
+        {
+            for (int axis = 0; axis < 3; ++axis) {
+                spread[axis] = centers.max[axis] > centers.min[axis];
+                scale[axis] = spread[axis] ? binCount / (centers.max[axis] - centers.min[axis]) : 0;
+            }
+        }
+
+        int BinOf(const Item& item, int axis) const
+        {
+            return std::min((int)((item.Center(axis) - min[axis]) * scale[axis]), binCount - 1);
+        }
+    };
+
+    Bounds BoundsOf(int begin, int end, bool parallel)
+    {
+        std::vector<Bounds> partial(ChunkCount(begin, end));
+        ForChunks(begin, end, parallel, [&](int b, int e) {
+            Bounds& bounds = partial[(b - begin) / chunkSize];
+            for (int i = b; i < e; ++i) bounds.Add(items[i]);
+        });
+        Bounds bounds;
+        for (auto& part : partial) bounds.Add(part);
+        return bounds;
+    }
+
+    void BinItems(int begin, int end, const Binning& binning, Bins& bins) const
+    {
+        for (int i = begin; i < end; ++i) {
+            const Item item = items[i];  // a copy, which the bins cannot alias
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!binning.spread[axis]) continue;
+                Bin& bin = bins.axes[axis][binning.BinOf(item, axis)];
+                bin.box.Extend(item.box);
+                ++bin.count;
+            }
+        }
+    }
+
+    void BinRange(const Range& range, const Binning& binning, bool parallel, Bins& bins)
+    {
+        if (!parallel || range.end - range.begin <= chunkSize) {
+            BinItems(range.begin, range.end, binning, bins);
+            return;
+        }
+        std::vector<Bins> partial(ChunkCount(range.begin, range.end));
+        ForChunks(range.begin, range.end, true, [&](int b, int e) {
+            BinItems(b, e, binning, partial[(b - range.begin) / chunkSize]);
+        });
+        for (auto& part : partial) bins.Add(part);
+    }
+
+    // The cheapest split of range, or false when none separates anything or
+    // a leaf is cheaper than any, as long as the range fits in a leaf.
+    bool ChooseSplit(const Range& range, const Binning& binning, const Bins& bins, Split& split) const
+    {
+        int count = range.end - range.begin;
+        double best = (count > maxLeafSize) ? std::numeric_limits<double>::infinity() : count;
+        double area = std::max((double)range.bounds.box.Area(), std::numeric_limits<double>::min());
+        bool found = false;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!binning.spread[axis]) continue;
+            const Bin* bin = bins.axes[axis];
+
+            double rightCost[binCount];
+            Bin right;
+            for (int i = binCount - 1; i > 0; --i) {
+                right.Add(bin[i]);
+                rightCost[i] = right.count ? (double)right.box.Area() * right.count : 0.0;
+            }
+            Bin left;
+            for (int i = 1; i < binCount; ++i) {
+                left.Add(bin[i - 1]);
+                if (left.count == 0 || left.count == count) continue;
+                double cost = traversalCost + ((double)left.box.Area() * left.count + rightCost[i]) / area;
+                if (cost < best) {
+                    best = cost;
+                    split = Split{ axis, i };
+                    found = true;
+                }
+            }
+        }
+        return found;
+    }
+
+    // Partitions range into left, the items goesLeft accepts, and right,
+    // adding each item to the bounds of its side with add. Ranges larger than
+    // a chunk partition stably through scratch, chunk by chunk; smaller ones
+    // in place.
+    template <typename GoesLeft, typename AddItem>
+    void PartitionBy(const Range& range, bool parallel, GoesLeft&& goesLeft, AddItem&& add, Range& left, Range& right)
+    {
+        left.bounds = Bounds();
+        right.bounds = Bounds();
+
+        int chunks = ChunkCount(range.begin, range.end);
+        if (chunks == 1) {
+            int i = range.begin, j = range.end - 1;
+            for (;;) {
+                while (i <= j && goesLeft(items[i])) add(left.bounds, items[i++]);
+                while (i <= j && !goesLeft(items[j])) add(right.bounds, items[j--]);
+                if (i >= j) break;
+                std::swap(items[i], items[j]);
+            }
+        } else {
+            std::vector<Bounds> leftBounds(chunks), rightBounds(chunks);
+            ForChunks(range.begin, range.end, parallel, [&](int b, int e) {
+                int c = (b - range.begin) / chunkSize;
+                for (int i = b; i < e; ++i) add(goesLeft(items[i]) ? leftBounds[c] : rightBounds[c], items[i]);
+            });
+            std::vector<int> leftAt(chunks), rightAt(chunks);
+            int l = range.begin, r = range.begin;
+            for (int c = 0; c < chunks; ++c) r += leftBounds[c].count;
+            for (int c = 0; c < chunks; ++c) {
+                leftAt[c] = l;
+                rightAt[c] = r;
+                l += leftBounds[c].count;
+                r += rightBounds[c].count;
+                left.bounds.Add(leftBounds[c]);
+                right.bounds.Add(rightBounds[c]);
+            }
+            ForChunks(range.begin, range.end, parallel, [&](int b, int e) {
+                int c = (b - range.begin) / chunkSize;
+                int l = leftAt[c], r = rightAt[c];
+                for (int i = b; i < e; ++i) scratch[goesLeft(items[i]) ? l++ : r++] = items[i];
+            });
+            ForChunks(range.begin, range.end, parallel, [&](int b, int e) {
+                std::copy(scratch.begin() + b, scratch.begin() + e, items.begin() + b);
+            });
+        }
+
+        int mid = range.begin + left.bounds.count;
+        left.begin = range.begin;
+        left.end = right.begin = mid;
+        right.end = range.end;
+    }
+
+    // Partitions range by split into left and right, whose boxes come from
+    // the bins.
+    void Partition(const Range& range, const Binning& binning, const Bins& bins, const Split& split, bool parallel,
+        Range& left, Range& right)
+    {
+        PartitionBy(range, parallel,
+            [&](const Item& item) { return binning.BinOf(item, split.axis) < split.bin; },
+            [](Bounds& bounds, const Item& item) { bounds.AddCenter(item); }, left, right);
+        for (int i = 0; i < binCount; ++i) {
+            const Bin& bin = bins.axes[split.axis][i];
+            if (bin.count > 0) (i < split.bin ? left : right).bounds.box.Extend(bin.box);
+        }
+    }
+
+    // Orders items by center along axis, then by primitive, so that every
+    // range has one median whatever order its items are in.
+    static bool Before(const Item& a, const Item& b, int axis)
+    {
+        Real ca = a.Center(axis), cb = b.Center(axis);
+        return ca < cb || (ca == cb && a.primitive < b.primitive);
+    }
+
+    // The item k-th in range by Before. The centers are counted into bins
+    // chunk by chunk, and only the items of the bin holding the k-th are
+    // collected and selected from.
+    Item SelectItem(const Range& range, int axis, int k, bool parallel)
+    {
+        const int bins = 1024;
+        Real min = range.bounds.centers.min[axis];
+        Real extent = range.bounds.centers.max[axis] - min;
+        Real scale = (extent > 0) ? bins / extent : 0;
+        if (!(scale < std::numeric_limits<Real>::max())) scale = 0;  // all in one bin
+        auto binOf = [=](const Item& item) { return std::min((int)((item.Center(axis) - min) * scale), bins - 1); };
+
+        int chunks = ChunkCount(range.begin, range.end);
+        std::vector<std::vector<int>> counts(chunks);
+        ForChunks(range.begin, range.end, parallel, [&](int b, int e) {
+            std::vector<int>& count = counts[(b - range.begin) / chunkSize];
+            count.assign(bins, 0);
+            for (int i = b; i < e; ++i) ++count[binOf(items[i])];
+        });
+        int bin = 0, below = 0;
+        for (;; ++bin) {
+            int inBin = 0;
+            for (auto& count : counts) inBin += count[bin];
+            if (below + inBin > k) break;
+            below += inBin;
+        }
+
+        std::vector<std::vector<Item>> found(chunks);
+        ForChunks(range.begin, range.end, parallel, [&](int b, int e) {
+            std::vector<Item>& chunk = found[(b - range.begin) / chunkSize];
+            for (int i = b; i < e; ++i) {
+                if (binOf(items[i]) == bin) chunk.push_back(items[i]);
+            }
+        });
+        std::vector<Item> candidates;
+        for (auto& chunk : found) candidates.insert(candidates.end(), chunk.begin(), chunk.end());
+        auto kth = candidates.begin() + (k - below);
+        std::nth_element(candidates.begin(), kth, candidates.end(),
+            [axis](const Item& a, const Item& b) { return Before(a, b, axis); });
+        return *kth;
+    }
+
+    // Halves range at the median along the axis its centers spread most on.
+    // Parallel ranges larger than a chunk select the median and partition
+    // around it chunk by chunk; others select in place. Both give the same
+    // halves, only in another order, and leaves are sorted.
+    void SplitMedian(const Range& range, bool parallel, Range& left, Range& right)
+    {
+        int axis = range.bounds.centers.LongestAxis();
+        int count = range.end - range.begin;
+        if (parallel && count > chunkSize) {
+            Item median = SelectItem(range, axis, count / 2, parallel);
+            PartitionBy(range, parallel, [&](const Item& item) { return Before(item, median, axis); },
+                [](Bounds& bounds, const Item& item) { bounds.Add(item); }, left, right);
+            return;
+        }
+        int mid = range.begin + count / 2;
+        std::nth_element(items.begin() + range.begin, items.begin() + mid, items.begin() + range.end,
+            [axis](const Item& a, const Item& b) { return Before(a, b, axis); });
+        left = Range{ range.begin, mid, BoundsOf(range.begin, mid, false) };
+        right = Range{ mid, range.end, BoundsOf(mid, range.end, false) };
+    }
+
+    // Levels of median splits below a range of count primitives.
+    static int MedianLevels(int count)
+    {
+        int levels = 0;
+        while ((int64_t)maxLeafSize << levels < count) ++levels;
+        return levels;
+    }
+
+    // Splits range in two, or returns false to keep it as a leaf. A surface
+    // area split may leave all but one primitive on one side, so it is only
+    // taken while median splits of that side would still end within
+    // Bvh::MaxDepth; below that the range splits at the median.
+    bool SplitRange(const Range& range, int depth, bool parallel, Range& left, Range& right)
+    {
+        // Any split costs at least a traversal, so no smaller range splits.
+        int count = range.end - range.begin;
+        if (count <= traversalCost) return false;
+
+        if (split == BvhSplit::Sah && depth + 1 + MedianLevels(count - 1) <= Bvh<Real>::MaxDepth) {
+            Binning binning(range.bounds.centers);
+            Bins bins;
+            Split best;
+            BinRange(range, binning, parallel, bins);
+            if (ChooseSplit(range, binning, bins, best)) {
+                Partition(range, binning, bins, best, parallel, left, right);
+                return true;
+            }
+        }
+        if (count <= maxLeafSize) return false;
+
+        SplitMedian(range, parallel, left, right);
+        return true;
+    }
+
+    // Builds range depth-first into nodes on the calling thread.
+    int Subtree(const Range& range, int depth, std::vector<Node>& nodes)
+    {
+        int index = (int)nodes.size();
+        nodes.push_back(Node{ range.bounds.box, range.begin, range.end - range.begin });
+        Range left, right;
+        if (!SplitRange(range, depth, false, left, right)) {
+            // Serial and parallel splits leave a leaf's items in different
+            // orders, so they are put in primitive order.
+            std::sort(items.begin() + range.begin, items.begin() + range.end,
+                [](const Item& a, const Item& b) { return a.primitive < b.primitive; });
+            return index;
+        }
+
+        Subtree(left, depth + 1, nodes);
+        int rightIndex = Subtree(right, depth + 1, nodes);
+        nodes[index].start = rightIndex;
+        nodes[index].count = 0;
+        return index;
+    }
+
+    // Splits the top levels with parallel binning and partitioning, and
+    // hands ranges of at most subtreeSize primitives to tasks.
+    int Top(const Range& range, int depth, int subtreeSize, TaskGroup& group)
+    {
+        int index = (int)top.size();
+        top.emplace_back();
+        top[index].box = range.bounds.box;
+
+        Range left, right;
+        if (range.end - range.begin <= subtreeSize || !SplitRange(range, depth, true, left, right)) {
+            top[index].subtree = std::make_unique<std::vector<Node>>();
+            std::vector<Node>* nodes = top[index].subtree.get();
+            pool->Run(group, [this, range, depth, nodes] { Subtree(range, depth, *nodes); });
+            return index;
+        }
+        int leftIndex = Top(left, depth + 1, subtreeSize, group);
+        int rightIndex = Top(right, depth + 1, subtreeSize, group);
+        top[index].left = leftIndex;
+        top[index].right = rightIndex;
+        return index;
+    }
+
+    // Lays the top tree and its subtrees out depth-first.
+    void Emit(int index, PoolArray<Node>& nodes)
+    {
+        TopNode& node = top[index];
+        if (node.subtree) {
+            int offset = (int)nodes.size();
+            for (Node n : *node.subtree) {
+                if (n.count == 0) n.start += offset;
+                nodes.push_back(n);
+            }
+            return;
+        }
+        int at = (int)nodes.size();
+        nodes.push_back(Node{ node.box, 0, 0 });
+        Emit(node.left, nodes);
+        nodes[at].start = (int)nodes.size();
+        Emit(node.right, nodes);
+    }
+
+public:
+    BvhBuilder(const std::vector<BoundingBox<Real>>& boxes, ThreadPool* pool, BvhSplit split) :
+        split(split), items(boxes.size()), scratch(boxes.size()), pool((pool && pool->ThreadCount() > 1) ? pool : nullptr)
+    {
+        ForChunks(0, (int)boxes.size(), this->pool != nullptr, [&](int b, int e) {
+            for (int i = b; i < e; ++i) items[i] = Item{ boxes[i], i };
+        });
+    }
+
+    void Build(Bvh<Real>& bvh)
+    {
+        bvh.nodes.clear();
+        bvh.order.clear();
+        int count = (int)items.size();
+        if (count == 0) return;
+
+        Range all{ 0, count, BoundsOf(0, count, pool != nullptr) };
+        if (pool) {
+            TaskGroup group;
+            int subtreeSize = std::max(chunkSize, count / (pool->ThreadCount() * 4));
+            Top(all, 0, subtreeSize, group);
+            pool->Wait(group);
+            bvh.nodes.reserve(2 * count / maxLeafSize + top.size());
+            Emit(0, bvh.nodes);
+        } else {
+            std::vector<Node> nodes;
+            nodes.reserve(2 * count / maxLeafSize + 1);
+            Subtree(all, 0, nodes);
+            bvh.nodes.reserve(nodes.size());
+            for (auto& node : nodes) bvh.nodes.push_back(node);
+        }
+
+        bvh.order.reserve(count);
+        for (auto& item : items) bvh.order.push_back(item.primitive);
+    }
+};
+
+template <typename Real>
+void Bvh<Real>::Build(const std::vector<BoundingBox<Real>>& boxes, ThreadPool* pool, BvhSplit split)
+{
+    BvhBuilder<Real>(boxes, pool, split).Build(*this);
+}
+
+struct Tile
+{
+    int x0, y0, x1, y1;
+};
+
+// Tiles of tileSize pixels covering a w x h frame, numbered row by row.
+struct TileGrid
+{
+    int w, h, tileSize, columns, rows;
+
+    TileGrid(int w, int h, int tileSize) :
+        w(w), h(h), tileSize(tileSize), columns((w + tileSize - 1) / tileSize), rows((h + tileSize - 1) / tileSize)
+    {}
+
+    int Count() const { return columns * rows; }
+
+    Tile At(int index) const
+    {
+        int x = (index % columns) * tileSize;
+        int y = (index / columns) * tileSize;
+        return Tile{ x, y, std::min(x + tileSize, w), std::min(y + tileSize, h) };
+    }
+};
+
+// Spreads the low 10 bits of v to every third bit.
+inline uint32_t SpreadBits(uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+const uint64_t ReorderIndexMask = (uint64_t(1) << 31) - 1;
+
+// Sort key for reordering rays: the direction octant in the top 3 bits, the
+// 30-bit Morton code of the origin within bounds below it, and the ray's
+// index, which must fit ReorderIndexMask, in the low 31 bits.
+template <typename Real>
+uint64_t ReorderKey(const Ray<Real>& ray, const BoundingBox<Real>& bounds, uint32_t index)
+{
+    Vector<Real> extent = bounds.max - bounds.min;
+    auto cell = [](Real v, Real lo, Real size) {
+        return (size > 0) ? (uint32_t)std::min(Real(1023), (v - lo) * (Real(1023) / size)) : 0u;
+    };
+    uint64_t octant = (ray.dir.x < 0 ? 4 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 1 : 0);
+    uint64_t morton = (SpreadBits(cell(ray.start.x, bounds.min.x, extent.x)) << 2)
+        | (SpreadBits(cell(ray.start.y, bounds.min.y, extent.y)) << 1)
+        | SpreadBits(cell(ray.start.z, bounds.min.z, extent.z));
+    return (octant << 61) | (morton << 31) | (index & ReorderIndexMask);
+}
+
+// Lights a recorded path keeps a shadow bit for.
+const int PathMaxLights = 64;
+
+// One shaded bounce of a traced path, kept so the path can be shaded again
+// when lights move without tracing its rays again.
+template <typename Real>
+struct PathVertex
+{
+    Real dist;                 // along the ray that found the hit
+    Vector<Real> origin;       // of the shadow and reflection rays
+    Vector<Real> normal;
+    Vector<Real> reflectDir;
+    SurfacePropreties<Real> surface;
+    uint64_t shadowed;         // bit per light
+};
+
+template <typename Real>
+class RayTracerEngine
+{
+    template <typename> friend class BenchmarkSuite;
+    template <typename> friend class IncrementalRenderer;
+
+    static const int maxDepth = 5;
+    Scene<Real>& scene;
+    Acceleration acceleration;
+    SceneLayout layout;
+    SimdIsa packets;
+    bool wavefront;
+    bool reorder;
+    PacketKernels<Real> packetKernels;
+    float outputScale;  // 255 times the exposure
+    PixelConverter convert;
+
+    static const int LinearBandPixels = 65536;  // linear pixels buffered per thread for 8-bit output
+
+    bool GetClosestIntersection(const Ray<Real>& ray, Intersection<Real>& hit)
+    {
+        hit = Intersection<Real>{ FarAway<Real>, 0, nullptr };
+
+        if (acceleration == Acceleration::Bvh) {
+            for (auto thing : scene.unbounded) {
+                thing->IntersectCloser(ray, hit);
+            }
+            scene.bvh.Intersect(ray, hit.dist, [&](int start, int count) {
+                for (int i = start; i < start + count; ++i) {
+                    scene.bvhThings[i]->IntersectCloser(ray, hit);
+                }
+            });
+            return hit.thing != nullptr;
+        }
+
+        if (acceleration == Acceleration::Grid) {
+            for (auto thing : scene.unbounded) {
+                thing->IntersectCloser(ray, hit);
+            }
+            scene.grid.Intersect(ray, hit.dist, [&](const int* begin, const int* end) {
+                for (; begin != end; ++begin) {
+                    scene.gridThings[*begin]->IntersectCloser(ray, hit);
+                }
+            });
+            return hit.thing != nullptr;
+        }
+
+        for (auto& thing : scene.things) {
+            thing->IntersectCloser(ray, hit);
+        }
+        return hit.thing != nullptr;
+    }
+
+    // Stops at the first thing hit within maxDist. The closest hit is within
+    // maxDist exactly when any hit is, so shadows match a closest-hit test.
+    bool IsOccluded(const Ray<Real>& ray, Real maxDist)
+    {
+        if (layout == SceneLayout::Pools) {
+            return scene.pools.IsOccluded(ray, maxDist);
+        }
+
+        if (acceleration == Acceleration::Bvh) {
+            for (auto thing : scene.unbounded) {
+                if (thing->IsOccluded(ray, maxDist)) return true;
+            }
+            return scene.bvh.IsOccluded(ray, maxDist, [&](int start, int count) {
+                for (int i = start; i < start + count; ++i) {
+                    if (scene.bvhThings[i]->IsOccluded(ray, maxDist)) return true;
+                }
+                return false;
+            });
+        }
+
+        if (acceleration == Acceleration::Grid) {
+            for (auto thing : scene.unbounded) {
+                if (thing->IsOccluded(ray, maxDist)) return true;
+            }
+            return scene.grid.IsOccluded(ray, maxDist, [&](const int* begin, const int* end) {
+                for (; begin != end; ++begin) {
+                    if (scene.gridThings[*begin]->IsOccluded(ray, maxDist)) return true;
+                }
+                return false;
+            });
+        }
+
+        for (auto& thing : scene.things) {
+            if (thing->IsOccluded(ray, maxDist)) return true;
+        }
+        return false;
+    }
+
+    Color<Real> TraceRay(const Ray<Real>& ray, int depth)
+    {
+        RayKind kind = (depth == 0) ? PrimaryRay : ReflectionRay;
+        if (layout == SceneLayout::Pools) {
+            PoolHit<Real> hit;
+            bool found = scene.pools.Intersect(ray, hit);
+            CountRay(kind, depth, found);
+            if (found) {
+                return Shade(ray, hit, depth);
+            }
+            return Color<Real>::Background;
+        }
+
+        Intersection<Real> isect;
+        bool found = GetClosestIntersection(ray, isect);
+        CountRay(kind, depth, found);
+        if (found) {
+            return Shade(ray, isect, depth);
+        }
+        return Color<Real>::Background;
+    }
+
+    Color<Real> Shade(const Ray<Real>& ray, const Intersection<Real>& isect, int depth)
+    {
+        Vector<Real> d = ray.dir;
+        Vector<Real> pos = (d * isect.dist) + ray.start;
+        Vector<Real> normal;
+        SurfacePropreties<Real> surface;
+        isect.thing->Describe(isect, pos, normal, surface);
+        return ShadePoint(d, pos, normal, surface, depth);
+    }
+
+    Color<Real> Shade(const Ray<Real>& ray, const PoolHit<Real>& hit, int depth)
+    {
+        Vector<Real> d = ray.dir;
+        Vector<Real> pos = (d * hit.dist) + ray.start;
+        Vector<Real> normal = scene.pools.GetNormal(hit, pos);
+        SurfacePropreties<Real> surface = scene.pools.GetSurfaceProperties(hit, pos);
+        return ShadePoint(d, pos, normal, surface, depth);
+    }
+
+    // Reflection and shadow rays leave from pos, moved off the surface by the
+    // precision's RayOffset.
+    static Vector<Real> SecondaryOrigin(const Vector<Real>& pos, const Vector<Real>& normal)
+    {
+        if constexpr (RealTraits<Real>::RayOffset == 0) {
+            return pos;
+        } else {
+            Real scale = std::max({ std::fabs(pos.x), std::fabs(pos.y), std::fabs(pos.z), Real(1) });
+            return pos + normal * (RealTraits<Real>::RayOffset * scale);
+        }
+    }
+
+    Color<Real> ShadePoint(const Vector<Real>& d, const Vector<Real>& pos, const Vector<Real>& normal, const SurfacePropreties<Real>& surface, int depth)
+    {
+        Vector<Real> reflectDir = (d - ((normal * (normal * d)) * 2)).Norm();
+        Vector<Real> origin = SecondaryOrigin(pos, normal);
+
+        Color<Real> naturalColor = Color<Real>::Background + GetNaturalColor(surface, origin, normal, reflectDir, depth);
+        Color<Real> reflectedColor = (depth >= maxDepth) ? Color<Real>::Grey : GetReflectionColor(surface, origin, reflectDir, depth);
+
+        return naturalColor + reflectedColor;
+    }
+
+    Color<Real> GetReflectionColor(const SurfacePropreties<Real>& surface, const Vector<Real>& pos, const Vector<Real>& reflectDir, int depth)
+    {
+        Ray<Real>    ray(pos, reflectDir);
+        Color<Real>  color = TraceRay(ray, depth + 1);
+        return color.Scale(surface.Reflect);
+    }
+
+    Color<Real> GetNaturalColor(const SurfacePropreties<Real>& surface, const Vector<Real>& pos, const Vector<Real>& norm, const Vector<Real>& reflectDir, int depth)
+    {
+        Color<Real> result = Color<Real>::Black;
+        for (auto& light : scene.lights)
+        {
+            Vector<Real> ldis = light.pos - pos;
+            Vector<Real> livec = ldis.Norm();
+            Ray<Real> ray{ pos, livec };
+
+            bool isInShadow = IsOccluded(ray, ldis.Length());
+            CountRay(ShadowRay, depth, isInShadow);
+
+            if (!isInShadow) {
+                result = AddLight(result, surface, light, livec * norm, livec * reflectDir);
+            }
+        }
+        return result;
+    }
+
+    // Adds the diffuse and specular light of one unshadowed light to result.
+    Color<Real> AddLight(const Color<Real>& result, const SurfacePropreties<Real>& surface, const Light<Real>& light, Real illum, Real specular) const
+    {
+        Color<Real> lcolor = (illum > 0) ? (light.color.Scale(illum)) : Color<Real>::DefaultColor;
+        Color<Real> scolor = (specular > 0) ? (light.color.Scale(std::pow(specular, surface.Roughness))) : Color<Real>::DefaultColor;
+        return result + lcolor * surface.Diffuse + scolor * surface.Specular;
+    }
+
+    // One step of composing a path's color from its last bounce back to its
+    // first, in the order ShadePoint composes the recursion. color is what
+    // the bounce after depth sees.
+    static Color<Real> FoldBounce(const Color<Real>& color, const Color<Real>& natural, Real reflect, int depth)
+    {
+        Color<Real> reflectedColor = (depth >= maxDepth) ? color : color.Scale(reflect);
+        return (Color<Real>::Background + natural) + reflectedColor;
+    }
+
+    // Closest hit of ray with what shading it needs.
+    bool FindSurface(const Ray<Real>& ray, int depth, Real& dist, Vector<Real>& pos, Vector<Real>& normal, SurfacePropreties<Real>& surface)
+    {
+        RayKind kind = (depth == 0) ? PrimaryRay : ReflectionRay;
+        if (layout == SceneLayout::Pools) {
+            PoolHit<Real> hit;
+            bool found = scene.pools.Intersect(ray, hit);
+            CountRay(kind, depth, found);
+            if (!found) return false;
+            dist = hit.dist;
+            pos = (ray.dir * hit.dist) + ray.start;
+            normal = scene.pools.GetNormal(hit, pos);
+            surface = scene.pools.GetSurfaceProperties(hit, pos);
+            return true;
+        }
+
+        Intersection<Real> isect;
+        bool found = GetClosestIntersection(ray, isect);
+        CountRay(kind, depth, found);
+        if (!found) return false;
+        dist = isect.dist;
+        pos = (ray.dir * isect.dist) + ray.start;
+        isect.thing->Describe(isect, pos, normal, surface);
+        return true;
+    }
+
+    // Traces ray as TraceRay does and appends each bounce it shades to path.
+    // The path ends in a miss unless it holds maxDepth + 1 bounces.
+    void TracePath(Ray<Real> ray, std::vector<PathVertex<Real>>& path)
+    {
+        for (int depth = 0; ; ++depth) {
+            PathVertex<Real> vertex;
+            Vector<Real> pos;
+            if (!FindSurface(ray, depth, vertex.dist, pos, vertex.normal, vertex.surface)) return;
+            vertex.reflectDir = (ray.dir - ((vertex.normal * (vertex.normal * ray.dir)) * 2)).Norm();
+            vertex.origin = SecondaryOrigin(pos, vertex.normal);
+            vertex.shadowed = 0;
+            for (int light = 0; light < (int)scene.lights.size(); ++light) {
+                if (IsShadowed(vertex, light, depth)) vertex.shadowed |= uint64_t(1) << light;
+            }
+            path.push_back(vertex);
+            if (depth >= maxDepth) return;
+            ray = Ray<Real>(vertex.origin, vertex.reflectDir);
+        }
+    }
+
+    bool IsShadowed(const PathVertex<Real>& vertex, int light, int depth)
+    {
+        Vector<Real> ldis = scene.lights[light].pos - vertex.origin;
+        bool isInShadow = IsOccluded(Ray<Real>(vertex.origin, ldis.Norm()), ldis.Length());
+        CountRay(ShadowRay, depth, isInShadow);
+        return isInShadow;
+    }
+
+    // Color of a recorded path under the current lights and the shadow bits
+    // it holds; the same color TraceRay gives while nothing has changed.
+    Color<Real> ResolvePath(const PathVertex<Real>* path, int count) const
+    {
+        Color<Real> color = (count > maxDepth) ? Color<Real>::Grey : Color<Real>::Background;
+        for (int depth = count - 1; depth >= 0; --depth) {
+            const PathVertex<Real>& vertex = path[depth];
+            Color<Real> natural = Color<Real>::Black;
+            for (int light = 0; light < (int)scene.lights.size(); ++light) {
+                if (vertex.shadowed & (uint64_t(1) << light)) continue;
+                Vector<Real> livec = (scene.lights[light].pos - vertex.origin).Norm();
+                natural = AddLight(natural, vertex.surface, scene.lights[light], livec * vertex.normal, livec * vertex.reflectDir);
+            }
+            color = FoldBounce(color, natural, vertex.surface.Reflect, depth);
+        }
+        return color;
+    }
+
+    // Traces the pixels of one tile of a w x h frame; the whole frame is just
+    // one big tile. pixels points at the tile's top left pixel in a buffer of
+    // stride pixels per row.
+    void RenderTile(LinearRgb* pixels, size_t stride, int w, int h, const Tile& tile, const Camera<Real>& camera)
+    {
+        Ray<Real> ray(camera.pos, Vector<Real>());
+
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            LinearRgb* row = pixels + (y - tile.y0) * stride - tile.x0;
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                ray.dir = camera.GetPoint(x, y, w, h);
+                row[x] = TraceRay(ray, 0).ToLinear();
+            }
+        }
+    }
+
+    PoolHit<Real> ToPoolHit(const PacketHit<Real>& hit, int lane) const
+    {
+        int index = (int)hit.index[lane];
+        int planeCount = scene.pools.planes.Size();
+        return (index < planeCount)
+            ? PoolHit<Real>{ hit.dist[lane], index, PrimitiveKind::Plane }
+            : PoolHit<Real>{ hit.dist[lane], index - planeCount, PrimitiveKind::Sphere };
+    }
+
+    // Traces primary rays a packet at a time; secondary rays diverge after the
+    // first bounce, so shading continues one ray at a time.
+    void RenderTilePackets(LinearRgb* pixels, size_t stride, int w, int h, const Tile& tile, const Camera<Real>& camera)
+    {
+        RayPacket<Real> rays;
+        PacketHit<Real> hit;
+        for (int k = 0; k < PacketSize<Real>; ++k) {
+            rays.ox[k] = camera.pos.x;
+            rays.oy[k] = camera.pos.y;
+            rays.oz[k] = camera.pos.z;
+        }
+
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            LinearRgb* row = pixels + (y - tile.y0) * stride - tile.x0;
+            for (int x = tile.x0; x < tile.x1; x += PacketSize<Real>) {
+                int lanes = std::min(PacketSize<Real>, tile.x1 - x);
+                for (int k = 0; k < PacketSize<Real>; ++k) {
+                    // Partial packets repeat their last pixel in the unused lanes.
+                    Vector<Real> dir = camera.GetPoint(x + std::min(k, lanes - 1), y, w, h);
+                    rays.dx[k] = dir.x;
+                    rays.dy[k] = dir.y;
+                    rays.dz[k] = dir.z;
+                    rays.ix[k] = Real(1) / dir.x;
+                    rays.iy[k] = Real(1) / dir.y;
+                    rays.iz[k] = Real(1) / dir.z;
+                }
+
+                IntersectPacket(packetKernels, scene.pools, rays, hit);
+
+                for (int k = 0; k < lanes; ++k) {
+                    CountRay(PrimaryRay, 0, hit.index[k] >= 0);
+                    Color<Real> color = Color<Real>::Background;
+                    if (hit.index[k] >= 0) {
+                        Ray<Real> ray(camera.pos, Vector<Real>(rays.dx[k], rays.dy[k], rays.dz[k]));
+                        color = Shade(ray, ToPoolHit(hit, k), 0);
+                    }
+                    row[x + k] = color.ToLinear();
+                }
+            }
+        }
+    }
+
+    // Wavefront tracing runs the recursion of TraceRay breadth first. A batch
+    // of pixels starts as a queue of primary rays; each wave intersects the
+    // whole queue, shades the hits into a shadow queue and a reflection queue,
+    // resolves the shadow queue, and hands the reflection queue to the next
+    // wave. Each bounce keeps its direct light and reflectance, and a pixel's
+    // color is folded from its last bounce back to the first, so it rounds
+    // exactly as the recursive evaluation does.
+    static const int WavefrontBatch = 4096;  // pixels traced together
+
+    struct WavefrontRay
+    {
+        Ray<Real> ray;
+        int path;
+    };
+
+    struct ShadowQuery
+    {
+        Ray<Real> ray;
+        Real maxDist;
+        int hit;    // wave index of the shaded hit
+        int light;
+        Real illum, specular;
+    };
+
+    struct Bounce
+    {
+        Color<Real> natural;
+        Real reflect;
+    };
+
+    struct WavefrontPath
+    {
+        Color<Real> terminal;  // Background after a miss, Grey past maxDepth
+        int bounces;
+    };
+
+    struct Wavefront
+    {
+        std::vector<WavefrontPath> paths;
+        std::vector<Bounce> bounces;  // maxDepth + 1 per path
+        std::vector<WavefrontRay> rays;
+        std::vector<WavefrontRay> reflections;
+        std::vector<ShadowQuery> shadows;
+        std::vector<char> found;
+        std::vector<PoolHit<Real>> poolHits;
+        std::vector<Intersection<Real>> objectHits;
+        std::vector<Vector<Real>> positions;
+        std::vector<Vector<Real>> normals;
+        std::vector<SurfacePropreties<Real>> surfaces;
+        std::vector<std::vector<int>> materialBatches;  // hit indices per MaterialKind
+        std::vector<uint64_t> keys;
+
+        Bounce& At(int path, int depth) { return bounces[(size_t)path * (maxDepth + 1) + depth]; }
+    };
+
+    void IntersectWave(Wavefront& wave, int depth)
+    {
+        size_t count = wave.rays.size();
+        wave.found.resize(count);
+        if (layout == SceneLayout::Pools) {
+            wave.poolHits.assign(count, PoolHit<Real>());
+            size_t i = 0;
+            if (packets != SimdIsa::None) {
+                RayPacket<Real> packet;
+                PacketHit<Real> hit;
+                for (; i + PacketSize<Real> <= count; i += PacketSize<Real>) {
+                    for (int k = 0; k < PacketSize<Real>; ++k) {
+                        const Ray<Real>& ray = wave.rays[i + k].ray;
+                        packet.ox[k] = ray.start.x;
+                        packet.oy[k] = ray.start.y;
+                        packet.oz[k] = ray.start.z;
+                        packet.dx[k] = ray.dir.x;
+                        packet.dy[k] = ray.dir.y;
+                        packet.dz[k] = ray.dir.z;
+                        packet.ix[k] = Real(1) / ray.dir.x;
+                        packet.iy[k] = Real(1) / ray.dir.y;
+                        packet.iz[k] = Real(1) / ray.dir.z;
+                    }
+                    IntersectPacket(packetKernels, scene.pools, packet, hit);
+                    for (int k = 0; k < PacketSize<Real>; ++k) {
+                        wave.found[i + k] = hit.index[k] >= 0;
+                        if (wave.found[i + k]) wave.poolHits[i + k] = ToPoolHit(hit, k);
+                    }
+                }
+            }
+            for (; i < count; ++i) {
+                wave.found[i] = scene.pools.Intersect(wave.rays[i].ray, wave.poolHits[i]);
+            }
+        } else {
+            wave.objectHits.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                wave.found[i] = GetClosestIntersection(wave.rays[i].ray, wave.objectHits[i]);
+            }
+        }
+
+        RayKind kind = (depth == 0) ? PrimaryRay : ReflectionRay;
+        for (size_t i = 0; i < count; ++i) CountRay(kind, depth, wave.found[i] != 0);
+    }
+
+    template <MaterialKind Kind>
+    void EvaluateMaterialBatch(Wavefront& wave)
+    {
+        for (int i : wave.materialBatches[(size_t)Kind]) {
+            wave.surfaces[i] = Material<Real, Kind>::Evaluate(wave.positions[i]);
+        }
+    }
+
+    template <size_t... Kinds>
+    void EvaluateMaterialBatches(Wavefront& wave, std::index_sequence<Kinds...>)
+    {
+        (EvaluateMaterialBatch<(MaterialKind)Kinds>(wave), ...);
+    }
+
+    // Does the work of ShadePoint for every hit of the wave, queueing the
+    // shadow and reflection rays instead of tracing them. Pool hits are
+    // grouped by material kind and each group is shaded by its own Material.
+    void ShadeWave(Wavefront& wave, int depth)
+    {
+        size_t count = wave.rays.size();
+        wave.positions.resize(count);
+        wave.normals.resize(count);
+        wave.surfaces.resize(count);
+        wave.materialBatches.resize((size_t)MaterialKind::Count);
+        for (auto& batch : wave.materialBatches) batch.clear();
+
+        for (size_t i = 0; i < count; ++i) {
+            if (!wave.found[i]) continue;
+            const Ray<Real>& ray = wave.rays[i].ray;
+            if (layout == SceneLayout::Pools) {
+                const PoolHit<Real>& hit = wave.poolHits[i];
+                wave.positions[i] = (ray.dir * hit.dist) + ray.start;
+                wave.normals[i] = scene.pools.GetNormal(hit, wave.positions[i]);
+                wave.materialBatches[(size_t)scene.pools.GetMaterialKind(hit)].push_back((int)i);
+            } else {
+                const Intersection<Real>& isect = wave.objectHits[i];
+                wave.positions[i] = (ray.dir * isect.dist) + ray.start;
+                isect.thing->Describe(isect, wave.positions[i], wave.normals[i], wave.surfaces[i]);
+            }
+        }
+        EvaluateMaterialBatches(wave, std::make_index_sequence<(size_t)MaterialKind::Count>());
+
+        wave.shadows.clear();
+        wave.reflections.clear();
+        for (size_t i = 0; i < count; ++i) {
+            int path = wave.rays[i].path;
+            if (!wave.found[i]) {
+                wave.paths[path].terminal = Color<Real>::Background;
+                continue;
+            }
+
+            const Vector<Real>& d = wave.rays[i].ray.dir;
+            const Vector<Real>& normal = wave.normals[i];
+            Vector<Real> reflectDir = (d - ((normal * (normal * d)) * 2)).Norm();
+            Vector<Real> origin = SecondaryOrigin(wave.positions[i], normal);
+
+            wave.At(path, depth) = Bounce{ Color<Real>::Black, wave.surfaces[i].Reflect };
+            wave.paths[path].bounces = depth + 1;
+            for (int light = 0; light < (int)scene.lights.size(); ++light) {
+                Vector<Real> ldis = scene.lights[light].pos - origin;
+                Vector<Real> livec = ldis.Norm();
+                wave.shadows.push_back(ShadowQuery{ Ray<Real>(origin, livec), ldis.Length(), (int)i, light, livec * normal, livec * reflectDir });
+            }
+
+            if (depth >= maxDepth) {
+                wave.paths[path].terminal = Color<Real>::Grey;
+            } else {
+                wave.reflections.push_back(WavefrontRay{ Ray<Real>(origin, reflectDir), path });
+            }
+        }
+    }
+
+    // Shadow queries are queued per hit in light order, so each bounce sums
+    // its lights in the same order as GetNaturalColor.
+    void TraceShadows(Wavefront& wave, int depth)
+    {
+        for (const ShadowQuery& query : wave.shadows) {
+            bool isInShadow = IsOccluded(query.ray, query.maxDist);
+            CountRay(ShadowRay, depth, isInShadow);
+            if (isInShadow) continue;
+
+            Color<Real>& result = wave.At(wave.rays[query.hit].path, depth).natural;
+            result = AddLight(result, wave.surfaces[query.hit], scene.lights[query.light], query.illum, query.specular);
+        }
+    }
+
+    // Sorts the wave's rays by direction octant, then by the Morton code of
+    // their origin within the wave's bounds, so neighbouring rays traverse the
+    // same part of the scene and packets stay coherent. The order of the rays
+    // does not change the result: every path still sums its own lights in
+    // light order.
+    void ReorderWave(Wavefront& wave)
+    {
+        size_t count = wave.rays.size();
+        if (count < 2) return;
+
+        BoundingBox<Real> bounds;
+        for (auto& ray : wave.rays) bounds.Extend(ray.ray.start);
+
+        wave.keys.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            wave.keys[i] = ReorderKey(wave.rays[i].ray, bounds, (uint32_t)i);
+        }
+        std::sort(wave.keys.begin(), wave.keys.end());
+
+        wave.reflections.clear();
+        for (uint64_t key : wave.keys) wave.reflections.push_back(wave.rays[key & ReorderIndexMask]);
+        std::swap(wave.rays, wave.reflections);
+    }
+
+    void RenderTileWavefront(LinearRgb* pixels, size_t stride, int w, int h, const Tile& tile, const Camera<Real>& camera)
+    {
+        Wavefront wave;
+        int batchRows = std::max(1, WavefrontBatch / (tile.x1 - tile.x0));
+        for (int y0 = tile.y0; y0 < tile.y1; y0 += batchRows) {
+            int y1 = std::min(y0 + batchRows, tile.y1);
+            int pathCount = (y1 - y0) * (tile.x1 - tile.x0);
+            wave.paths.assign(pathCount, WavefrontPath{ Color<Real>::Background, 0 });
+            wave.bounces.resize((size_t)pathCount * (maxDepth + 1));
+
+            wave.rays.clear();
+            for (int y = y0; y < y1; ++y) {
+                for (int x = tile.x0; x < tile.x1; ++x) {
+                    wave.rays.push_back(WavefrontRay{ Ray<Real>(camera.pos, camera.GetPoint(x, y, w, h)), (int)wave.rays.size() });
+                }
+            }
+
+            for (int depth = 0; !wave.rays.empty(); ++depth) {
+                if (reorder && depth > 0) ReorderWave(wave);
+                IntersectWave(wave, depth);
+                ShadeWave(wave, depth);
+                TraceShadows(wave, depth);
+                std::swap(wave.rays, wave.reflections);
+            }
+
+            int path = 0;
+            for (int y = y0; y < y1; ++y) {
+                LinearRgb* row = pixels + (y - tile.y0) * stride - tile.x0;
+                for (int x = tile.x0; x < tile.x1; ++x, ++path) {
+                    Color<Real> color = wave.paths[path].terminal;
+                    for (int depth = wave.paths[path].bounces - 1; depth >= 0; --depth) {
+                        const Bounce& bounce = wave.At(path, depth);
+                        color = FoldBounce(color, bounce.natural, bounce.reflect, depth);
+                    }
+                    row[x] = color.ToLinear();
+                }
+            }
+        }
+    }
+
+    void TraceTile(LinearRgb* pixels, size_t stride, int w, int h, const Tile& tile, const Camera<Real>& camera)
+    {
+        if (wavefront) {
+            RenderTileWavefront(pixels, stride, w, h, tile, camera);
+        } else if (packets != SimdIsa::None) {
+            RenderTilePackets(pixels, stride, w, h, tile, camera);
+        } else {
+            RenderTile(pixels, stride, w, h, tile, camera);
+        }
+    }
+
+    // rows points at row tile.y0 of a buffer w pixels wide.
+    void RenderAnyTile(LinearRgb* rows, int w, int h, const Tile& tile, const Camera<Real>& camera)
+    {
+        TileTimer timer(tile.x0, tile.y0, tile.x1, tile.y1);
+        TraceTile(rows + tile.x0, w, w, h, tile, camera);
+    }
+
+    // Traces the tile a band of rows at a time into a linear buffer of the
+    // thread's, then converts each band to 8-bit a row at a time. Bands keep
+    // the buffer small when the tile is the whole frame.
+    void RenderAnyTile(RgbColor* rows, int w, int h, const Tile& tile, const Camera<Real>& camera)
+    {
+        static thread_local std::vector<LinearRgb> linear;
+        TileTimer timer(tile.x0, tile.y0, tile.x1, tile.y1);
+        int width = tile.x1 - tile.x0;
+        int bandRows = std::max(1, LinearBandPixels / width);
+        linear.resize((size_t)width * std::min(bandRows, tile.y1 - tile.y0));
+        for (int y0 = tile.y0; y0 < tile.y1; y0 += bandRows) {
+            Tile band{ tile.x0, y0, tile.x1, std::min(y0 + bandRows, tile.y1) };
+            TraceTile(&linear[0], width, w, h, band, camera);
+            for (int y = band.y0; y < band.y1; ++y) {
+                convert(&linear[(size_t)(y - band.y0) * width], rows + (size_t)(y - tile.y0) * w + tile.x0, width, outputScale);
+            }
+        }
+    }
+
+    template <typename Pixel>
+    void RenderAnyTile(Pixel* rows, int w, int h, const Tile& tile)
+    {
+        RenderAnyTile(rows, w, h, tile, scene.camera);
+    }
+
+public:
+    // The scene must have had BuildBvh called before rendering objects with
+    // Acceleration::Bvh, BuildGrid before rendering with Acceleration::Grid,
+    // and Compile before rendering from pools, with the BVH built in the
+    // pools when the acceleration asks for it.
+    RayTracerEngine(Scene<Real>& scene, const TraceSettings& settings = TraceSettings()) :
+        scene(scene), acceleration(settings.acceleration), layout(settings.layout), packets(settings.packets),
+        wavefront(settings.wavefront || settings.reorder), reorder(settings.reorder),
+        outputScale(255.0f * settings.exposure)
+    {
+        SimdIsa outputIsa = DetectSimdIsa();
+        convert = GetPixelConverter(outputIsa);
+        if (packets == SimdIsa::None) return;
+
+        layout = SceneLayout::Pools;
+        packets = SupportedSimdIsa(packets);
+        packetKernels = GetPacketKernels<Real>(packets);
+    }
+
+    // The ISA actually used, None when the scene forced scalar tracing.
+    SimdIsa PacketIsa() const { return packets; }
+
+    // The 8-bit pixel of linear radiance color at the engine's exposure, as
+    // the rendered images have it.
+    RgbColor ToPixel(const Color<Real>& color) const
+    {
+        return QuantizePixel(color.ToLinear(), outputScale);
+    }
+
+    // Converts count linear pixels to 8-bit ones at the engine's exposure.
+    void Convert(const LinearRgb* in, RgbColor* out, int count) const
+    {
+        convert(in, out, count, outputScale);
+    }
+
+    // Images are RgbColor, converted at the exposure of the settings, or
+    // linear LinearRgb radiance.
+    template <typename Pixel>
+    void render(Pixel* image, int w, int h)
+    {
+        RenderAnyTile(image, w, h, Tile{ 0, 0, w, h });
+    }
+
+    // Linear radiance seen through point (x, y) of a w x h frame.
+    Color<Real> TraceSample(Real x, Real y, int w, int h)
+    {
+        return TraceRay(Ray<Real>(scene.camera.pos, scene.camera.GetPoint(x, y, w, h)), 0);
+    }
+
+    // Renders rows [y0, y1) of a w x h frame into rows, which holds just
+    // those rows.
+    template <typename Pixel>
+    void RenderRows(Pixel* rows, int w, int h, int y0, int y1)
+    {
+        RenderAnyTile(rows, w, h, Tile{ 0, y0, w, y1 });
+    }
+
+    // Renders tile of a w x h frame into rows, which points at row tile.y0
+    // of a buffer w pixels wide.
+    template <typename Pixel>
+    void RenderRegion(Pixel* rows, int w, int h, const Tile& tile)
+    {
+        RenderAnyTile(rows, w, h, tile);
+    }
+
+    // Every pixel is traced by the same kernel whichever thread picks up its
+    // tile, so the result is identical to the single-threaded render.
+    template <typename Pixel>
+    void render(Pixel* image, int w, int h, ThreadPool& pool, int tileSize)
+    {
+        TaskGroup group;
+        for (int y = 0; y < h; y += tileSize) {
+            for (int x = 0; x < w; x += tileSize) {
+                Tile tile{ x, y, std::min(x + tileSize, w), std::min(y + tileSize, h) };
+                Pixel* rows = image + (size_t)tile.y0 * w;
+                pool.Run(group, [this, rows, w, h, tile] { RenderAnyTile(rows, w, h, tile); });
+            }
+        }
+        pool.Wait(group);
+    }
+
+    // Renders the scene from each of cameras into the matching image of
+    // images. The views share the prepared scene and their tiles share the
+    // pool, so threads that finish one view go on with the others.
+    void render(const std::vector<Camera<Real>>& cameras, const std::vector<RgbColor*>& images, int w, int h, ThreadPool& pool, int tileSize)
+    {
+        TaskGroup group;
+        for (size_t view = 0; view < cameras.size(); ++view) {
+            const Camera<Real>* camera = &cameras[view];
+            for (int y = 0; y < h; y += tileSize) {
+                for (int x = 0; x < w; x += tileSize) {
+                    Tile tile{ x, y, std::min(x + tileSize, w), std::min(y + tileSize, h) };
+                    RgbColor* rows = images[view] + (size_t)tile.y0 * w;
+                    pool.Run(group, [this, rows, w, h, tile, camera] { RenderAnyTile(rows, w, h, tile, *camera); });
+                }
+            }
+        }
+        pool.Wait(group);
+    }
+};
+
+// Writes the headers of a top-down 32-bit BMP and returns the offset of the
+// pixel data. Size fields that do not fit in 32 bits are written as 0, which
+// BI_RGB readers accept for the image size.
+uint64_t WriteBitmapHeader(std::ostream& file, int width, int height)
 {
     typedef unsigned int DWORD;
     typedef int LONG;
     typedef unsigned short WORD;
     const int BI_RGB = 0;
 
-    struct BITMAPINFOHEADER {
-        DWORD biSize;
-        LONG  biWidth;
-        LONG  biHeight;
-        WORD  biPlanes;
-        WORD  biBitCount;
-        DWORD biCompression;
-        DWORD biSizeImage;
-        LONG  biXPelsPerMeter;
-        LONG  biYPelsPerMeter;
-        DWORD biClrUsed;
-        DWORD biClrImportant;
+    struct BITMAPINFOHEADER {
+        DWORD biSize;
+        LONG  biWidth;
+        LONG  biHeight;
+        WORD  biPlanes;
+        WORD  biBitCount;
+        DWORD biCompression;
+        DWORD biSizeImage;
+        LONG  biXPelsPerMeter;
+        LONG  biYPelsPerMeter;
+        DWORD biClrUsed;
+        DWORD biClrImportant;
+    };
+
+#pragma pack(push, 1)
+    struct BITMAPFILEHEADER {
+        WORD  bfType;
+        DWORD bfSize;
+        WORD  bfReserved1;
+        WORD  bfReserved2;
+        DWORD bfOffBits;
+    };
+#pragma pack(pop)
+
+    uint64_t imageSize = (uint64_t)width * height * 4;
+
+    BITMAPINFOHEADER bmpInfoHeader = { 0 };
+    bmpInfoHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmpInfoHeader.biBitCount = 32;
+    bmpInfoHeader.biClrImportant = 0;
+    bmpInfoHeader.biClrUsed = 0;
+    bmpInfoHeader.biCompression = BI_RGB;
+    bmpInfoHeader.biHeight = -height;
+    bmpInfoHeader.biWidth = width;
+    bmpInfoHeader.biPlanes = 1;
+    bmpInfoHeader.biSizeImage = (imageSize <= 0xFFFFFFFFu) ? (DWORD)imageSize : 0;
+
+    BITMAPFILEHEADER bfh = { 0 };
+    bfh.bfType = 'B' + ('M' << 8);
+    bfh.bfOffBits = sizeof(BITMAPINFOHEADER) + sizeof(BITMAPFILEHEADER);
+    bfh.bfSize = (bfh.bfOffBits + imageSize <= 0xFFFFFFFFu) ? (DWORD)(bfh.bfOffBits + imageSize) : 0;
+
+    file.write((const char*)&bfh, sizeof(bfh));
+    file.write((const char*)&bmpInfoHeader, sizeof(bmpInfoHeader));
+    return bfh.bfOffBits;
+}
+
+bool SaveImage(const RgbColor* bitmapBits, int width, int height, const char* fileName)
+{
+    std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+    WriteBitmapHeader(file, width, height);
+    file.write((const char*)bitmapBits, (std::streamsize)width * height * sizeof(RgbColor));
+    file.close();
+    return (bool)file;
+}
+
+// Writes the header of a PFM color image, whose rows of float triples follow
+// from the bottom row up, and returns the offset of the pixel data. A
+// negative scale marks little-endian floats.
+uint64_t WritePfmHeader(std::ostream& file, int width, int height)
+{
+    const uint16_t one = 1;
+    bool littleEndian = *(const uint8_t*)&one == 1;
+    std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + (littleEndian ? "\n-1.0\n" : "\n1.0\n");
+    file.write(header.data(), (std::streamsize)header.size());
+    return header.size();
+}
+
+// Output paths ending in .pfm get the linear radiance as floats.
+bool IsPfmPath(const std::string& path)
+{
+    if (path.size() < 4) return false;
+    std::string extension = path.substr(path.size() - 4);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    return extension == ".pfm";
+}
+
+bool SaveImage(const LinearRgb* pixels, int width, int height, const char* fileName)
+{
+    std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
+    WritePfmHeader(file, width, height);
+    for (int y = height - 1; y >= 0; --y) {
+        file.write((const char*)(pixels + (size_t)y * width), (std::streamsize)width * sizeof(LinearRgb));
+    }
+    file.close();
+    return (bool)file;
+}
+
+// BMP written band by band as bands finish, in any order: each band is
+// written straight to its final offset, so the frame is never resident.
+class BitmapStreamWriter
+{
+    std::ofstream file;
+    std::mutex mutex;
+    int width;
+    uint64_t dataOffset;
+
+public:
+    using Pixel = RgbColor;
+
+    BitmapStreamWriter(const char* fileName, int width, int height) :
+        file(fileName, std::ios::binary | std::ios::trunc), width(width)
+    {
+        dataOffset = WriteBitmapHeader(file, width, height);
+    }
+
+    bool Good() const { return (bool)file; }
+
+    void WriteRows(int y0, const RgbColor* rows, int count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        file.seekp((std::streamoff)(dataOffset + (uint64_t)y0 * width * sizeof(RgbColor)));
+        file.write((const char*)rows, (std::streamsize)count * width * sizeof(RgbColor));
+    }
+};
+
+// PFM written band by band like BitmapStreamWriter. The file stores rows
+// bottom up, so each row of a band goes to its own offset.
+class PfmStreamWriter
+{
+    std::ofstream file;
+    std::mutex mutex;
+    int width, height;
+    uint64_t dataOffset;
+
+public:
+    using Pixel = LinearRgb;
+
+    PfmStreamWriter(const char* fileName, int width, int height) :
+        file(fileName, std::ios::binary | std::ios::trunc), width(width), height(height)
+    {
+        dataOffset = WritePfmHeader(file, width, height);
+    }
+
+    bool Good() const { return (bool)file; }
+
+    void WriteRows(int y0, const LinearRgb* rows, int count)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int i = 0; i < count; ++i) {
+            file.seekp((std::streamoff)(dataOffset + (uint64_t)(height - 1 - (y0 + i)) * width * sizeof(LinearRgb)));
+            file.write((const char*)(rows + (size_t)i * width), (std::streamsize)width * sizeof(LinearRgb));
+        }
+    }
+};
+
+// Renders the frame as horizontal bands of bandHeight rows. A band's buffer
+// exists only while its task runs, so at most one band per thread is
+// resident no matter how large the image is.
+template <typename Real, typename Writer>
+bool RenderStreaming(RayTracerEngine<Real>& rayTracer, Writer& writer, int w, int h, int bandHeight, ThreadPool& pool)
+{
+    TaskGroup group;
+    for (int y = 0; y < h; y += bandHeight) {
+        int y1 = std::min(y + bandHeight, h);
+        pool.Run(group, [&rayTracer, &writer, w, h, y, y1] {
+            std::vector<typename Writer::Pixel> band((size_t)w * (y1 - y));
+            rayTracer.RenderRows(&band[0], w, h, y, y1);
+            writer.WriteRows(y, &band[0], y1 - y);
+        });
+    }
+    pool.Wait(group);
+    return writer.Good();
+}
+
+// Progressive adaptive supersampling. Pass 0 traces one sample per pixel;
+// every later pass doubles the stratified grid (2x2, 4x4, ...) but only for
+// pixels whose estimate differs from a neighbour's, or whose samples vary,
+// by more than the threshold. Each pass leaves a complete image behind.
+template <typename Real>
+class AdaptiveSampler
+{
+    RayTracerEngine<Real>& rayTracer;
+    int w, h;
+    int maxGrid;
+    double threshold;
+
+    std::vector<Color<Real>> sum;
+    std::vector<Real> sumSquares;  // of luminance, for the sample variance
+    std::vector<int> count;
+    std::vector<uint8_t> refine;
+    std::atomic<uint64_t> samples{ 0 };
+
+    static double Luminance(const Color<Real>& c)
+    {
+        return 0.2126 * c.r + 0.7152 * c.g + 0.0722 * c.b;
+    }
+
+    static double Display(double c)
+    {
+        return std::min(std::max(c, 0.0), 1.0);
+    }
+
+    // Repeatable jitter in [0, 1), so results do not depend on thread count.
+    static double Jitter(uint32_t x, uint32_t y, uint32_t pass, uint32_t i)
+    {
+        uint32_t v = x * 0x8da6b343u ^ y * 0xd8163841u ^ pass * 0xcb1ab31fu ^ i * 0x165667b1u;
+        v ^= v >> 16;
+        v *= 0x7feb352du;
+        v ^= v >> 15;
+        v *= 0x846ca68bu;
+        v ^= v >> 16;
+        return (v >> 8) * (1.0 / 16777216.0);
+    }
+
+    Color<Real> Mean(size_t i) const
+    {
+        return sum[i].Scale(1.0 / count[i]);
+    }
+
+    void AddSample(size_t i, const Color<Real>& c)
+    {
+        sum[i] = sum[i] + c;
+        double l = Luminance(c);
+        sumSquares[i] += l * l;
+        ++count[i];
+    }
+
+    bool NeedsRefinement(int x, int y) const
+    {
+        size_t i = (size_t)y * w + x;
+        Color<Real> m = Mean(i);
+        if (count[i] > 1) {
+            double mean = Luminance(m);
+            double variance = std::max(sumSquares[i] / count[i] - mean * mean, 0.0);
+            if (std::sqrt(variance / count[i]) > threshold) return true;
+        }
+
+        const int dx[] = { -1, 1, 0, 0 };
+        const int dy[] = { 0, 0, -1, 1 };
+        for (int k = 0; k < 4; ++k) {
+            int nx = x + dx[k], ny = y + dy[k];
+            if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+            Color<Real> n = Mean((size_t)ny * w + nx);
+            double contrast = std::max({ std::fabs(Display(m.r) - Display(n.r)),
+                                         std::fabs(Display(m.g) - Display(n.g)),
+                                         std::fabs(Display(m.b) - Display(n.b)) });
+            if (contrast > threshold) return true;
+        }
+        return false;
+    }
+
+    template <typename RowFunction>
+    void ForRows(ThreadPool& pool, RowFunction&& function)
+    {
+        const int rowsPerTask = 16;
+        TaskGroup group;
+        for (int y = 0; y < h; y += rowsPerTask) {
+            int y1 = std::min(y + rowsPerTask, h);
+            pool.Run(group, [&function, y, y1] {
+                for (int row = y; row < y1; ++row) function(row);
+            });
+        }
+        pool.Wait(group);
+    }
+
+public:
+    // maxGrid, a power of two, is the grid of the last pass.
+    AdaptiveSampler(RayTracerEngine<Real>& rayTracer, int w, int h, int maxGrid, double threshold) :
+        rayTracer(rayTracer), w(w), h(h), maxGrid(maxGrid), threshold(threshold),
+        sum((size_t)w * h), sumSquares((size_t)w * h), count((size_t)w * h), refine((size_t)w * h)
+    {}
+
+    uint64_t Samples() const { return samples; }
+
+    // Calls onPass(pass, grid, refinedPixels) after every pass; Resolve gives
+    // the image as it stands at that point.
+    template <typename PassCallback>
+    void Render(ThreadPool& pool, PassCallback&& onPass)
+    {
+        ForRows(pool, [this](int y) {
+            for (int x = 0; x < w; ++x) {
+                AddSample((size_t)y * w + x, rayTracer.TraceSample(x, y, w, h));
+            }
+            samples += w;
+        });
+        onPass(0, 1, (size_t)w * h);
+
+        int pass = 1;
+        for (int grid = 2; grid <= maxGrid; grid *= 2, ++pass) {
+            ForRows(pool, [this](int y) {
+                for (int x = 0; x < w; ++x) refine[(size_t)y * w + x] = NeedsRefinement(x, y);
+            });
+
+            std::atomic<size_t> refined{ 0 };
+            ForRows(pool, [this, grid, pass, &refined](int y) {
+                size_t rowRefined = 0;
+                for (int x = 0; x < w; ++x) {
+                    size_t i = (size_t)y * w + x;
+                    if (!refine[i]) continue;
+                    for (int s = 0; s < grid * grid; ++s) {
+                        double sx = x - 0.5 + (s % grid + Jitter(x, y, pass, 2 * s)) / grid;
+                        double sy = y - 0.5 + (s / grid + Jitter(x, y, pass, 2 * s + 1)) / grid;
+                        AddSample(i, rayTracer.TraceSample(sx, sy, w, h));
+                    }
+                    ++rowRefined;
+                }
+                samples += rowRefined * grid * grid;
+                refined += rowRefined;
+            });
+            onPass(pass, grid, (size_t)refined);
+            if (refined == 0) break;
+        }
+    }
+
+    void Resolve(RgbColor* image) const
+    {
+        for (size_t i = 0; i < sum.size(); ++i) {
+            image[i] = rayTracer.ToPixel(Mean(i));
+        }
+    }
+};
+
+// Keyframed changes to a scene, read from a text file with one item per
+// line, '#' starts a comment:
+//
+//   frames  <count>
+//   camera  <frame> <pos x y z> <look-at x y z>
+//   light   <index> <frame> <pos x y z>
+//   sphere  <index> <frame> <center x y z>
+//
+// Lights are counted in scene order, spheres in the order the scene lists
+// them. An item moves linearly between its keys and holds still before its
+// first key and after its last.
+struct Animation
+{
+    enum TrackKind { CameraTrack, LightTrack, SphereTrack };
+
+    struct Key
+    {
+        int frame;
+        Vector<double> a, b;  // position, and the camera's look-at
+    };
+
+    struct Track
+    {
+        TrackKind kind;
+        int index;
+        std::vector<Key> keys;  // by frame
+    };
+
+    int frames = 1;
+    std::vector<Track> tracks;
+
+    Track& GetTrack(TrackKind kind, int index)
+    {
+        for (auto& track : tracks) {
+            if (track.kind == kind && track.index == index) return track;
+        }
+        tracks.push_back(Track{ kind, index, {} });
+        return tracks.back();
+    }
+
+    void AddKey(TrackKind kind, int index, const Key& key)
+    {
+        auto& keys = GetTrack(kind, index).keys;
+        auto at = std::upper_bound(keys.begin(), keys.end(), key.frame, [](int frame, const Key& k) { return frame < k.frame; });
+        keys.insert(at, key);
+    }
+
+    static Key Sample(const Track& track, int frame)
+    {
+        auto& keys = track.keys;
+        if (frame <= keys.front().frame) return keys.front();
+        if (frame >= keys.back().frame) return keys.back();
+        size_t next = 1;
+        while (keys[next].frame < frame) ++next;
+        const Key& k0 = keys[next - 1];
+        const Key& k1 = keys[next];
+        double t = (double)(frame - k0.frame) / (k1.frame - k0.frame);
+        return Key{ frame, k0.a + (k1.a - k0.a) * t, k0.b + (k1.b - k0.b) * t };
+    }
+};
+
+Animation LoadAnimation(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error(path + ": cannot open");
+
+    Animation animation;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        auto fail = [&](const std::string& message) {
+            return std::runtime_error(path + ":" + std::to_string(lineNumber) + ": " + message);
+        };
+
+        std::istringstream in(line.substr(0, line.find('#')));
+        std::string keyword;
+        if (!(in >> keyword)) continue;
+
+        int index, frame;
+        double a, b, c, d, e, f;
+        if (keyword == "frames" && (in >> frame) && frame > 0) {
+            animation.frames = frame;
+        } else if (keyword == "camera" && (in >> frame >> a >> b >> c >> d >> e >> f) && frame >= 0) {
+            animation.AddKey(Animation::CameraTrack, 0, Animation::Key{ frame, Vector<double>(a, b, c), Vector<double>(d, e, f) });
+        } else if (keyword == "light" && (in >> index >> frame >> a >> b >> c) && index >= 0 && frame >= 0) {
+            animation.AddKey(Animation::LightTrack, index, Animation::Key{ frame, Vector<double>(a, b, c), Vector<double>() });
+        } else if (keyword == "sphere" && (in >> index >> frame >> a >> b >> c) && index >= 0 && frame >= 0) {
+            animation.AddKey(Animation::SphereTrack, index, Animation::Key{ frame, Vector<double>(a, b, c), Vector<double>() });
+        } else {
+            throw fail("cannot parse '" + line + "'");
+        }
+
+        if (in >> keyword) throw fail("unexpected '" + keyword + "'");
+    }
+    return animation;
+}
+
+// A camera of a batch of views, as position and look-at point.
+struct View
+{
+    Vector<double> position;
+    Vector<double> lookAt;
+
+    template <typename Real>
+    Camera<Real> ToCamera() const { return Camera<Real>(Camera<double>(position, lookAt)); }
+};
+
+// A view file holds one "camera <pos x y z> <look-at x y z>" line per view,
+// as in scene files; '#' starts a comment.
+std::vector<View> LoadViews(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error(path + ": cannot open");
+
+    std::vector<View> views;
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        auto fail = [&](const std::string& message) {
+            return std::runtime_error(path + ":" + std::to_string(lineNumber) + ": " + message);
+        };
+
+        std::istringstream in(line.substr(0, line.find('#')));
+        std::string keyword;
+        if (!(in >> keyword)) continue;
+
+        double a, b, c, d, e, f;
+        if (keyword == "camera" && (in >> a >> b >> c >> d >> e >> f)) {
+            views.push_back(View{ Vector<double>(a, b, c), Vector<double>(d, e, f) });
+            if ((views.back().lookAt - views.back().position).Length() == 0) throw fail("camera looks at itself");
+        } else {
+            throw fail("cannot parse '" + line + "'");
+        }
+
+        if (in >> keyword) throw fail("unexpected '" + keyword + "'");
+    }
+    if (views.empty()) throw std::runtime_error(path + ": no views");
+    return views;
+}
+
+// count views circling a vertical axis at the camera's distance. The axis
+// goes through the point of the camera's line of sight nearest the origin.
+std::vector<View> TurntableViews(const Camera<double>& camera, int count)
+{
+    double along = -(camera.pos * camera.forward);
+    if (along <= 0) along = camera.pos.Length();
+    Vector<double> center = camera.pos + camera.forward * along;
+    Vector<double> arm = camera.pos - center;
+    std::vector<View> views;
+    for (int i = 0; i < count; ++i) {
+        double angle = 2 * 3.14159265358979323846 * i / count;
+        double c = std::cos(angle), s = std::sin(angle);
+        Vector<double> rotated(arm.x * c - arm.z * s, arm.y, arm.x * s + arm.z * c);
+        views.push_back(View{ center + rotated, center });
+    }
+    return views;
+}
+
+// What changed in a scene since the previous frame.
+template <typename Real>
+struct SceneChanges
+{
+    bool camera = false;
+    uint64_t lights = 0;                     // bit per moved light
+    std::vector<BoundingBox<Real>> regions;  // old and new bounds of every moved object
+};
+
+// Moves the items of a scene to where an animation has them at a frame.
+template <typename Real>
+class SceneAnimator
+{
+    Scene<Real>& scene;
+    const Animation& animation;
+    std::vector<Sphere<Real>*> spheres;
+
+    static bool Same(const Vector<Real>& a, const Vector<Real>& b)
+    {
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+
+public:
+    SceneAnimator(Scene<Real>& scene, const Animation& animation) : scene(scene), animation(animation)
+    {
+        for (auto& thing : scene.things) {
+            if (auto sphere = dynamic_cast<Sphere<Real>*>(thing.get())) spheres.push_back(sphere);
+        }
+        for (auto& track : animation.tracks) {
+            if (track.kind == Animation::LightTrack && track.index >= (int)scene.lights.size()) {
+                throw std::runtime_error("animation moves light " + std::to_string(track.index) + " of " + std::to_string(scene.lights.size()));
+            }
+            if (track.kind == Animation::SphereTrack && track.index >= (int)spheres.size()) {
+                throw std::runtime_error("animation moves sphere " + std::to_string(track.index) + " of " + std::to_string(spheres.size()));
+            }
+        }
+    }
+
+    SceneChanges<Real> Apply(int frame)
+    {
+        SceneChanges<Real> changes;
+        for (auto& track : animation.tracks) {
+            Animation::Key key = Animation::Sample(track, frame);
+            Vector<Real> position(key.a);
+            if (track.kind == Animation::CameraTrack) {
+                Camera<Real> camera(position, Vector<Real>(key.b));
+                auto& current = scene.camera;
+                if (Same(camera.pos, current.pos) && Same(camera.forward, current.forward) &&
+                    Same(camera.right, current.right) && Same(camera.up, current.up)) continue;
+                current = camera;
+                changes.camera = true;
+            } else if (track.kind == Animation::LightTrack) {
+                auto& light = scene.lights[track.index];
+                if (Same(light.pos, position)) continue;
+                light.pos = position;
+                // Scenes with more lights are traced in full every frame.
+                if (track.index < PathMaxLights) changes.lights |= uint64_t(1) << track.index;
+            } else {
+                Sphere<Real>& sphere = *spheres[track.index];
+                if (Same(sphere.Center(), position)) continue;
+                BoundingBox<Real> box;
+                sphere.GetBounds(box);
+                changes.regions.push_back(box);
+                sphere.SetCenter(position);
+                sphere.GetBounds(box);
+                changes.regions.push_back(box);
+            }
+        }
+        return changes;
+    }
+};
+
+// Renders the frames of a changing scene, keeping the traced path of every
+// pixel between frames. Only pixels with a ray that passes through the old
+// or new bounds of a moved object are traced again; for moved lights only
+// the shadow rays towards them are, and the paths are shaded again. A moved
+// camera, or a scene with too many lights to record, traces every pixel.
+template <typename Real>
+class IncrementalRenderer
+{
+    Scene<Real>& scene;
+    RayTracerEngine<Real>& rayTracer;
+    int w, h;
+    std::vector<RgbColor> image;
+    std::vector<uint8_t> pathLength;                  // vertices per pixel
+    std::vector<std::vector<PathVertex<Real>>> rows;  // paths of each row, pixel after pixel
+    bool recorded = false;
+    std::atomic<uint64_t> retraced{ 0 };
+    std::atomic<uint64_t> reshaded{ 0 };
+
+    Ray<Real> PrimaryRay(int x, int y) const
+    {
+        return Ray<Real>(scene.camera.pos, scene.camera.GetPoint(x, y, w, h));
+    }
+
+    static bool Crosses(const Ray<Real>& ray, Real maxDist, const std::vector<BoundingBox<Real>>& regions)
+    {
+        Vector<Real> invDir(Real(1) / ray.dir.x, Real(1) / ray.dir.y, Real(1) / ray.dir.z);
+        for (auto& box : regions) {
+            if (box.Intersect(ray, invDir, maxDist) != FarAway<Real>) return true;
+        }
+        return false;
+    }
+
+    // True if a ray of the path, closest-hit or shadow, passes through a
+    // changed region. Shadow rays towards moved lights are traced again
+    // anyway and are not tested.
+    bool Touches(int x, int y, const PathVertex<Real>* path, int length, const SceneChanges<Real>& changes) const
+    {
+        Ray<Real> ray = PrimaryRay(x, y);
+        for (int depth = 0; ; ++depth) {
+            if (depth == length) {
+                // The ray past the last vertex missed, unless the path was
+                // cut off at the maximum depth.
+                return length <= RayTracerEngine<Real>::maxDepth && Crosses(ray, FarAway<Real>, changes.regions);
+            }
+            const PathVertex<Real>& vertex = path[depth];
+            if (Crosses(ray, vertex.dist, changes.regions)) return true;
+            for (int light = 0; light < (int)scene.lights.size(); ++light) {
+                if (changes.lights & (uint64_t(1) << light)) continue;
+                Vector<Real> ldis = scene.lights[light].pos - vertex.origin;
+                if (Crosses(Ray<Real>(vertex.origin, ldis.Norm()), ldis.Length(), changes.regions)) return true;
+            }
+            ray = Ray<Real>(vertex.origin, vertex.reflectDir);
+        }
+    }
+
+    void TraceRow(int y)
+    {
+        auto& row = rows[y];
+        row.clear();
+        for (int x = 0; x < w; ++x) {
+            size_t i = (size_t)y * w + x;
+            size_t start = row.size();
+            rayTracer.TracePath(PrimaryRay(x, y), row);
+            pathLength[i] = (uint8_t)(row.size() - start);
+            image[i] = rayTracer.ToPixel(rayTracer.ResolvePath(row.data() + start, pathLength[i]));
+        }
+        retraced += w;
+    }
+
+    void UpdateRow(int y, const SceneChanges<Real>& changes)
+    {
+        auto& row = rows[y];
+        std::vector<char> dirty(w, 0);
+        bool anyDirty = false;
+        if (!changes.regions.empty()) {
+            size_t offset = 0;
+            for (int x = 0; x < w; ++x) {
+                int length = pathLength[(size_t)y * w + x];
+                dirty[x] = Touches(x, y, row.data() + offset, length, changes);
+                anyDirty = anyDirty || dirty[x];
+                offset += length;
+            }
+        }
+        if (!anyDirty && changes.lights == 0) return;
+
+        // Traced pixels can change their path length, so a row with any is
+        // rebuilt; otherwise the paths are updated in place.
+        std::vector<PathVertex<Real>> updated;
+        if (anyDirty) updated.reserve(row.size());
+        size_t offset = 0;
+        uint64_t rowRetraced = 0, rowReshaded = 0;
+        for (int x = 0; x < w; ++x) {
+            size_t i = (size_t)y * w + x;
+            int length = pathLength[i];
+            PathVertex<Real>* path = row.data() + offset;
+            offset += length;
+
+            if (dirty[x]) {
+                size_t start = updated.size();
+                rayTracer.TracePath(PrimaryRay(x, y), updated);
+                pathLength[i] = (uint8_t)(updated.size() - start);
+                image[i] = rayTracer.ToPixel(rayTracer.ResolvePath(updated.data() + start, pathLength[i]));
+                ++rowRetraced;
+                continue;
+            }
+            if (changes.lights != 0 && length > 0) {
+                for (int depth = 0; depth < length; ++depth) {
+                    for (int light = 0; light < (int)scene.lights.size(); ++light) {
+                        uint64_t bit = uint64_t(1) << light;
+                        if (!(changes.lights & bit)) continue;
+                        if (rayTracer.IsShadowed(path[depth], light, depth)) path[depth].shadowed |= bit;
+                        else path[depth].shadowed &= ~bit;
+                    }
+                }
+                image[i] = rayTracer.ToPixel(rayTracer.ResolvePath(path, length));
+                ++rowReshaded;
+            }
+            if (anyDirty) updated.insert(updated.end(), path, path + length);
+        }
+        if (anyDirty) row.swap(updated);
+        retraced += rowRetraced;
+        reshaded += rowReshaded;
+    }
+
+    template <typename RowFunction>
+    void ForRows(ThreadPool& pool, RowFunction&& function)
+    {
+        const int rowsPerTask = 8;
+        TaskGroup group;
+        for (int y = 0; y < h; y += rowsPerTask) {
+            int y1 = std::min(y + rowsPerTask, h);
+            pool.Run(group, [&function, y, y1] {
+                for (int row = y; row < y1; ++row) function(row);
+            });
+        }
+        pool.Wait(group);
+    }
+
+public:
+    IncrementalRenderer(Scene<Real>& scene, RayTracerEngine<Real>& rayTracer, int w, int h) :
+        scene(scene), rayTracer(rayTracer), w(w), h(h), image((size_t)w * h), pathLength((size_t)w * h), rows(h)
+    {}
+
+    const std::vector<RgbColor>& Image() const { return image; }
+
+    // Pixels traced from the camera and pixels only shaded again, over all
+    // frames so far.
+    uint64_t RetracedPixels() const { return retraced; }
+    uint64_t ReshadedPixels() const { return reshaded; }
+
+    // Renders the next frame. changes must describe everything that changed
+    // in the scene since the previous frame, and the scene must have been
+    // prepared again if objects moved.
+    void Render(ThreadPool& pool, const SceneChanges<Real>& changes)
+    {
+        if (scene.lights.size() > PathMaxLights) {
+            ForRows(pool, [this](int y) { rayTracer.RenderRows(&image[(size_t)y * w], w, h, y, y + 1); });
+            retraced += (uint64_t)w * h;
+            return;
+        }
+        if (!recorded || changes.camera) {
+            ForRows(pool, [this](int y) { TraceRow(y); });
+            recorded = true;
+            return;
+        }
+        ForRows(pool, [this, &changes](int y) { UpdateRow(y, changes); });
+    }
+};
+
+enum class Precision
+{
+    Double,
+    Float
+};
+
+struct RenderOptions
+{
+    int threads = 1;
+    int tileSize = 32;
+    TraceSettings trace;
+    int spheres = -1;  // -1 renders the default scene
+    int instances = 0;  // > 0 renders this many copies of a group of --spheres spheres
+    std::string scenePath;
+    std::string saveScenePath;
+    std::string outputPath = "cpp-raytracer.bmp";
+    int width = 500;
+    int height = 500;
+    int bandHeight = 0;  // > 0 streams the image to disk in bands of this many rows
+    int adaptiveGrid = 0;  // > 1 supersamples edges adaptively up to this many samples per axis, a power of two
+    double adaptiveThreshold = 0.05;
+    Precision precision = Precision::Double;
+    bool comparePrecision = false;  // render in both precisions and report the difference
+    bool verify = false;            // render through the reference path too and report the difference
+    int verifyThreshold = 1;        // --verify counts pixels off by more than this many 8-bit levels
+    std::string heatmapPath;        // --verify heatmap; by default next to the output
+    bool benchBvh = false;
+    bool benchGrid = false;
+    bool benchBuild = false;
+    bool benchReorder = false;
+    int benchViews = 0;  // > 0 times batch against separate renders of this many views
+    std::string viewsPath;  // render every camera of this view file
+    int turntable = 0;      // > 0 renders this many views around the scene
+    int maxError = -1;  // --verify error budget in 8-bit levels, -1 for the threshold
+    std::string animationPath;
+    bool fullFrames = false;  // trace every animation frame from scratch
+    std::string workerAddress;                     // serve tiles to coordinators on this address
+    std::vector<std::string> distributeAddresses;  // render on the workers at these addresses
+    int workerTimeout = 30;  // seconds a worker may stay silent with work outstanding
+    bool hasCamera = false;  // replace the scene's camera
+    Vector<double> cameraPosition, cameraLookAt;
+    std::string servePath;         // serve render jobs on this Unix domain socket
+    std::string submitPath;        // send jobs from standard input to the server on this socket
+    int priority = 0;              // server jobs: higher runs first
+    std::string sharedMemoryName;  // server jobs: write the image to this shared memory object
+    bool bench = false;
+    std::string statsJsonPath;  // ray statistics, in builds with RAYTRACER_STATS
+    int benchRuns = 5;
+    std::string benchJsonPath;
+};
+
+using Clock = std::chrono::high_resolution_clock;
+
+double MillisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+template <typename Real, typename Pixel>
+void RenderFrame(RayTracerEngine<Real>& rayTracer, Pixel* image, int width, int height, ThreadPool& pool,
+    const RenderOptions& options)
+{
+    if (options.threads > 1) {
+        rayTracer.render(image, width, height, pool, options.tileSize);
+    } else {
+        rayTracer.render(image, width, height);
+    }
+}
+
+template <typename Real, typename Pixel>
+void RenderFrame(RayTracerEngine<Real>& rayTracer, Pixel* image, int width, int height, const RenderOptions& options)
+{
+    if (options.threads > 1) {
+        ThreadPool pool(options.threads);
+        RenderFrame(rayTracer, image, width, height, pool, options);
+    } else {
+        rayTracer.render(image, width, height);
+    }
+}
+
+// Renders the sphere-field scene at growing object counts. The linear scan is
+// only timed while it still finishes in reasonable time.
+template <typename Real>
+void RunBvhBenchmark(const RenderOptions& options)
+{
+    const int width = 160;
+    const int height = 160;
+    const int linearLimit = 10000;
+    std::vector<RgbColor> bitmapData(width * height);
+
+    std::cout << "spheres     build[ms]   nodes      bvh[ms]     linear[ms]" << std::endl;
+    for (int count = 10; count <= 1000000; count *= 10) {
+        Scene<Real> scene(count);
+
+        TraceSettings settings = options.trace;
+        settings.acceleration = Acceleration::Bvh;
+        auto start = Clock::now();
+        PrepareScene(scene, settings);
+        double buildMs = MillisecondsSince(start);
+        size_t nodes = (settings.layout == SceneLayout::Pools) ? scene.pools.bvh.NodeCount() : scene.bvh.NodeCount();
+
+        RayTracerEngine<Real> bvhTracer(scene, settings);
+        start = Clock::now();
+        RenderFrame(bvhTracer, &bitmapData[0], width, height, options);
+        double bvhMs = MillisecondsSince(start);
+
+        std::string linear = "-";
+        if (count <= linearLimit) {
+            settings = options.trace;
+            settings.acceleration = Acceleration::Linear;
+            PrepareScene(scene, settings);
+            RayTracerEngine<Real> linearTracer(scene, settings);
+            start = Clock::now();
+            RenderFrame(linearTracer, &bitmapData[0], width, height, options);
+            linear = std::to_string((int)MillisecondsSince(start));
+        }
+
+        printf("%-11d %-11.1f %-10zu %-11.1f %s\n", count, buildMs, nodes, bvhMs, linear.c_str());
+    }
+}
+
+// Compares the uniform grid with the linear scan on evenly spread and on
+// clustered spheres: build time, the grid's memory and the time to trace a
+// frame. The linear scan is only timed while it still finishes in
+// reasonable time.
+template <typename Real>
+void RunGridBenchmark(const RenderOptions& options)
+{
+    const int width = 160;
+    const int height = 160;
+    const int linearLimit = 10000;
+    std::vector<RgbColor> bitmapData(width * height);
+
+    std::cout << "scene       spheres     build[ms]   cells       memory[KB]  grid[ms]    linear[ms]" << std::endl;
+    for (bool clustered : { false, true }) {
+        for (int count = 1000; count <= 1000000; count *= 10) {
+            auto scene = clustered ? MakeClusteredScene<Real>(count) : std::make_unique<Scene<Real>>(count);
+
+            TraceSettings settings = options.trace;
+            settings.acceleration = Acceleration::Grid;
+            auto start = Clock::now();
+            PrepareScene(*scene, settings);
+            double buildMs = MillisecondsSince(start);
+
+            RayTracerEngine<Real> gridTracer(*scene, settings);
+            start = Clock::now();
+            RenderFrame(gridTracer, &bitmapData[0], width, height, options);
+            double gridMs = MillisecondsSince(start);
+
+            std::string linear = "-";
+            if (count <= linearLimit) {
+                settings = options.trace;
+                settings.acceleration = Acceleration::Linear;
+                PrepareScene(*scene, settings);
+                RayTracerEngine<Real> linearTracer(*scene, settings);
+                start = Clock::now();
+                RenderFrame(linearTracer, &bitmapData[0], width, height, options);
+                linear = std::to_string((int)MillisecondsSince(start));
+            }
+
+            printf("%-11s %-11d %-11.1f %-11zu %-11zu %-11.1f %s\n", clustered ? "clustered" : "uniform", count, buildMs,
+                scene->grid.CellCount(), scene->grid.MemoryBytes() / 1024, gridMs, linear.c_str());
+        }
+    }
+}
+
+// Builds the BVH of a large sphere field with median and surface area splits
+// on growing numbers of threads, then refits it after every sphere moved,
+// and traces one frame through each tree. Build, refit and trace times are
+// reported apart; every build of a split must produce the same tree.
+template <typename Real>
+void RunBuildBenchmark(const RenderOptions& options)
+{
+    const int count = (options.spheres > 0) ? options.spheres : 1000000;
+    const int width = 160;
+    const int height = 160;
+    const int runs = 3;
+    std::vector<RgbColor> bitmapData(width * height);
+
+    Scene<Real> scene(count);
+    std::vector<int> counts;
+    for (int n = 1; n < options.threads; n *= 2) counts.push_back(n);
+    counts.push_back(std::max(options.threads, 1));
+
+    std::cout << "split       threads     build[ms]   nodes       refit[ms]   trace[ms]" << std::endl;
+    for (BvhSplit split : { BvhSplit::Median, BvhSplit::Sah }) {
+        std::vector<typename Bvh<Real>::Node> reference;
+        for (int threads : counts) {
+            ThreadPool pool(threads);
+            std::vector<double> builds;
+            for (int run = 0; run < runs; ++run) {
+                auto start = Clock::now();
+                scene.BuildBvh(&pool, split);
+                builds.push_back(MillisecondsSince(start));
+            }
+            std::sort(builds.begin(), builds.end());
+
+            auto& nodes = scene.bvh.Nodes();
+            if (reference.empty()) {
+                reference.assign(nodes.begin(), nodes.end());
+            } else if (nodes.size() != reference.size() ||
+                       std::memcmp(nodes.data(), reference.data(), nodes.size() * sizeof(reference[0])) != 0) {
+                std::cout << "the tree built on " << threads << " threads differs from the one built on 1" << std::endl;
+            }
+
+            // Every sphere moves by a fraction of its radius, and back after
+            // the trace so that every thread count builds the same tree.
+            std::vector<std::pair<Sphere<Real>*, Vector<Real>>> moved;
+            for (auto& thing : scene.things) {
+                if (auto sphere = dynamic_cast<Sphere<Real>*>(thing.get())) {
+                    moved.emplace_back(sphere, sphere->Center());
+                    sphere->SetCenter(sphere->Center() + Vector<Real>(0.1, 0.0, -0.1) * std::sqrt(sphere->Radius2()));
+                }
+            }
+            auto start = Clock::now();
+            scene.RefitBvh();
+            double refitMs = MillisecondsSince(start);
+
+            TraceSettings settings = options.trace;
+            settings.acceleration = Acceleration::Bvh;
+            settings.layout = SceneLayout::Objects;
+            settings.packets = SimdIsa::None;
+            RayTracerEngine<Real> tracer(scene, settings);
+            start = Clock::now();
+            tracer.render(&bitmapData[0], width, height, pool, options.tileSize);
+            double traceMs = MillisecondsSince(start);
+            for (auto& sphere : moved) sphere.first->SetCenter(sphere.second);
+
+            printf("%-11s %-11d %-11.1f %-11zu %-11.1f %.1f\n", BvhSplitName(split), threads, builds[runs / 2], nodes.size(),
+                refitMs, traceMs);
+        }
+    }
+}
+
+// Renders a large field of reflective spheres through the wavefront tracer
+// with and without reordering the reflection rays, with scalar and packet
+// intersection, and checks that every variant produces the same image.
+template <typename Real>
+void RunReorderBenchmark(const RenderOptions& options)
+{
+    const int count = (options.spheres > 0) ? options.spheres : 300000;
+    const int width = options.width;
+    const int height = options.height;
+
+    Scene<Real> scene(count);
+    TraceSettings prepared = options.trace;
+    prepared.acceleration = Acceleration::Bvh;
+    prepared.layout = SceneLayout::Pools;
+    auto start = Clock::now();
+    PrepareScene(scene, prepared);
+    printf("%d spheres, %dx%d, BVH built in %.1f ms\n", count, width, height, MillisecondsSince(start));
+
+    std::vector<RgbColor> reference;
+    std::cout << "packets     reorder     render[ms]  image" << std::endl;
+    for (SimdIsa isa : { SimdIsa::None, DetectSimdIsa() }) {
+        for (bool reorder : { false, true }) {
+            TraceSettings settings = prepared;
+            settings.packets = isa;
+            settings.wavefront = true;
+            settings.reorder = reorder;
+            RayTracerEngine<Real> rayTracer(scene, settings);
+
+            std::vector<RgbColor> bitmapData(width * height);
+            start = Clock::now();
+            RenderFrame(rayTracer, &bitmapData[0], width, height, options);
+            double ms = MillisecondsSince(start);
+
+            if (reference.empty()) reference = bitmapData;
+            bool same = std::memcmp(&reference[0], &bitmapData[0], reference.size() * sizeof(RgbColor)) == 0;
+            printf("%-11s %-11s %-11.1f %s\n", (isa == SimdIsa::None) ? "none" : SimdIsaName(rayTracer.PacketIsa()),
+                reorder ? "yes" : "no", ms, same ? "identical" : "DIFFERS");
+        }
+    }
+}
+
+// Renders a turntable of views of a sphere field once as separate renders,
+// each building its scene, BVH and thread pool as a new process would, and
+// once as a batch sharing all three.
+template <typename Real>
+void RunViewsBenchmark(const RenderOptions& options)
+{
+    const int count = (options.spheres > 0) ? options.spheres : 100000;
+    const int width = options.width;
+    const int height = options.height;
+    const int viewCount = options.benchViews;
+    TraceSettings settings = options.trace;
+    settings.acceleration = Acceleration::Bvh;
+
+    std::vector<View> views;
+    std::vector<Camera<Real>> cameras;
+    std::vector<std::vector<RgbColor>> separate(viewCount, std::vector<RgbColor>((size_t)width * height));
+    std::vector<std::vector<RgbColor>> batch = separate;
+    printf("%d spheres, %d views of %dx%d, %d threads\n", count, viewCount, width, height, ThreadPool(options.threads).ThreadCount());
+
+    auto start = Clock::now();
+    double prepareMs = 0;
+    for (int view = 0; view < viewCount; ++view) {
+        auto prepareStart = Clock::now();
+        Scene<Real> scene(count);
+        TraceSettings prepared = settings;
+        PrepareScene(scene, prepared);
+        prepareMs += MillisecondsSince(prepareStart);
+        if (views.empty()) {
+            views = TurntableViews(Camera<double>(scene.camera), viewCount);
+            for (auto& v : views) cameras.push_back(v.template ToCamera<Real>());
+        }
+        scene.camera = cameras[view];
+        RayTracerEngine<Real> rayTracer(scene, prepared);
+        ThreadPool pool(options.threads);
+        rayTracer.render(&separate[view][0], width, height, pool, options.tileSize);
+    }
+    double separateMs = MillisecondsSince(start);
+
+    start = Clock::now();
+    Scene<Real> scene(count);
+    TraceSettings prepared = settings;
+    PrepareScene(scene, prepared);
+    double batchPrepareMs = MillisecondsSince(start);
+    RayTracerEngine<Real> rayTracer(scene, prepared);
+    ThreadPool pool(options.threads);
+    std::vector<RgbColor*> images;
+    for (auto& image : batch) images.push_back(&image[0]);
+    rayTracer.render(cameras, images, width, height, pool, options.tileSize);
+    double batchMs = MillisecondsSince(start);
+
+    bool same = true;
+    for (int view = 0; view < viewCount; ++view) {
+        same = same && std::memcmp(&separate[view][0], &batch[view][0], separate[view].size() * sizeof(RgbColor)) == 0;
+    }
+    printf("separate    %10.1f ms  (%.1f ms building scenes)\n", separateMs, prepareMs);
+    printf("batch       %10.1f ms  (%.1f ms building the scene)\n", batchMs, batchPrepareMs);
+    printf("speedup     %10.2fx, images %s\n", batchMs > 0 ? separateMs / batchMs : 0.0, same ? "identical" : "DIFFER");
+}
+
+// Peak resident set size of the process so far, in kilobytes.
+size_t PeakRssKb()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss / 1024;
+#else
+    return (size_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+struct BenchStats
+{
+    double median = 0;
+    double p10 = 0;
+    double p90 = 0;
+    double min = 0;
+    double mean = 0;
+};
+
+BenchStats Summarize(std::vector<double> samples)
+{
+    BenchStats stats;
+    if (samples.empty()) return stats;
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) {
+        double rank = p * (samples.size() - 1);
+        size_t low = (size_t)rank;
+        size_t high = std::min(low + 1, samples.size() - 1);
+        return samples[low] + (samples[high] - samples[low]) * (rank - low);
+    };
+    stats.median = percentile(0.5);
+    stats.p10 = percentile(0.1);
+    stats.p90 = percentile(0.9);
+    stats.min = samples[0];
+    for (double sample : samples) stats.mean += sample;
+    stats.mean /= samples.size();
+    return stats;
+}
+
+struct BenchResult
+{
+    std::string group;    // micro, frame or threads
+    std::string name;
+    std::string unit;     // of the stats: ns per call or ms per frame
+    BenchStats stats;
+    double ratePerSecond; // calls or primary rays per second at the median
+    size_t peakRssKb;     // of the whole process when the case finished
+};
+
+// Keeps benchmark results observable so the measured work is not optimized
+// away.
+volatile double BenchmarkSink;
+
+// Micro benchmarks of the hot routines, whole frames at several sizes and
+// scene complexities, and a thread-scaling sweep. Every case runs once to
+// warm up and is then timed over options.benchRuns runs. Frame timings cover
+// rendering only; scenes are built and prepared beforehand.
+template <typename Real>
+class BenchmarkSuite
+{
+    const RenderOptions& options;
+    std::vector<BenchResult> results;
+
+    void Add(const std::string& group, const std::string& name, const std::string& unit,
+             const std::vector<double>& samples, double workPerSample, double samplesPerSecond)
+    {
+        BenchResult result{ group, name, unit, Summarize(samples), 0.0, PeakRssKb() };
+        if (result.stats.median > 0) result.ratePerSecond = workPerSample * samplesPerSecond / result.stats.median;
+        results.push_back(result);
+
+        printf("%-7s %-42s %10.2f %10.2f %10.2f %-3s %10.3g/s %10zu\n", group.c_str(), name.c_str(),
+            result.stats.median, result.stats.p10, result.stats.p90, unit.c_str(), result.ratePerSecond, result.peakRssKb);
+        fflush(stdout);
+    }
+
+    // Times iterations calls of body(i), which returns a value to keep.
+    template <typename Body>
+    void Micro(const std::string& name, int iterations, Body&& body)
+    {
+        double sink = 0;
+        for (int i = 0; i < iterations; ++i) sink += body(i);
+
+        std::vector<double> samples;
+        for (int run = 0; run < options.benchRuns; ++run) {
+            auto start = Clock::now();
+            for (int i = 0; i < iterations; ++i) sink += body(i);
+            samples.push_back(MillisecondsSince(start) * 1e6 / iterations);
+        }
+        BenchmarkSink = sink;
+        Add("micro", name, "ns", samples, 1.0, 1e9);
+    }
+
+    void Frame(const std::string& group, const std::string& name, Scene<Real>& scene, TraceSettings settings,
+               int width, int height, int threads)
+    {
+        PrepareScene(scene, settings);
+        RayTracerEngine<Real> rayTracer(scene, settings);
+        RenderOptions frameOptions = options;
+        frameOptions.threads = threads;
+        std::vector<RgbColor> image((size_t)width * height);
+
+        RenderFrame(rayTracer, &image[0], width, height, frameOptions);
+        std::vector<double> samples;
+        for (int run = 0; run < options.benchRuns; ++run) {
+            auto start = Clock::now();
+            RenderFrame(rayTracer, &image[0], width, height, frameOptions);
+            samples.push_back(MillisecondsSince(start));
+        }
+        Add(group, name, "ms", samples, (double)width * height, 1e3);
+    }
+
+    void RunMicro()
+    {
+        const int inputCount = 1024;
+        const int iterations = 1000000;
+        std::mt19937 random(1);
+        std::uniform_real_distribution<double> unit(-1.0, 1.0);
+
+        Scene<Real> scene;
+        ShinySurface<Real> shiny;
+        CheckerboardSurface<Real> checkerboard;
+        Sphere<Real> sphere(Vector<Real>(0.0, 1.0, -0.25), 1.0, shiny);
+        Plane<Real> plane(Vector<Real>(0.0, 1.0, 0.0), 0.0, checkerboard);
+
+        // Camera rays through random pixels, so a realistic share of them
+        // hits the sphere and the plane.
+        std::vector<Vector<Real>> vectors;
+        std::vector<Ray<Real>> rays;
+        std::vector<Vector<Real>> points;
+        for (int i = 0; i < inputCount; ++i) {
+            vectors.push_back(Vector<Real>(unit(random), unit(random), unit(random)));
+            Real x = (Real)((unit(random) + 1.0) * 250.0);
+            Real y = (Real)((unit(random) + 1.0) * 250.0);
+            rays.push_back(Ray<Real>(scene.camera.pos, scene.camera.GetPoint(x, y, 500, 500)));
+            points.push_back(Vector<Real>(unit(random) * 10.0, 0.0, unit(random) * 10.0));
+        }
+        auto mask = inputCount - 1;
+
+        Micro("Vector::Norm", iterations, [&](int i) {
+            return (double)vectors[i & mask].Norm().x;
+        });
+        Micro("Sphere::Intersect", iterations, [&](int i) {
+            Real dist;
+            return sphere.Intersect(rays[i & mask], dist) ? (double)dist : 0.0;
+        });
+        Micro("Plane::Intersect", iterations, [&](int i) {
+            Real dist;
+            return plane.Intersect(rays[i & mask], dist) ? (double)dist : 0.0;
+        });
+        Micro("CheckerboardSurface::GetSurfaceProperties", iterations, [&](int i) {
+            return (double)checkerboard.GetSurfaceProperties(points[i & mask]).Reflect;
+        });
+        Micro("Material<Checkerboard>::Evaluate", iterations, [&](int i) {
+            return (double)Material<Real, MaterialKind::Checkerboard>::Evaluate(points[i & mask]).Reflect;
+        });
+
+        // Full shading of primary hits in the default scene, reflections and
+        // shadow rays included, through the object layout.
+        RayTracerEngine<Real> rayTracer(scene);
+        std::vector<Ray<Real>> hitRays;
+        std::vector<Intersection<Real>> hits;
+        for (auto& ray : rays) {
+            Intersection<Real> inter;
+            if (rayTracer.GetClosestIntersection(ray, inter)) {
+                hitRays.push_back(ray);
+                hits.push_back(inter);
+            }
+        }
+        if (!hits.empty()) {
+            Micro("RayTracerEngine::Shade", iterations / 100, [&](int i) {
+                size_t k = i % hits.size();
+                return (double)rayTracer.Shade(hitRays[k], hits[k], 0).r;
+            });
+        }
+    }
+
+    // Times the conversion of a linear frame to 8-bit, row by row as the
+    // engine does it, with the conversion of isa.
+    void Convert(SimdIsa isa, int width, int height)
+    {
+        PixelConverter convert = GetPixelConverter(isa);
+        std::mt19937 random(1);
+        std::uniform_real_distribution<float> radiance(-0.1f, 1.2f);
+        std::vector<LinearRgb> linear((size_t)width * height);
+        for (auto& pixel : linear) pixel = LinearRgb{ radiance(random), radiance(random), radiance(random) };
+        std::vector<RgbColor> image(linear.size());
+
+        std::vector<double> samples;
+        for (int run = 0; run <= options.benchRuns; ++run) {
+            auto start = Clock::now();
+            for (int y = 0; y < height; ++y) {
+                convert(&linear[(size_t)y * width], &image[(size_t)y * width], width, 255.0f);
+            }
+            if (run > 0) samples.push_back(MillisecondsSince(start));
+        }
+        BenchmarkSink = image[image.size() / 2].g;
+        std::string size = std::to_string(width) + "x" + std::to_string(height);
+        Add("frame", "convert " + size + " " + SimdIsaName(isa), "ms", samples, (double)width * height, 1e3);
+    }
+
+    void RunFrames()
+    {
+        for (int size : { 256, 512, 1024 }) {
+            Scene<Real> scene;
+            std::string name = "default " + std::to_string(size) + "x" + std::to_string(size);
+            Frame("frame", name, scene, options.trace, size, size, options.threads);
+        }
+
+        // Conversion to 8-bit is part of the frames above; alone it should
+        // be a small fraction of them.
+        for (SimdIsa isa : { SimdIsa::Scalar, SimdIsa::Sse2, SimdIsa::Avx2 }) {
+            if (SupportedSimdIsa(isa) == isa) Convert(isa, 1024, 1024);
+        }
+
+        // Sphere fields are always traced through a BVH; a linear scan would
+        // only measure the scene size.
+        for (int count : { 1000, 10000 }) {
+            Scene<Real> scene(count);
+            TraceSettings settings = options.trace;
+            settings.acceleration = Acceleration::Bvh;
+            Frame("frame", "spheres-" + std::to_string(count) + " 512x512", scene, settings, 512, 512, options.threads);
+        }
+    }
+
+    void RunThreadScaling()
+    {
+        int hardware = ThreadPool::HardwareThreads();
+        std::vector<int> counts;
+        for (int n = 1; n < hardware; n *= 2) counts.push_back(n);
+        counts.push_back(hardware);
+
+        Scene<Real> scene;
+        for (int threads : counts) {
+            Frame("threads", "default 512x512 threads=" + std::to_string(threads), scene, options.trace, 512, 512, threads);
+        }
+    }
+
+public:
+    explicit BenchmarkSuite(const RenderOptions& options) : options(options) {}
+
+    const std::vector<BenchResult>& Results() const { return results; }
+
+    void Run()
+    {
+        printf("%-7s %-42s %10s %10s %10s %-3s %12s %10s\n", "group", "name", "median", "p10", "p90", "", "rate", "rss[KB]");
+        RunMicro();
+        RunFrames();
+        RunThreadScaling();
+    }
+};
+
+void WriteBenchmarkJson(const std::string& path, const std::vector<BenchResult>& results, const RenderOptions& options, const char* precision)
+{
+    std::ofstream file(path, std::ios::trunc);
+    if (!file) throw std::runtime_error(path + ": cannot create");
+    file.precision(9);
+
+    auto& trace = options.trace;
+    file << "{\n"
+         << "  \"precision\": \"" << precision << "\",\n"
+         << "  \"acceleration\": \"" << AccelerationName(trace.acceleration) << "\",\n"
+         << "  \"layout\": \"" << (trace.layout == SceneLayout::Pools ? "pools" : "objects") << "\",\n"
+         << "  \"packets\": \"" << SimdIsaName(SupportedSimdIsa(trace.packets)) << "\",\n"
+         << "  \"threads\": " << options.threads << ",\n"
+         << "  \"hardwareThreads\": " << ThreadPool::HardwareThreads() << ",\n"
+         << "  \"runs\": " << options.benchRuns << ",\n"
+         << "  \"peakRssKb\": " << PeakRssKb() << ",\n"
+         << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto& r = results[i];
+        file << "    { \"group\": \"" << r.group << "\", \"name\": \"" << r.name << "\", \"unit\": \"" << r.unit << "\""
+             << ", \"median\": " << r.stats.median << ", \"p10\": " << r.stats.p10 << ", \"p90\": " << r.stats.p90
+             << ", \"min\": " << r.stats.min << ", \"mean\": " << r.stats.mean
+             << ", \"ratePerSecond\": " << r.ratePerSecond << ", \"peakRssKb\": " << r.peakRssKb << " }"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n}\n";
+    if (!file) throw std::runtime_error(path + ": write failed");
+}
+
+template <typename Real>
+int RunBenchmarkSuite(const RenderOptions& options)
+{
+    BenchmarkSuite<Real> suite(options);
+    suite.Run();
+    if (options.benchJsonPath.empty()) return 0;
+    try {
+        WriteBenchmarkJson(options.benchJsonPath, suite.Results(), options, RealTraits<Real>::Name);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+void PrintUsage()
+{
+    std::cout << "Usage: RayTracer [options]" << std::endl
+              << "  --size W H              image size in pixels (default 500 500)" << std::endl
+              << "  --output FILE           output image (default cpp-raytracer.bmp); FILE.pfm gets the linear radiance as floats" << std::endl
+              << "  --exposure E            scale radiance by E before it is quantized to 8 bits (default 1)" << std::endl
+              << "  --stream ROWS           render in bands of ROWS rows written straight to the output file" << std::endl
+              << "  --adaptive N            progressive adaptive supersampling up to an NxN grid per pixel, N a power of two" << std::endl
+              << "  --threshold T           contrast/noise threshold for --adaptive (default 0.05)" << std::endl
+              << "  --threads N             render with N threads, 0 = all hardware threads (default 1)" << std::endl
+              << "  --tile N                tile size in pixels for threaded rendering (default 32)" << std::endl
+              << "  --accel linear|bvh|grid intersection acceleration (default linear); grid traces objects" << std::endl
+              << "  --layout objects|pools  trace through Thing objects or compiled structure-of-arrays pools" << std::endl
+              << "  --packets ISA           trace primary rays in packets of 4 doubles or 8 floats: auto|scalar|sse2|avx2" << std::endl
+              << "  --wavefront             trace tiles a bounce at a time through ray queues" << std::endl
+              << "  --reorder               wavefront tracing with reflection rays sorted by octant and origin" << std::endl
+              << "  --precision double|float  scalar type of the whole tracing pipeline (default double)" << std::endl
+              << "  --compare-precision     render in double and float and report the largest pixel difference" << std::endl
+              << "  --verify                also render through the scalar exact double path and report the error against it" << std::endl
+              << "  --verify-threshold N    --verify counts pixels off by more than N/255 and fails with exit code 2 on any (default 1)" << std::endl
+              << "  --max-error N           fail with exit code 2 when --verify is off by more than N/255" << std::endl
+              << "  --heatmap FILE          --verify difference image (default the output path with -heatmap)" << std::endl
+              << "  --spheres N             render a generated field of N spheres instead of the default scene" << std::endl
+              << "  --instances N           render N instances of one group of 100 (or --spheres N) spheres" << std::endl
+              << "  --scene FILE            render a scene file; text scenes are compiled to FILE.cache for later runs" << std::endl
+              << "  --save-scene FILE       write the scene as text" << std::endl
+              << "  --animate FILE          render the keyframed animation in FILE, re-tracing only what changed" << std::endl
+              << "  --full-frames           with --animate, trace every frame from scratch" << std::endl
+              << "  --refit                 with --animate, refit the first frame's BVH to moved objects instead of rebuilding it" << std::endl
+              << "  --bvh-split median|sah  BVH build: median splits build fastest (default), surface area splits trace uneven scenes faster" << std::endl
+              << "  --views FILE            render the scene from every camera line of FILE, to numbered outputs" << std::endl
+              << "  --turntable N           render N views circling the scene, to numbered outputs" << std::endl
+              << "  --worker [HOST:]PORT    serve tiles to coordinators on HOST:PORT (default host 127.0.0.1)" << std::endl
+              << "  --distribute A[,A...]   render on the workers at the HOST:PORT addresses A" << std::endl
+              << "  --worker-timeout S      give up on a worker silent for S seconds with work outstanding (default 30)" << std::endl
+              << "  --camera X Y Z LX LY LZ  place the camera at X Y Z looking at LX LY LZ" << std::endl
+              << "  --serve SOCKET          keep scenes and threads loaded and render jobs sent to the Unix socket SOCKET" << std::endl
+              << "  --submit SOCKET         send the job lines on standard input to the server on SOCKET" << std::endl
+              << "  --priority N            server jobs: higher priorities run first (default 0)" << std::endl
+              << "  --shm NAME              server jobs: write the BMP image to shared memory object NAME, not --output" << std::endl
+              << "  --bench-bvh             time BVH against linear scan from 10 to 1,000,000 spheres" << std::endl
+              << "  --bench-grid            time the uniform grid against linear scan on even and clustered spheres" << std::endl
+              << "  --bench-build           time BVH builds and refits of 1,000,000 spheres (or --spheres N) on 1 to --threads threads" << std::endl
+              << "  --bench-reorder         time wavefront tracing of 300,000 spheres (or --spheres N) with and without --reorder" << std::endl
+              << "  --bench-views N         time N views of 100,000 spheres (or --spheres N) as one batch and as separate renders" << std::endl
+              << "  --stats-json FILE       write ray statistics as JSON (builds with -DRAYTRACER_STATS)" << std::endl
+              << "  --bench                 run the micro, frame and thread-scaling benchmarks" << std::endl
+              << "  --bench-runs N          timed runs per benchmark after one warm-up run (default 5)" << std::endl
+              << "  --bench-json FILE       also write the benchmark results as JSON" << std::endl;
+}
+
+bool ParseOptions(int argc, char** argv, RenderOptions& options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--size" && i + 2 < argc) {
+            options.width = std::atoi(argv[++i]);
+            options.height = std::atoi(argv[++i]);
+            if (options.width <= 0 || options.height <= 0) return false;
+        } else if (arg == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        } else if (arg == "--stream" && hasValue) {
+            options.bandHeight = std::atoi(argv[++i]);
+            if (options.bandHeight <= 0) return false;
+        } else if (arg == "--adaptive" && hasValue) {
+            options.adaptiveGrid = std::atoi(argv[++i]);
+            // Passes double the grid, so only powers of two are reachable.
+            if (options.adaptiveGrid < 1 || (options.adaptiveGrid & (options.adaptiveGrid - 1)) != 0) return false;
+        } else if (arg == "--threshold" && hasValue) {
+            options.adaptiveThreshold = std::atof(argv[++i]);
+            if (!(options.adaptiveThreshold >= 0)) return false;
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::atoi(argv[++i]);
+            if (options.threads <= 0) options.threads = ThreadPool::HardwareThreads();
+        } else if (arg == "--tile" && hasValue) {
+            options.tileSize = std::atoi(argv[++i]);
+            if (options.tileSize <= 0) return false;
+        } else if (arg == "--accel" && hasValue) {
+            std::string value = argv[++i];
+            if (value == "linear") options.trace.acceleration = Acceleration::Linear;
+            else if (value == "bvh") options.trace.acceleration = Acceleration::Bvh;
+            else if (value == "grid") options.trace.acceleration = Acceleration::Grid;
+            else return false;
+        } else if (arg == "--layout" && hasValue) {
+            std::string value = argv[++i];
+            if (value == "objects") options.trace.layout = SceneLayout::Objects;
+            else if (value == "pools") options.trace.layout = SceneLayout::Pools;
+            else return false;
+        } else if (arg == "--packets" && hasValue) {
+            std::string value = argv[++i];
+            if (value == "auto") options.trace.packets = DetectSimdIsa();
+            else if (value == "scalar") options.trace.packets = SimdIsa::Scalar;
+            else if (value == "sse2") options.trace.packets = SimdIsa::Sse2;
+            else if (value == "avx2") options.trace.packets = SimdIsa::Avx2;
+            else return false;
+        } else if (arg == "--wavefront") {
+            options.trace.wavefront = true;
+        } else if (arg == "--reorder") {
+            options.trace.reorder = true;
+        } else if (arg == "--exposure" && hasValue) {
+            options.trace.exposure = (float)std::atof(argv[++i]);
+            if (!(options.trace.exposure > 0 && options.trace.exposure < std::numeric_limits<float>::infinity())) return false;
+        } else if (arg == "--max-error" && hasValue) {
+            options.maxError = std::atoi(argv[++i]);
+            if (options.maxError < 0) return false;
+        } else if (arg == "--precision" && hasValue) {
+            std::string value = argv[++i];
+            if (value == "double") options.precision = Precision::Double;
+            else if (value == "float") options.precision = Precision::Float;
+            else return false;
+        } else if (arg == "--compare-precision") {
+            options.comparePrecision = true;
+        } else if (arg == "--verify") {
+            options.verify = true;
+        } else if (arg == "--verify-threshold" && hasValue) {
+            options.verifyThreshold = std::atoi(argv[++i]);
+            if (options.verifyThreshold < 0) return false;
+        } else if (arg == "--heatmap" && hasValue) {
+            options.heatmapPath = argv[++i];
+        } else if (arg == "--spheres" && hasValue) {
+            options.spheres = std::atoi(argv[++i]);
+            if (options.spheres < 0) return false;
+        } else if (arg == "--instances" && hasValue) {
+            options.instances = std::atoi(argv[++i]);
+            if (options.instances <= 0) return false;
+        } else if (arg == "--scene" && hasValue) {
+            options.scenePath = argv[++i];
+        } else if (arg == "--save-scene" && hasValue) {
+            options.saveScenePath = argv[++i];
+        } else if (arg == "--animate" && hasValue) {
+            options.animationPath = argv[++i];
+        } else if (arg == "--full-frames") {
+            options.fullFrames = true;
+        } else if (arg == "--refit") {
+            options.trace.refit = true;
+        } else if (arg == "--bvh-split" && hasValue) {
+            std::string value = argv[++i];
+            if (value == "median") options.trace.split = BvhSplit::Median;
+            else if (value == "sah") options.trace.split = BvhSplit::Sah;
+            else return false;
+        } else if (arg == "--worker" && hasValue) {
+            options.workerAddress = argv[++i];
+        } else if (arg == "--distribute" && hasValue) {
+            std::stringstream list(argv[++i]);
+            for (std::string address; std::getline(list, address, ',');) {
+                if (!address.empty()) options.distributeAddresses.push_back(address);
+            }
+            if (options.distributeAddresses.empty()) return false;
+        } else if (arg == "--camera" && i + 6 < argc) {
+            double v[6];
+            for (double& value : v) value = std::atof(argv[++i]);
+            options.hasCamera = true;
+            options.cameraPosition = Vector<double>(v[0], v[1], v[2]);
+            options.cameraLookAt = Vector<double>(v[3], v[4], v[5]);
+            if ((options.cameraLookAt - options.cameraPosition).Length() == 0) return false;
+        } else if (arg == "--serve" && hasValue) {
+            options.servePath = argv[++i];
+        } else if (arg == "--submit" && hasValue) {
+            options.submitPath = argv[++i];
+        } else if (arg == "--priority" && hasValue) {
+            options.priority = std::atoi(argv[++i]);
+        } else if (arg == "--shm" && hasValue) {
+            options.sharedMemoryName = argv[++i];
+        } else if (arg == "--worker-timeout" && hasValue) {
+            options.workerTimeout = std::atoi(argv[++i]);
+            if (options.workerTimeout <= 0) return false;
+        } else if (arg == "--bench-bvh") {
+            options.benchBvh = true;
+        } else if (arg == "--bench-grid") {
+            options.benchGrid = true;
+        } else if (arg == "--bench-build") {
+            options.benchBuild = true;
+        } else if (arg == "--bench-reorder") {
+            options.benchReorder = true;
+        } else if (arg == "--bench-views" && hasValue) {
+            options.benchViews = std::atoi(argv[++i]);
+            if (options.benchViews <= 0) return false;
+        } else if (arg == "--views" && hasValue) {
+            options.viewsPath = argv[++i];
+        } else if (arg == "--turntable" && hasValue) {
+            options.turntable = std::atoi(argv[++i]);
+            if (options.turntable <= 0) return false;
+        } else if (arg == "--stats-json" && hasValue) {
+            options.statsJsonPath = argv[++i];
+            if (!StatsEnabled) std::cerr << "--stats-json: built without RAYTRACER_STATS, no statistics are collected" << std::endl;
+        } else if (arg == "--bench") {
+            options.bench = true;
+        } else if (arg == "--bench-runs" && hasValue) {
+            options.benchRuns = std::atoi(argv[++i]);
+            if (options.benchRuns < 1) return false;
+        } else if (arg == "--bench-json" && hasValue) {
+            options.benchJsonPath = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    // Streamed bands are written as they finish, before adaptive passes
+    // could revisit them.
+    if (options.bandHeight > 0 && options.adaptiveGrid > 1) {
+        std::cerr << "--stream and --adaptive do not combine" << std::endl;
+        return false;
+    }
+    if (!options.animationPath.empty() && (options.bandHeight > 0 || options.adaptiveGrid > 1 || options.comparePrecision)) {
+        std::cerr << "--animate does not combine with --stream, --adaptive or --compare-precision" << std::endl;
+        return false;
+    }
+    if (!options.distributeAddresses.empty() && (options.bandHeight > 0 || options.adaptiveGrid > 1 ||
+        options.comparePrecision || !options.animationPath.empty())) {
+        std::cerr << "--distribute renders whole frames only" << std::endl;
+        return false;
+    }
+    // Workers receive the scene as a scene cache, which has no instances.
+    if (!options.distributeAddresses.empty() && options.instances > 0) {
+        std::cerr << "--distribute cannot send --instances scenes: scene caches hold no instances" << std::endl;
+        return false;
+    }
+    bool batch = !options.viewsPath.empty() || options.turntable > 0;
+    if (options.maxError >= 0 && !options.verify) {
+        std::cerr << "--max-error needs --verify" << std::endl;
+        return false;
+    }
+    if (IsPfmPath(options.outputPath) && (options.adaptiveGrid > 1 || options.comparePrecision || options.verify ||
+        !options.animationPath.empty() || !options.distributeAddresses.empty() || batch)) {
+        std::cerr << "PFM output is written for single frames without --adaptive or comparisons" << std::endl;
+        return false;
+    }
+    if (options.verify && (options.bandHeight > 0 || options.adaptiveGrid > 1 || options.comparePrecision ||
+        !options.animationPath.empty() || !options.distributeAddresses.empty() || batch)) {
+        std::cerr << "--verify compares single whole frames only" << std::endl;
+        return false;
+    }
+    if (batch && (options.bandHeight > 0 || options.adaptiveGrid > 1 || options.comparePrecision ||
+        !options.animationPath.empty() || !options.distributeAddresses.empty() || (!options.viewsPath.empty() && options.turntable > 0))) {
+        std::cerr << "--views and --turntable render whole frames and do not combine with each other" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+template <typename Real>
+double RenderTimed(Scene<Real>& scene, RgbColor* image, RenderOptions options)
+{
+    PrepareScene(scene, options.trace);
+    RayTracerEngine<Real> rayTracer(scene, options.trace);
+    auto start = Clock::now();
+    RenderFrame(rayTracer, image, options.width, options.height, options);
+    return MillisecondsSince(start);
+}
+
+// path with text inserted before its extension, or appended if it has none.
+std::string InsertBeforeExtension(const std::string& path, const std::string& text)
+{
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return path + text;
+    return path.substr(0, dot) + text + path.substr(dot);
+}
+
+// Per-pixel deviation of an image from a reference, in 8-bit levels of the
+// worst channel.
+struct ImageDifference
+{
+    int max = 0;
+    size_t maxPixel = 0;
+    size_t differing = 0;
+    size_t overThreshold = 0;  // pixels off by more than the threshold CompareImages was given
+    double mean = 0;
+};
+
+int PixelDifference(const RgbColor& a, const RgbColor& b)
+{
+    return std::max({ std::abs(a.r - b.r), std::abs(a.g - b.g), std::abs(a.b - b.b) });
+}
+
+ImageDifference CompareImages(const std::vector<RgbColor>& reference, const std::vector<RgbColor>& image, int threshold = 0)
+{
+    ImageDifference result;
+    uint64_t total = 0;
+    for (size_t i = 0; i < reference.size(); ++i) {
+        int difference = PixelDifference(reference[i], image[i]);
+        if (difference > result.max) {
+            result.max = difference;
+            result.maxPixel = i;
+        }
+        if (difference > 0) ++result.differing;
+        if (difference > threshold) ++result.overThreshold;
+        total += difference;
+    }
+    if (!reference.empty()) result.mean = (double)total / reference.size();
+    return result;
+}
+
+void PrintImageDifference(const ImageDifference& difference, int width, size_t pixels)
+{
+    printf("Max pixel difference: %d/255 at (%d, %d)\n", difference.max, (int)(difference.maxPixel % width), (int)(difference.maxPixel / width));
+    printf("Pixels differing: %zu (%.2f%%), mean difference %.4f/255\n",
+        difference.differing, 100.0 * difference.differing / pixels, difference.mean);
+}
+
+// The settings --verify renders the reference with: scalar rays through the
+// objects, no wavefront queues. Acceleration structures only skip objects a
+// ray misses, so the selected one is kept, and so is the exposure of the
+// output.
+TraceSettings ReferenceSettings(const TraceSettings& settings)
+{
+    TraceSettings reference;
+    reference.acceleration = settings.acceleration;
+    reference.exposure = settings.exposure;
+    return reference;
+}
+
+// Shows where image strays from reference: matching pixels as the reference
+// dimmed to gray, the others from yellow at one level off to red at scale
+// levels or more.
+std::vector<RgbColor> DifferenceHeatmap(const std::vector<RgbColor>& reference, const std::vector<RgbColor>& image, int scale)
+{
+    std::vector<RgbColor> heatmap(reference.size());
+    for (size_t i = 0; i < reference.size(); ++i) {
+        const RgbColor& a = reference[i];
+        int difference = PixelDifference(a, image[i]);
+        if (difference == 0) {
+            UInt8 gray = (UInt8)((a.r + a.g + a.b) / 12);
+            heatmap[i] = RgbColor{ gray, gray, gray, 255 };
+        } else {
+            int heat = std::min(difference - 1, scale - 1) * 255 / std::max(scale - 1, 1);
+            heatmap[i] = RgbColor{ 0, (UInt8)(255 - heat), 255, 255 };
+        }
+    }
+    return heatmap;
+}
+
+// Renders the scene through the reference path and through the selected
+// one, which may be float precision, packets or reordered wavefronts, and
+// reports how far the selected image strays. Writes the selected image and
+// a heatmap of the differences, and fails with exit code 2 when any pixel
+// is off by more than the --max-error budget or, without one, by more than
+// --verify-threshold.
+template <typename Real>
+int VerifyRender(Scene<double>& referenceScene, Scene<Real>& scene, const RenderOptions& options)
+{
+    const int width = options.width;
+    const int height = options.height;
+    RenderOptions referenceOptions = options;
+    referenceOptions.trace = ReferenceSettings(options.trace);
+    std::vector<RgbColor> reference((size_t)width * height);
+    std::vector<RgbColor> image((size_t)width * height);
+    double referenceMs = RenderTimed(referenceScene, &reference[0], referenceOptions);
+    double optimizedMs = RenderTimed(scene, &image[0], options);
+
+    ImageDifference difference = CompareImages(reference, image, options.verifyThreshold);
+    printf("optimized: %.1f ms, reference: %.1f ms\n", optimizedMs, referenceMs);
+    PrintImageDifference(difference, width, reference.size());
+    printf("Pixels over %d/255: %zu (%.2f%%)\n", options.verifyThreshold, difference.overThreshold,
+        100.0 * difference.overThreshold / reference.size());
+    SaveImage(&image[0], width, height, options.outputPath.c_str());
+
+    std::string heatmapPath = options.heatmapPath.empty() ? InsertBeforeExtension(options.outputPath, "-heatmap") : options.heatmapPath;
+    std::vector<RgbColor> heatmap = DifferenceHeatmap(reference, image, std::max(difference.max, 2));
+    SaveImage(&heatmap[0], width, height, heatmapPath.c_str());
+
+    int budget = (options.maxError >= 0) ? options.maxError : options.verifyThreshold;
+    if (difference.max > budget) {
+        std::cerr << "Error " << difference.max << "/255 exceeds the budget of " << budget << "/255" << std::endl;
+        return 2;
+    }
+    return 0;
+}
+
+// Prints the merged ray statistics and optionally writes them as JSON.
+// renderMs is the wall time the counted rays took.
+void ReportRayStats(double renderMs, const std::string& jsonPath)
+{
+    RayStats total;
+    std::vector<std::pair<size_t, double>> threadTiles;  // tile count and busy time per thread
+    for (auto& stats : RayStatsRegistry::Threads()) {
+        total.Add(*stats);
+        double busy = 0;
+        for (auto& tile : stats->tiles) busy += tile.ms;
+        if (!stats->tiles.empty()) threadTiles.push_back({ stats->tiles.size(), busy });
+    }
+
+    const char* kindNames[RayKindCount] = { "primary", "reflection", "shadow" };
+    const char* testNames[TestKindCount] = { "plane", "sphere", "box", "cell" };
+    uint64_t rays = total.TotalRays();
+    double raysPerSecond = (renderMs > 0) ? rays * 1000.0 / renderMs : 0.0;
+    double testsPerRay = (rays > 0) ? (double)total.TotalTests() / rays : 0.0;
+
+    std::vector<double> tileMs;
+    for (auto& tile : total.tiles) tileMs.push_back(tile.ms);
+    std::sort(tileMs.begin(), tileMs.end());
+
+    printf("Rays: %llu in %.1f ms, %.3g rays/s, %.2f intersection tests per ray\n",
+        (unsigned long long)rays, renderMs, raysPerSecond, testsPerRay);
+    for (int kind = 0; kind < RayKindCount; ++kind) {
+        uint64_t count = total.Rays(kind);
+        printf("  %-10s %12llu  %s %5.1f%%  by depth:", kindNames[kind], (unsigned long long)count,
+            kind == ShadowRay ? "blocked" : "hit    ", count ? 100.0 * total.hits[kind] / count : 0.0);
+        for (int depth = 0; depth < StatsDepthCount; ++depth) {
+            if (total.rays[kind][depth]) printf(" %d:%llu", depth, (unsigned long long)total.rays[kind][depth]);
+        }
+        printf("\n");
+    }
+    printf("Intersection tests:");
+    for (int kind = 0; kind < TestKindCount; ++kind) printf(" %s %llu", testNames[kind], (unsigned long long)total.tests[kind]);
+    printf("\n");
+    if (!tileMs.empty()) {
+        printf("Tiles: %zu, min %.2f ms, median %.2f ms, max %.2f ms\n",
+            tileMs.size(), tileMs.front(), tileMs[tileMs.size() / 2], tileMs.back());
+        for (size_t i = 0; i < threadTiles.size(); ++i) {
+            printf("  thread %zu: %zu tiles, %.1f ms busy\n", i, threadTiles[i].first, threadTiles[i].second);
+        }
+    }
+
+    if (jsonPath.empty()) return;
+    std::ofstream file(jsonPath, std::ios::trunc);
+    file.precision(9);
+    file << "{\n  \"renderMs\": " << renderMs << ",\n  \"rays\": " << rays
+         << ",\n  \"raysPerSecond\": " << raysPerSecond << ",\n  \"testsPerRay\": " << testsPerRay << ",\n  \"rayKinds\": {\n";
+    for (int kind = 0; kind < RayKindCount; ++kind) {
+        file << "    \"" << kindNames[kind] << "\": { \"count\": " << total.Rays(kind) << ", \"hits\": " << total.hits[kind] << ", \"byDepth\": [";
+        for (int depth = 0; depth < StatsDepthCount; ++depth) file << (depth ? ", " : "") << total.rays[kind][depth];
+        file << "] }" << (kind + 1 < RayKindCount ? ",\n" : "\n");
+    }
+    file << "  },\n  \"tests\": {";
+    for (int kind = 0; kind < TestKindCount; ++kind) file << (kind ? ", " : " ") << "\"" << testNames[kind] << "\": " << total.tests[kind];
+    file << " },\n  \"threads\": [";
+    for (size_t i = 0; i < threadTiles.size(); ++i) {
+        file << (i ? ", " : "") << "{ \"tiles\": " << threadTiles[i].first << ", \"busyMs\": " << threadTiles[i].second << " }";
+    }
+    file << "],\n  \"tiles\": [\n";
+    for (size_t i = 0; i < total.tiles.size(); ++i) {
+        auto& tile = total.tiles[i];
+        file << "    [" << tile.x0 << ", " << tile.y0 << ", " << tile.x1 << ", " << tile.y1 << ", " << tile.ms << "]"
+             << (i + 1 < total.tiles.size() ? ",\n" : "\n");
+    }
+    file << "  ]\n}\n";
+    if (!file) std::cerr << jsonPath << ": write failed" << std::endl;
+}
+
+template <typename Real>
+int RenderOutput(RayTracerEngine<Real>& rayTracer, const RenderOptions& options, ThreadPool& pool, Clock::time_point t1)
+{
+    const int width = options.width;
+    const int height = options.height;
+
+    bool hdr = IsPfmPath(options.outputPath);
+    if (options.bandHeight > 0) {
+        bool written;
+        if (hdr) {
+            PfmStreamWriter writer(options.outputPath.c_str(), width, height);
+            written = RenderStreaming(rayTracer, writer, width, height, options.bandHeight, pool);
+        } else {
+            BitmapStreamWriter writer(options.outputPath.c_str(), width, height);
+            written = RenderStreaming(rayTracer, writer, width, height, options.bandHeight, pool);
+        }
+
+        std::cout << "Completed in " << (int)MillisecondsSince(t1) << " ms" << std::endl;
+        if (!written) {
+            std::cerr << options.outputPath << ": write failed" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // The traced radiance, written as it is.
+    if (hdr) {
+        std::vector<LinearRgb> linear((size_t)width * height);
+        RenderFrame(rayTracer, &linear[0], width, height, pool, options);
+        std::cout << "Completed in " << (int)MillisecondsSince(t1) << " ms" << std::endl;
+        if (!SaveImage(&linear[0], width, height, options.outputPath.c_str())) {
+            std::cerr << options.outputPath << ": write failed" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::vector<RgbColor> bitmapData((size_t)width * height);
+
+    // Every pass rewrites the output, so a usable image exists from the first
+    // pass on.
+    if (options.adaptiveGrid > 1) {
+        AdaptiveSampler<Real> sampler(rayTracer, width, height, options.adaptiveGrid, options.adaptiveThreshold);
+        sampler.Render(pool, [&](int pass, int grid, size_t pixels) {
+            sampler.Resolve(&bitmapData[0]);
+            SaveImage(&bitmapData[0], width, height, options.outputPath.c_str());
+            std::cout << "Pass " << pass << ": " << grid << "x" << grid << " samples in " << pixels
+                      << " pixels, " << (int)MillisecondsSince(t1) << " ms" << std::endl;
+        });
+
+        int grid = options.adaptiveGrid;
+        uint64_t uniform = (uint64_t)width * height * grid * grid;
+        printf("Samples: %llu, %.1f%% of uniform %dx%d supersampling\n",
+            (unsigned long long)sampler.Samples(), 100.0 * sampler.Samples() / uniform, grid, grid);
+        std::cout << "Completed in " << (int)MillisecondsSince(t1) << " ms" << std::endl;
+        return 0;
+    }
+
+    RenderFrame(rayTracer, &bitmapData[0], width, height, pool, options);
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>((t2 - t1));
+
+    std::cout << "Completed in " << diff.count() << " ms" << std::endl;
+    SaveImage(&bitmapData[0], width, height, options.outputPath.c_str());
+
+    return 0;
+}
+
+// Traces scene as the options ask and writes the output image.
+template <typename Real>
+int RenderScene(Scene<Real>& scene, RenderOptions options, Clock::time_point t1)
+{
+    // One pool builds the acceleration structures and renders.
+    ThreadPool pool(options.threads);
+    auto start = Clock::now();
+    PrepareScene(scene, options.trace, &pool);
+    if (options.trace.acceleration != Acceleration::Linear && !scene.IsMapped()) {
+        printf("Built %s in %.1f ms\n", AccelerationName(options.trace.acceleration), MillisecondsSince(start));
+    }
+    RayTracerEngine<Real> rayTracer(scene, options.trace);
+    if (options.trace.packets != SimdIsa::None) {
+        std::cout << "Packet tracing: " << SimdIsaName(rayTracer.PacketIsa()) << std::endl;
+    }
+
+    RayStatsRegistry::Reset();
+    auto renderStart = Clock::now();
+    int status = RenderOutput(rayTracer, options, pool, t1);
+    if (StatsEnabled) {
+        ReportRayStats(MillisecondsSince(renderStart), options.statsJsonPath);
+    }
+    return status;
+}
+
+// Output path of an animation frame: the frame number goes before the
+// extension of the output path.
+std::string FramePath(const std::string& outputPath, int frame)
+{
+    char number[16];
+    snprintf(number, sizeof(number), "-%04d", frame);
+    return InsertBeforeExtension(outputPath, number);
+}
+
+// Renders every frame of an animation to its own image, incrementally unless
+// --full-frames asks for complete renders. Only tracing is timed; scene
+// preparation after objects move is reported separately.
+template <typename Real>
+int RenderAnimation(Scene<Real>& scene, const Animation& animation, const RenderOptions& options)
+{
+    const int width = options.width;
+    const int height = options.height;
+    TraceSettings settings = options.trace;
+    ThreadPool pool(options.threads);
+    PrepareScene(scene, settings, &pool);
+    RayTracerEngine<Real> rayTracer(scene, settings);
+    SceneAnimator<Real> animator(scene, animation);
+    IncrementalRenderer<Real> renderer(scene, rayTracer, width, height);
+    std::vector<RgbColor> fullImage(options.fullFrames ? (size_t)width * height : 0);
+
+    RayStatsRegistry::Reset();
+    double traceMs = 0, prepareMs = 0;
+    for (int frame = 0; frame < animation.frames; ++frame) {
+        SceneChanges<Real> changes = animator.Apply(frame);
+        auto start = Clock::now();
+        if (!changes.regions.empty()) PrepareScene(scene, settings, &pool);
+        prepareMs += MillisecondsSince(start);
+
+        start = Clock::now();
+        const RgbColor* image;
+        if (options.fullFrames) {
+            rayTracer.render(&fullImage[0], width, height, pool, options.tileSize);
+            image = &fullImage[0];
+        } else {
+            renderer.Render(pool, changes);
+            image = &renderer.Image()[0];
+        }
+        traceMs += MillisecondsSince(start);
+        SaveImage(image, width, height, FramePath(options.outputPath, frame).c_str());
+    }
+
+    uint64_t pixels = (uint64_t)width * height * animation.frames;
+    printf("%d frames in %.1f ms of tracing, %.1f frames/s; scene updates %.1f ms\n",
+        animation.frames, traceMs, traceMs > 0 ? animation.frames * 1000.0 / traceMs : 0.0, prepareMs);
+    if (!options.fullFrames) {
+        printf("Pixels traced: %.2f%%, shaded again for moved lights: %.2f%%\n",
+            100.0 * renderer.RetracedPixels() / pixels, 100.0 * renderer.ReshadedPixels() / pixels);
+    }
+    if (StatsEnabled) {
+        ReportRayStats(traceMs, options.statsJsonPath);
+    }
+    return 0;
+}
+
+// Renders the scene from every view into its own image, named as
+// animation frames are, in one batch on one pool.
+template <typename Real>
+int RenderViews(Scene<Real>& scene, const std::vector<View>& views, const RenderOptions& options, Clock::time_point t1)
+{
+    const int width = options.width;
+    const int height = options.height;
+    TraceSettings settings = options.trace;
+    auto start = Clock::now();
+    ThreadPool pool(options.threads);
+    PrepareScene(scene, settings, &pool);
+    RayTracerEngine<Real> rayTracer(scene, settings);
+    double prepareMs = MillisecondsSince(start);
+
+    std::vector<Camera<Real>> cameras;
+    std::vector<std::vector<RgbColor>> images(views.size(), std::vector<RgbColor>((size_t)width * height));
+    std::vector<RgbColor*> targets;
+    for (size_t i = 0; i < views.size(); ++i) {
+        cameras.push_back(views[i].ToCamera<Real>());
+        targets.push_back(&images[i][0]);
+    }
+
+    RayStatsRegistry::Reset();
+    start = Clock::now();
+    rayTracer.render(cameras, targets, width, height, pool, options.tileSize);
+    double traceMs = MillisecondsSince(start);
+    for (size_t i = 0; i < views.size(); ++i) {
+        SaveImage(&images[i][0], width, height, FramePath(options.outputPath, (int)i).c_str());
+    }
+
+    printf("%zu views in %.1f ms of tracing, %.1f ms each; scene preparation %.1f ms\n",
+        views.size(), traceMs, traceMs / views.size(), prepareMs);
+    std::cout << "Completed in " << (int)MillisecondsSince(t1) << " ms" << std::endl;
+    if (StatsEnabled) {
+        ReportRayStats(traceMs, options.statsJsonPath);
+    }
+    return 0;
+}
+
+#if defined(_WIN32)
+using SocketHandle = SOCKET;
+const SocketHandle NoSocket = INVALID_SOCKET;
+#else
+using SocketHandle = int;
+const SocketHandle NoSocket = -1;
+#endif
+
+#if defined(MSG_NOSIGNAL)
+const int SendFlags = MSG_NOSIGNAL;  // a closed peer is an error, not SIGPIPE
+#else
+const int SendFlags = 0;
+#endif
+
+// Blocking TCP or Unix domain socket connection or listener. TCP addresses
+// are "host:port"; a bare port means 127.0.0.1.
+class Socket
+{
+    SocketHandle handle = NoSocket;
+
+    explicit Socket(SocketHandle handle) : handle(handle) {}
+
+    static void Startup()
+    {
+#if defined(_WIN32)
+        static bool started = [] {
+            WSADATA data;
+            return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }();
+        if (!started) throw std::runtime_error("cannot start Winsock");
+#endif
+    }
+
+    static addrinfo* Resolve(const std::string& address, bool passive)
+    {
+        Startup();
+        size_t colon = address.rfind(':');
+        std::string host = (colon == std::string::npos) ? "127.0.0.1" : address.substr(0, colon);
+        std::string port = (colon == std::string::npos) ? address : address.substr(colon + 1);
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = passive ? AI_PASSIVE : 0;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || !result) {
+            throw std::runtime_error(address + ": cannot resolve");
+        }
+        return result;
+    }
+
+    static sockaddr_un LocalAddress(const std::string& path)
+    {
+        Startup();
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) throw std::runtime_error(path + ": invalid socket path");
+        std::memcpy(address.sun_path, path.c_str(), path.size());
+        return address;
+    }
+
+    void SetOption(int level, int option, int value)
+    {
+        setsockopt(handle, level, option, (const char*)&value, sizeof(value));
+    }
+
+    void Configure()
+    {
+        SetOption(IPPROTO_TCP, TCP_NODELAY, 1);
+#if defined(SO_NOSIGPIPE)
+        SetOption(SOL_SOCKET, SO_NOSIGPIPE, 1);
+#endif
+    }
+
+public:
+    Socket() {}
+    Socket(Socket&& other) noexcept : handle(other.handle) { other.handle = NoSocket; }
+    Socket& operator=(Socket&& other) noexcept
+    {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    ~Socket()
+    {
+        Close();
+    }
+
+    void Close()
+    {
+        if (handle == NoSocket) return;
+#if defined(_WIN32)
+        closesocket(handle);
+#else
+        close(handle);
+#endif
+        handle = NoSocket;
+    }
+
+    static Socket Connect(const std::string& address)
+    {
+        addrinfo* list = Resolve(address, false);
+        Socket socket;
+        for (addrinfo* a = list; a && socket.handle == NoSocket; a = a->ai_next) {
+            Socket candidate(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+            if (candidate.handle != NoSocket && connect(candidate.handle, a->ai_addr, (int)a->ai_addrlen) == 0) {
+                socket = std::move(candidate);
+            }
+        }
+        freeaddrinfo(list);
+        if (socket.handle == NoSocket) throw std::runtime_error(address + ": cannot connect");
+        socket.Configure();
+        return socket;
+    }
+
+    static Socket Listen(const std::string& address)
+    {
+        addrinfo* list = Resolve(address, true);
+        Socket socket;
+        for (addrinfo* a = list; a && socket.handle == NoSocket; a = a->ai_next) {
+            Socket candidate(::socket(a->ai_family, a->ai_socktype, a->ai_protocol));
+            if (candidate.handle == NoSocket) continue;
+            candidate.SetOption(SOL_SOCKET, SO_REUSEADDR, 1);
+            if (bind(candidate.handle, a->ai_addr, (int)a->ai_addrlen) == 0 && listen(candidate.handle, 16) == 0) {
+                socket = std::move(candidate);
+            }
+        }
+        freeaddrinfo(list);
+        if (socket.handle == NoSocket) throw std::runtime_error(address + ": cannot listen");
+        return socket;
+    }
+
+    // Makes blocked and later sends and receives on the socket fail.
+    void Shutdown()
+    {
+        if (handle == NoSocket) return;
+#if defined(_WIN32)
+        shutdown(handle, SD_BOTH);
+#else
+        shutdown(handle, SHUT_RDWR);
+#endif
+    }
+
+    static Socket ConnectLocal(const std::string& path)
+    {
+        sockaddr_un address = LocalAddress(path);
+        Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+        if (socket.handle == NoSocket || connect(socket.handle, (const sockaddr*)&address, sizeof(address)) != 0) {
+            throw std::runtime_error(path + ": cannot connect");
+        }
+        return socket;
+    }
+
+    // A socket file left behind by a listener that is gone is replaced. The
+    // new one is only accessible to its owner.
+    static Socket ListenLocal(const std::string& path)
+    {
+        sockaddr_un address = LocalAddress(path);
+        bool served = true;
+        try {
+            ConnectLocal(path);
+        } catch (const std::exception&) {
+            served = false;
+        }
+        if (served) throw std::runtime_error(path + ": already served");
+        std::error_code ignored;
+        std::filesystem::remove(path, ignored);
+        Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+#if defined(_WIN32)
+        bool bound = socket.handle != NoSocket && bind(socket.handle, (const sockaddr*)&address, sizeof(address)) == 0;
+#else
+        // bind creates the file with the umask's permissions, so there is
+        // no moment at which others could connect.
+        mode_t mask = umask(0177);
+        bool bound = socket.handle != NoSocket && bind(socket.handle, (const sockaddr*)&address, sizeof(address)) == 0;
+        umask(mask);
+#endif
+        if (!bound || listen(socket.handle, 16) != 0) throw std::runtime_error(path + ": cannot listen");
+        return socket;
+    }
+
+    Socket Accept()
+    {
+        Socket socket(accept(handle, nullptr, nullptr));
+        if (socket.handle == NoSocket) throw std::runtime_error("accept failed");
+        socket.Configure();
+        return socket;
+    }
+
+    // Receives fail once the peer has sent nothing for this long.
+    void SetReceiveTimeout(int seconds)
+    {
+#if defined(_WIN32)
+        DWORD ms = (DWORD)seconds * 1000;
+        setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+#else
+        timeval timeout = { seconds, 0 };
+        setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+    }
+
+    bool Send(const void* data, size_t size)
+    {
+        const char* p = (const char*)data;
+        while (size > 0) {
+            int chunk = (int)std::min(size, (size_t)1 << 30);
+            int sent = (int)send(handle, p, chunk, SendFlags);
+            if (sent <= 0) return false;
+            p += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    // Receives what has arrived, at least one byte; 0 once the peer is gone.
+    size_t ReceiveSome(void* data, size_t size)
+    {
+        int received = (int)recv(handle, (char*)data, (int)std::min(size, (size_t)1 << 30), 0);
+        return received > 0 ? received : 0;
+    }
+
+    bool Receive(void* data, size_t size)
+    {
+        char* p = (char*)data;
+        while (size > 0) {
+            int chunk = (int)std::min(size, (size_t)1 << 30);
+            int received = (int)recv(handle, p, chunk, 0);
+            if (received <= 0) return false;
+            p += received;
+            size -= received;
+        }
+        return true;
+    }
+};
+
+void RemoveLocalSocket(const std::string& path)
+{
+    std::error_code ignored;
+    std::filesystem::remove(path, ignored);
+}
+
+// Reads newline-terminated lines from a socket.
+class LineReader
+{
+    Socket& socket;
+    std::string buffer;
+    size_t start = 0;
+
+public:
+    static const size_t MaxLine = 1 << 16;
+
+    explicit LineReader(Socket& socket) : socket(socket) {}
+
+    // False once the peer is gone or sends a line longer than MaxLine.
+    bool ReadLine(std::string& line)
+    {
+        for (;;) {
+            size_t end = buffer.find('\n', start);
+            if (end != std::string::npos) {
+                line = buffer.substr(start, end - start);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                start = end + 1;
+                return true;
+            }
+            buffer.erase(0, start);
+            start = 0;
+            if (buffer.size() > MaxLine) return false;
+            char chunk[4096];
+            size_t received = socket.ReceiveSome(chunk, sizeof(chunk));
+            if (received == 0) return false;
+            buffer.append(chunk, received);
+        }
+    }
+};
+
+// Distributed rendering. A coordinator sends every worker the scene once,
+// as a scene cache image, and the frame settings, then hands out ranges of
+// tiles; workers send back the pixels of each range. Every message is a
+// MessageHeader followed by its payload, in the byte order of the
+// machines, which the scene cache header checks.
+const uint32_t MessageMagic = 0x314d5452;  // "RTM1"
+
+enum class MessageType : uint32_t
+{
+    Scene,   // scene cache image
+    Frame,   // FrameMessage
+    Range,   // RangeMessage
+    Pixels,  // RangeMessage, then the pixels of its tiles, tile after tile, row by row
+    Done     // no payload: the coordinator has no more work
+};
+
+struct MessageHeader
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t size;
+};
+
+struct FrameMessage
+{
+    int32_t width, height, tileSize;
+    uint32_t precision, acceleration, layout, packets;
+    uint8_t wavefront, reorder, split;
+    float exposure;
+};
+
+struct RangeMessage
+{
+    uint32_t first, count;  // tiles of the frame's TileGrid
+};
+
+bool SendMessage(Socket& socket, MessageType type, const void* payload, size_t size, const void* extra = nullptr, size_t extraSize = 0)
+{
+    MessageHeader header{ MessageMagic, (uint32_t)type, size + extraSize };
+    return socket.Send(&header, sizeof(header)) && socket.Send(payload, size) && socket.Send(extra, extraSize);
+}
+
+// Receives payload up to size bytes, after what it already holds. It grows
+// with what has arrived, so announcing a large payload costs nothing until
+// it is actually sent.
+bool ReceivePayload(Socket& socket, std::vector<char>& payload, uint64_t size)
+{
+    const uint64_t step = (uint64_t)1 << 20;
+    while (payload.size() < size) {
+        size_t at = payload.size();
+        payload.resize((size_t)std::min(size, at + std::max((uint64_t)at, step)));
+        if (!socket.Receive(payload.data() + at, payload.size() - at)) return false;
+    }
+    return true;
+}
+
+// Fails on a closed or timed-out connection, a foreign header or a payload
+// larger than maxSize.
+bool ReceiveMessage(Socket& socket, MessageHeader& header, std::vector<char>& payload, uint64_t maxSize)
+{
+    payload.clear();
+    if (!socket.Receive(&header, sizeof(header))) return false;
+    if (header.magic != MessageMagic || header.size > maxSize) return false;
+    return ReceivePayload(socket, payload, header.size);
+}
+
+// Receives a scene message. Its size has no fixed bound, so the scene cache
+// header at its start is checked against that size before the rest is
+// received; OpenSceneCache validates the contents.
+bool ReceiveScene(Socket& socket, std::vector<char>& payload)
+{
+    MessageHeader header;
+    SceneCacheHeader cache;
+    payload.clear();
+    if (!socket.Receive(&header, sizeof(header)) || header.magic != MessageMagic ||
+        header.type != (uint32_t)MessageType::Scene || header.size < sizeof(cache) ||
+        !socket.Receive(&cache, sizeof(cache)) || !IsSceneCacheLayout(cache, header.size)) {
+        return false;
+    }
+    payload.assign((const char*)&cache, (const char*)&cache + sizeof(cache));
+    return ReceivePayload(socket, payload, header.size);
+}
+
+// Renders the ranges a coordinator sends until it is done or gone. Each range is
+// rendered tile by tile on the pool into a band of whole rows, from which
+// the tiles are packed for sending.
+template <typename Real>
+uint64_t ServeFrame(Socket& socket, Scene<Real>& scene, const FrameMessage& frame, TraceSettings settings, ThreadPool& pool)
+{
+    PrepareScene(scene, settings);
+    RayTracerEngine<Real> rayTracer(scene, settings);
+    const int w = frame.width;
+    const int h = frame.height;
+    TileGrid grid(w, h, frame.tileSize);
+
+    MessageHeader header;
+    std::vector<char> payload;
+    std::vector<RgbColor> band;
+    std::vector<RgbColor> pixels;
+    uint64_t ranges = 0;
+    while (ReceiveMessage(socket, header, payload, sizeof(RangeMessage))) {
+        if (header.type == (uint32_t)MessageType::Done) return ranges;
+        RangeMessage range;
+        if (header.type != (uint32_t)MessageType::Range || payload.size() != sizeof(range)) throw std::runtime_error("unexpected message");
+        std::memcpy(&range, payload.data(), sizeof(range));
+        if (range.count == 0 || range.first >= (uint32_t)grid.Count() || range.count > grid.Count() - range.first) {
+            throw std::runtime_error("invalid range");
+        }
+
+        int y0 = grid.At(range.first).y0;
+        int y1 = grid.At(range.first + range.count - 1).y1;
+        band.resize((size_t)(y1 - y0) * w);
+        TaskGroup group;
+        for (uint32_t i = range.first; i < range.first + range.count; ++i) {
+            Tile tile = grid.At(i);
+            RgbColor* rows = &band[(size_t)(tile.y0 - y0) * w];
+            pool.Run(group, [&rayTracer, rows, w, h, tile] { rayTracer.RenderRegion(rows, w, h, tile); });
+        }
+        pool.Wait(group);
+
+        pixels.clear();
+        for (uint32_t i = range.first; i < range.first + range.count; ++i) {
+            Tile tile = grid.At(i);
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                const RgbColor* row = &band[(size_t)(y - y0) * w];
+                pixels.insert(pixels.end(), row + tile.x0, row + tile.x1);
+            }
+        }
+        if (!SendMessage(socket, MessageType::Pixels, &range, sizeof(range), pixels.data(), pixels.size() * sizeof(RgbColor))) return ranges;
+        ++ranges;
+    }
+    return ranges;
+}
+
+// Receives the scene and frame settings from a coordinator and serves it.
+void ServeCoordinator(Socket& socket, ThreadPool& pool)
+{
+    MessageHeader header;
+    std::vector<char> payload;
+    if (!ReceiveScene(socket, payload)) throw std::runtime_error("expected a scene");
+    size_t sceneBytes = payload.size();
+    auto scene = OpenSceneCache(std::make_unique<MappedFile>(std::move(payload)), "received scene");
+
+    FrameMessage frame;
+    if (!ReceiveMessage(socket, header, payload, sizeof(frame)) || header.type != (uint32_t)MessageType::Frame || payload.size() != sizeof(frame)) {
+        throw std::runtime_error("expected frame settings");
+    }
+    std::memcpy(&frame, payload.data(), sizeof(frame));
+    if (frame.width <= 0 || frame.height <= 0 || frame.tileSize <= 0 || frame.precision > (uint32_t)Precision::Float ||
+        frame.acceleration > (uint32_t)Acceleration::Grid || frame.layout > (uint32_t)SceneLayout::Pools || frame.packets > (uint32_t)SimdIsa::Avx2 ||
+        frame.split > (uint8_t)BvhSplit::Sah ||
+        !(frame.exposure > 0 && frame.exposure < std::numeric_limits<float>::infinity())) {
+        throw std::runtime_error("invalid frame settings");
+    }
+    TraceSettings settings;
+    settings.acceleration = (Acceleration)frame.acceleration;
+    settings.layout = (SceneLayout)frame.layout;
+    settings.packets = (SimdIsa)frame.packets;
+    settings.wavefront = frame.wavefront != 0;
+    settings.reorder = frame.reorder != 0;
+    settings.split = (BvhSplit)frame.split;
+    settings.exposure = frame.exposure;
+
+    auto start = Clock::now();
+    uint64_t ranges;
+    if ((Precision)frame.precision == Precision::Float) {
+        auto floatScene = ConvertScene<float>(*scene);
+        ranges = ServeFrame(socket, *floatScene, frame, settings, pool);
+    } else {
+        ranges = ServeFrame(socket, *scene, frame, settings, pool);
+    }
+    printf("Scene of %zu bytes, %dx%d frame: %llu ranges in %.1f ms\n", sceneBytes, frame.width, frame.height,
+        (unsigned long long)ranges, MillisecondsSince(start));
+    fflush(stdout);
+}
+
+// Serves coordinators one after another until the process is stopped.
+int RunWorker(const RenderOptions& options)
+{
+    Socket listener;
+    try {
+        listener = Socket::Listen(options.workerAddress);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    ThreadPool pool(options.threads);
+    std::cout << "Worker listening on " << options.workerAddress << " with " << pool.ThreadCount() << " threads" << std::endl;
+    for (;;) {
+        try {
+            Socket socket = listener.Accept();
+            ServeCoordinator(socket, pool);
+        } catch (const std::exception& e) {
+            std::cerr << "worker: " << e.what() << std::endl;
+        }
+    }
+}
+
+// Hands out ranges of tiles. A range held by a worker that failed goes back
+// to the queue. Once the queue is empty, idle workers also take a second
+// copy of ranges that have been out far longer than ranges usually take;
+// the first copy to come back is used.
+class TileScheduler
+{
+    struct Range
+    {
+        uint32_t first, count;
+        int copies;
+        bool done;
+        Clock::time_point sent;
     };
 
-#pragma pack(push, 1)
-    struct BITMAPFILEHEADER {
-        WORD  bfType;
-        DWORD bfSize;
-        WORD  bfReserved1;
-        WORD  bfReserved2;
-        DWORD bfOffBits;
-    };
-#pragma pack(pop)
+    std::vector<Range> ranges;
+    std::deque<int> queue;
+    std::mutex mutex;
+    std::condition_variable changed;
+    int remaining;
+    int drivers;
+    double completedMs = 0;
+    int completed = 0;
+    int backups = 0;
 
-    BITMAPINFOHEADER bmpInfoHeader = { 0 };
-    bmpInfoHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bmpInfoHeader.biBitCount = 32;
-    bmpInfoHeader.biClrImportant = 0;
-    bmpInfoHeader.biClrUsed = 0;
-    bmpInfoHeader.biCompression = BI_RGB;
-    bmpInfoHeader.biHeight = -height;
-    bmpInfoHeader.biWidth = width;
-    bmpInfoHeader.biPlanes = 1;
-    bmpInfoHeader.biSizeImage = width * height * 4;
+    // A single-copy range out for more than four times the mean, or -1.
+    int Straggler() const
+    {
+        if (completed == 0) return -1;
+        double limit = std::max(4 * completedMs / completed, 1.0);
+        int slowest = -1;
+        double slowestMs = limit;
+        for (int i = 0; i < (int)ranges.size(); ++i) {
+            const Range& r = ranges[i];
+            if (r.done || r.copies != 1) continue;
+            double ms = MillisecondsSince(r.sent);
+            if (ms > slowestMs) {
+                slowest = i;
+                slowestMs = ms;
+            }
+        }
+        return slowest;
+    }
 
-    BITMAPFILEHEADER bfh = { 0 };
-    bfh.bfType = 'B' + ('M' << 8);
-    bfh.bfOffBits = sizeof(BITMAPINFOHEADER) + sizeof(BITMAPFILEHEADER);
-    bfh.bfSize = bfh.bfOffBits + bmpInfoHeader.biSizeImage;
+public:
+    static const int AllDone = -1;
+    static const int NoneReady = -2;
 
-    std::ofstream file(fileName, std::ios::binary | std::ios::trunc);
-    file.write((const char*)&bfh, sizeof(bfh));
-    file.write((const char*)&bmpInfoHeader, sizeof(bmpInfoHeader));
-    file.write((const char*)bitmapBits, bmpInfoHeader.biSizeImage);
-    file.close();
+    TileScheduler(int tileCount, int rangeSize, int drivers) : remaining(0), drivers(drivers)
+    {
+        for (int first = 0; first < tileCount; first += rangeSize) {
+            ranges.push_back(Range{ (uint32_t)first, (uint32_t)std::min(rangeSize, tileCount - first), 0, false, Clock::now() });
+            queue.push_back((int)ranges.size() - 1);
+        }
+        remaining = (int)ranges.size();
+    }
+
+    RangeMessage Get(int range) const { return RangeMessage{ ranges[range].first, ranges[range].count }; }
+
+    int RangeCount() const { return (int)ranges.size(); }
+
+    int Backups() const { return backups; }
+
+    bool Finished()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return remaining == 0;
+    }
+
+    // The next range to render. Without wait, returns NoneReady instead of
+    // waiting for one.
+    int Take(bool wait)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            if (remaining == 0) return AllDone;
+            while (!queue.empty()) {
+                int range = queue.front();
+                queue.pop_front();
+                if (ranges[range].done) continue;
+                ++ranges[range].copies;
+                ranges[range].sent = Clock::now();
+                return range;
+            }
+            int straggler = Straggler();
+            if (straggler >= 0) {
+                ++ranges[straggler].copies;
+                ++backups;
+                return straggler;
+            }
+            if (!wait) return NoneReady;
+            changed.wait_for(lock, std::chrono::milliseconds(20));
+        }
+    }
+
+    // A copy of range will not come back.
+    void Release(int range)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Range& r = ranges[range];
+        --r.copies;
+        if (!r.done && r.copies == 0) queue.push_front(range);
+        changed.notify_all();
+    }
+
+    // A worker stopped taking ranges.
+    void Leave()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --drivers;
+        changed.notify_all();
+    }
+
+    // Waits until every range is done or every worker has left.
+    void WaitForWorkers()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return remaining == 0 || drivers == 0; });
+    }
+
+    // A copy of range came back; true if it is the first.
+    bool Complete(int range)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Range& r = ranges[range];
+        --r.copies;
+        if (r.done) return false;
+        r.done = true;
+        --remaining;
+        completedMs += MillisecondsSince(r.sent);
+        ++completed;
+        changed.notify_all();
+        return true;
+    }
+};
+
+// Copies the pixels of range, packed tile after tile, into image.
+void UnpackRange(const TileGrid& grid, const RangeMessage& range, const RgbColor* pixels, RgbColor* image)
+{
+    for (uint32_t i = range.first; i < range.first + range.count; ++i) {
+        Tile tile = grid.At(i);
+        int width = tile.x1 - tile.x0;
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            std::memcpy(&image[(size_t)y * grid.w + tile.x0], pixels, width * sizeof(RgbColor));
+            pixels += width;
+        }
+    }
+}
+
+size_t RangePixels(const TileGrid& grid, const RangeMessage& range)
+{
+    size_t pixels = 0;
+    for (uint32_t i = range.first; i < range.first + range.count; ++i) {
+        Tile tile = grid.At(i);
+        pixels += (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    }
+    return pixels;
 }
 
-int main()
+// Keeps a worker supplied with ranges until the frame is done or the worker
+// fails. Two ranges are kept in flight so the worker never waits for the
+// next one.
+class WorkerDriver
 {
-    auto t1 = std::chrono::high_resolution_clock::now();
+    std::string address;
+    TileScheduler& scheduler;
+    const TileGrid& grid;
+    RgbColor* image;
+    std::deque<int> inFlight;
+    Socket socket;
+    std::mutex mutex;  // guards socket and stopped against Stop
+    bool stopped = false;
 
-    Scene scene;
-    RayTracerEngine rayTracer(scene);
+public:
+    int ranges = 0;
+    std::string error;
 
-    const int width = 500;
-    const int height = 500;
+    WorkerDriver(const std::string& address, TileScheduler& scheduler, const TileGrid& grid, RgbColor* image) :
+        address(address), scheduler(scheduler), grid(grid), image(image)
+    {}
 
-    std::vector<RgbColor> bitmapData(width * height);
-    rayTracer.render(&bitmapData[0], width, height);
+    void Run(const char* scene, size_t sceneSize, const FrameMessage& frame, int timeoutSeconds)
+    {
+        const size_t pipelineDepth = 2;
+        try {
+            {
+                Socket connection = Socket::Connect(address);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopped) throw std::runtime_error("stopped");
+                socket = std::move(connection);
+            }
+            socket.SetReceiveTimeout(timeoutSeconds);
+            if (!SendMessage(socket, MessageType::Scene, scene, sceneSize) || !SendMessage(socket, MessageType::Frame, &frame, sizeof(frame))) {
+                throw std::runtime_error("cannot send the scene");
+            }
 
-    auto t2 = std::chrono::high_resolution_clock::now();
-    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>((t2 - t1));
+            MessageHeader header;
+            std::vector<char> payload;
+            while (!scheduler.Finished()) {
+                while (inFlight.size() < pipelineDepth) {
+                    int range = scheduler.Take(inFlight.empty());
+                    if (range < 0) break;
+                    RangeMessage message = scheduler.Get(range);
+                    inFlight.push_back(range);
+                    if (!SendMessage(socket, MessageType::Range, &message, sizeof(message))) throw std::runtime_error("connection lost");
+                }
+                if (inFlight.empty()) break;
 
-    std::cout << "Completed in " << diff.count() << " ms" << std::endl;
-    SaveImage(&bitmapData[0], width, height, "cpp-raytracer.bmp");
+                // Workers answer in order.
+                int range = inFlight.front();
+                RangeMessage expected = scheduler.Get(range);
+                size_t size = sizeof(RangeMessage) + RangePixels(grid, expected) * sizeof(RgbColor);
+                if (!ReceiveMessage(socket, header, payload, size)) throw std::runtime_error("connection lost or timed out");
+                RangeMessage received;
+                if (header.type != (uint32_t)MessageType::Pixels || payload.size() != size) throw std::runtime_error("unexpected message");
+                std::memcpy(&received, payload.data(), sizeof(received));
+                if (received.first != expected.first || received.count != expected.count) throw std::runtime_error("unexpected range");
+
+                inFlight.pop_front();
+                if (scheduler.Complete(range)) {
+                    UnpackRange(grid, expected, (const RgbColor*)(payload.data() + sizeof(RangeMessage)), image);
+                    ++ranges;
+                }
+            }
+            SendMessage(socket, MessageType::Done, nullptr, 0);
+        } catch (const std::exception& e) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stopped) error = e.what();
+        }
+        for (int range : inFlight) scheduler.Release(range);
+        inFlight.clear();
+        scheduler.Leave();
+    }
+
+    // Gives up on ranges still out, once other workers have finished them.
+    void Stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        socket.Shutdown();
+    }
+};
+
+// Renders the frame on the workers at options.distributeAddresses. The
+// coordinator only splits and assembles; if every worker fails it renders
+// the remaining ranges itself with localScene.
+template <typename Real>
+int RenderDistributed(Scene<double>& scene, Scene<Real>& localScene, const RenderOptions& options, Clock::time_point t1)
+{
+    const int width = options.width;
+    const int height = options.height;
+
+    // Mapped scenes are sent as they were mapped; others are serialized once.
+    std::string serialized;
+    const char* sceneBytes;
+    size_t sceneSize;
+    try {
+        if (scene.IsMapped()) {
+            sceneBytes = scene.mapping->Data();
+            sceneSize = scene.mapping->Size();
+        } else {
+            std::ostringstream stream;
+            WriteSceneCache(scene, stream, "scene", SceneSource());
+            serialized = stream.str();
+            sceneBytes = serialized.data();
+            sceneSize = serialized.size();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    auto& trace = options.trace;
+    FrameMessage frame = { width, height, options.tileSize, (uint32_t)options.precision,
+        (uint32_t)trace.acceleration, (uint32_t)trace.layout, (uint32_t)trace.packets,
+        (uint8_t)trace.wavefront, (uint8_t)trace.reorder, (uint8_t)trace.split, trace.exposure };
+
+    // About eight ranges per worker, so fast workers can take more of them.
+    TileGrid grid(width, height, options.tileSize);
+    int workerCount = (int)options.distributeAddresses.size();
+    int rangeSize = std::max(1, grid.Count() / (8 * workerCount));
+    TileScheduler scheduler(grid.Count(), rangeSize, workerCount);
+
+    std::vector<RgbColor> bitmapData((size_t)width * height);
+    std::vector<std::unique_ptr<WorkerDriver>> drivers;
+    std::vector<std::thread> threads;
+    for (auto& address : options.distributeAddresses) {
+        drivers.push_back(std::make_unique<WorkerDriver>(address, scheduler, grid, &bitmapData[0]));
+        WorkerDriver* driver = drivers.back().get();
+        threads.emplace_back([=, &frame] { driver->Run(sceneBytes, sceneSize, frame, options.workerTimeout); });
+    }
+    scheduler.WaitForWorkers();
+    for (auto& driver : drivers) driver->Stop();
+    for (auto& thread : threads) thread.join();
+
+    for (size_t i = 0; i < drivers.size(); ++i) {
+        printf("worker %s: %d ranges%s%s\n", options.distributeAddresses[i].c_str(), drivers[i]->ranges,
+            drivers[i]->error.empty() ? "" : ", failed: ", drivers[i]->error.c_str());
+    }
+
+    int local = 0;
+    if (!scheduler.Finished()) {
+        std::cerr << "All workers failed; rendering the remaining tiles here" << std::endl;
+        TraceSettings settings = options.trace;
+        PrepareScene(localScene, settings);
+        RayTracerEngine<Real> rayTracer(localScene, settings);
+        ThreadPool pool(options.threads);
+        for (int range; (range = scheduler.Take(false)) >= 0; ++local) {
+            RangeMessage message = scheduler.Get(range);
+            TaskGroup group;
+            for (uint32_t i = message.first; i < message.first + message.count; ++i) {
+                Tile tile = grid.At(i);
+                RgbColor* rows = &bitmapData[(size_t)tile.y0 * width];
+                pool.Run(group, [&rayTracer, rows, width, height, tile] { rayTracer.RenderRegion(rows, width, height, tile); });
+            }
+            pool.Wait(group);
+            scheduler.Complete(range);
+        }
+    }
+
+    printf("%d tiles in %d ranges of %d, %d taken again from slow workers, %d rendered locally\n",
+        grid.Count(), scheduler.RangeCount(), rangeSize, scheduler.Backups(), local);
+    std::cout << "Completed in " << (int)MillisecondsSince(t1) << " ms" << std::endl;
+    SaveImage(&bitmapData[0], width, height, options.outputPath.c_str());
+    return 0;
+}
+
+// Render server. Scenes stay loaded and prepared and the thread pool stays
+// up between jobs, so a job costs little more than its trace. Clients send
+// lines over a Unix domain socket:
+//
+//   render <options>   a job, with the command line's options plus --camera,
+//                      --priority and --shm; the scene is the one --scene
+//                      or --spheres names, loaded by the first job using it
+//   status             queue and server state
+//   unload             forgets every loaded scene, for edited scene files
+//   shutdown           finishes the queued jobs and exits
+//
+// Every line gets one reply straight away: "queued <id> <position>",
+// "rejected <reason>", "status ..." or "stopping". Each queued job later gets
+// "done <id> <timings>" or "failed <id> <reason>". Jobs run one at a time on
+// the whole pool, highest --priority first, then in order of arrival.
+template <typename Real>
+struct ResidentCopy
+{
+    std::unique_ptr<Scene<Real>> scene;
+    Camera<Real> camera;         // the scene's own, for jobs without --camera
+    bool prepared = false;
+    TraceSettings requested;     // what the scene was last prepared for
+    TraceSettings effective;     // what PrepareScene made of it
+};
+
+struct ResidentScene
+{
+    ResidentCopy<double> doubleCopy;
+    ResidentCopy<float> floatCopy;
+
+    template <typename Real>
+    ResidentCopy<Real>& Copy()
+    {
+        if constexpr (std::is_same_v<Real, float>) return floatCopy;
+        else return doubleCopy;
+    }
+};
+
+struct ServerConnection
+{
+    Socket socket;
+    std::mutex mutex;  // one reply at a time
+    std::atomic<bool> finished{ false };
+
+    explicit ServerConnection(Socket&& socket) : socket(std::move(socket)) {}
+
+    void Reply(const std::string& line)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string text = line + "\n";
+        socket.Send(text.data(), text.size());  // a client that left misses its reply
+    }
+};
+
+struct RenderJob
+{
+    uint64_t id;
+    RenderOptions options;
+    std::shared_ptr<ServerConnection> client;
+    Clock::time_point submitted;
+
+    bool operator<(const RenderJob& other) const
+    {
+        if (options.priority != other.options.priority) return options.priority < other.options.priority;
+        return id > other.id;
+    }
+};
+
+// The scene options ask for when they name no scene file.
+std::unique_ptr<Scene<double>> GenerateScene(const RenderOptions& options)
+{
+    if (options.instances > 0) return MakeInstancedScene<double>((options.spheres > 0) ? options.spheres : 100, options.instances);
+    if (options.spheres >= 0) return std::make_unique<Scene<double>>(options.spheres);
+    return std::make_unique<Scene<double>>();
+}
+
+// Key of the scene a job renders, as LoadJobScene loads it.
+std::string SceneKey(const RenderOptions& options)
+{
+    if (!options.scenePath.empty()) return "file:" + options.scenePath;
+    if (options.instances > 0) return "instances:" + std::to_string(options.instances) + "x" + std::to_string(options.spheres);
+    if (options.spheres >= 0) return "spheres:" + std::to_string(options.spheres);
+    return "default";
+}
+
+// Writes a BMP image to the shared memory object name, resized to fit, where
+// a client can map it without touching the disk.
+void WriteSharedImage(const std::string& name, const RgbColor* pixels, int width, int height)
+{
+    std::ostringstream bitmap;
+    WriteBitmapHeader(bitmap, width, height);
+    bitmap.write((const char*)pixels, (std::streamsize)width * height * sizeof(RgbColor));
+    std::string bytes = bitmap.str();
+#if defined(_WIN32)
+    // Named mappings vanish with their last handle, so the server keeps one
+    // open per name for as long as it runs.
+    static std::map<std::string, HANDLE> mappings;
+    HANDLE& mapping = mappings[name];
+    if (mapping) CloseHandle(mapping);
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+        (DWORD)((uint64_t)bytes.size() >> 32), (DWORD)bytes.size(), name.c_str());
+    if (!mapping) throw std::runtime_error(name + ": cannot create shared memory");
+    void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, bytes.size());
+    if (!view) throw std::runtime_error(name + ": cannot map shared memory");
+    std::memcpy(view, bytes.data(), bytes.size());
+    UnmapViewOfFile(view);
+#else
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) throw std::runtime_error(name + ": cannot open shared memory");
+    void* view = MAP_FAILED;
+    if (ftruncate(fd, (off_t)bytes.size()) == 0) {
+        view = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (view == MAP_FAILED) throw std::runtime_error(name + ": cannot map shared memory");
+    std::memcpy(view, bytes.data(), bytes.size());
+    munmap(view, bytes.size());
+#endif
+}
+
+class RenderServer
+{
+    std::string path;
+    ThreadPool pool;
+    std::map<std::string, ResidentScene> scenes;  // used by the render thread only
+    std::vector<RgbColor> image;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::priority_queue<RenderJob> queue;
+    uint64_t nextId = 1;
+    uint64_t running = 0;  // id of the job being rendered, 0 if none
+    uint64_t completed = 0;
+    bool stopping = false;
+    bool unload = false;
+
+    struct Times
+    {
+        double scene = 0, prepare = 0, trace = 0, write = 0;
+    };
+
+    template <typename Real>
+    void Render(ResidentCopy<Real>& copy, const RenderOptions& options, Times& times)
+    {
+        auto start = Clock::now();
+        Scene<Real>& scene = *copy.scene;
+        auto& trace = options.trace;
+        auto& requested = copy.requested;
+        if (!copy.prepared || requested.acceleration != trace.acceleration || requested.layout != trace.layout ||
+            requested.packets != trace.packets || requested.split != trace.split) {
+            copy.requested = trace;
+            copy.effective = trace;
+            PrepareScene(scene, copy.effective, &pool);
+            copy.prepared = true;
+        }
+        TraceSettings settings = copy.effective;
+        settings.wavefront = trace.wavefront;
+        settings.reorder = trace.reorder;
+        settings.exposure = trace.exposure;
+        scene.camera = options.hasCamera
+            ? Camera<Real>(Camera<double>(options.cameraPosition, options.cameraLookAt))
+            : copy.camera;
+        RayTracerEngine<Real> rayTracer(scene, settings);
+        times.prepare = MillisecondsSince(start);
+
+        start = Clock::now();
+        image.resize((size_t)options.width * options.height);
+        rayTracer.render(&image[0], options.width, options.height, pool, options.tileSize);
+        times.trace = MillisecondsSince(start);
+
+        start = Clock::now();
+        if (!options.sharedMemoryName.empty()) {
+            WriteSharedImage(options.sharedMemoryName, &image[0], options.width, options.height);
+        } else if (!SaveImage(&image[0], options.width, options.height, options.outputPath.c_str())) {
+            throw std::runtime_error(options.outputPath + ": cannot write");
+        }
+        times.write = MillisecondsSince(start);
+    }
+
+    // The job's scene in its precision, loaded by the first job that uses it.
+    template <typename Real>
+    ResidentCopy<Real>& Resident(const RenderOptions& options, Times& times)
+    {
+        auto start = Clock::now();
+        std::string key = SceneKey(options);
+        ResidentScene& resident = scenes[key];
+        auto& doubleCopy = resident.doubleCopy;
+        try {
+            if (!doubleCopy.scene) {
+                if (!options.scenePath.empty()) {
+                    bool fromCache;
+                    doubleCopy.scene = LoadScene(options.scenePath, fromCache);
+                } else {
+                    doubleCopy.scene = GenerateScene(options);
+                }
+                doubleCopy.camera = doubleCopy.scene->camera;
+            }
+        } catch (const std::exception&) {
+            scenes.erase(key);  // tried again by the next job
+            throw;
+        }
+        ResidentCopy<Real>& copy = resident.Copy<Real>();
+        if constexpr (std::is_same_v<Real, float>) {
+            if (!copy.scene) {
+                copy.scene = ConvertScene<float>(*doubleCopy.scene);
+                copy.camera = copy.scene->camera;
+            }
+        }
+        times.scene = MillisecondsSince(start);
+        return copy;
+    }
+
+    void Run(const RenderJob& job)
+    {
+        Times times;
+        try {
+            if (job.options.precision == Precision::Float) {
+                Render(Resident<float>(job.options, times), job.options, times);
+            } else {
+                Render(Resident<double>(job.options, times), job.options, times);
+            }
+        } catch (const std::exception& e) {
+            job.client->Reply("failed " + std::to_string(job.id) + " " + e.what());
+            return;
+        }
+        char reply[256];
+        snprintf(reply, sizeof(reply), "done %llu scene_ms=%.2f prepare_ms=%.2f trace_ms=%.2f write_ms=%.2f total_ms=%.2f",
+            (unsigned long long)job.id, times.scene, times.prepare, times.trace, times.write, MillisecondsSince(job.submitted));
+        job.client->Reply(reply);
+        printf("%s\n", reply);
+        fflush(stdout);
+    }
+
+    void RenderLoop()
+    {
+        for (;;) {
+            RenderJob job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return !queue.empty() || stopping || unload; });
+                if (unload) {
+                    scenes.clear();
+                    unload = false;
+                    continue;
+                }
+                if (queue.empty()) return;
+                job = queue.top();
+                queue.pop();
+                running = job.id;
+            }
+            Run(job);
+            std::lock_guard<std::mutex> lock(mutex);
+            running = 0;
+            ++completed;
+        }
+    }
+
+    // The immediate reply to one line from a client.
+    std::string Handle(const std::string& line, const std::shared_ptr<ServerConnection>& client)
+    {
+        std::vector<std::string> words;
+        std::istringstream in(line);
+        for (std::string word; in >> word;) words.push_back(word);
+        if (words.empty()) return "rejected empty line";
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (words[0] == "status") {
+            return "status queued=" + std::to_string(queue.size()) + " running=" + std::to_string(running) +
+                " completed=" + std::to_string(completed) + " threads=" + std::to_string(pool.ThreadCount());
+        }
+        if (words[0] == "unload") {
+            unload = true;
+            wake.notify_all();
+            return "unloading";
+        }
+        if (words[0] == "shutdown") {
+            stopping = true;
+            wake.notify_all();
+            return "stopping";
+        }
+        if (words[0] != "render") return "rejected unknown command " + words[0];
+        if (stopping) return "rejected stopping";
+
+        RenderOptions options;
+        std::vector<char*> argv;
+        for (auto& word : words) argv.push_back(&word[0]);
+        if (!ParseOptions((int)argv.size(), &argv[0], options)) return "rejected invalid options";
+        if (options.bandHeight > 0 || options.adaptiveGrid > 1 || options.comparePrecision || options.verify || IsPfmPath(options.outputPath) ||
+            !options.animationPath.empty() || !options.viewsPath.empty() || options.turntable > 0 ||
+            !options.distributeAddresses.empty() || !options.workerAddress.empty() || !options.servePath.empty() || !options.submitPath.empty() ||
+            options.bench || options.benchBvh || options.benchGrid || options.benchBuild || options.benchReorder || options.benchViews > 0 ||
+            !options.saveScenePath.empty()) {
+            return "rejected the server renders single whole frames only";
+        }
+
+        RenderJob job{ nextId++, options, client, Clock::now() };
+        queue.push(job);
+        wake.notify_all();
+        return "queued " + std::to_string(job.id) + " " + std::to_string(queue.size());
+    }
+
+    void Serve(std::shared_ptr<ServerConnection> client)
+    {
+        LineReader reader(client->socket);
+        for (std::string line; reader.ReadLine(line);) {
+            std::string reply = Handle(line, client);
+            client->Reply(reply);
+            if (reply == "stopping") WakeListener();
+        }
+        client->finished = true;
+    }
+
+    // Lets the accept loop see that the server is stopping.
+    void WakeListener()
+    {
+        try {
+            Socket::ConnectLocal(path);
+        } catch (const std::exception&) {
+        }
+    }
+
+public:
+    RenderServer(const std::string& path, int threads) : path(path), pool(threads) {}
+
+    int Run()
+    {
+        Socket listener;
+        try {
+            listener = Socket::ListenLocal(path);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Serving on " << path << " with " << pool.ThreadCount() << " threads" << std::endl;
+        std::thread renderThread([this] { RenderLoop(); });
+
+        std::vector<std::pair<std::shared_ptr<ServerConnection>, std::thread>> connections;
+        for (;;) {
+            Socket socket;
+            try {
+                socket = listener.Accept();
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) break;
+            }
+            for (size_t i = 0; i < connections.size();) {
+                if (connections[i].first->finished) {
+                    connections[i].second.join();
+                    connections.erase(connections.begin() + i);
+                } else {
+                    ++i;
+                }
+            }
+            auto client = std::make_shared<ServerConnection>(std::move(socket));
+            connections.emplace_back(client, std::thread([this, client] { Serve(client); }));
+        }
+
+        // Queued jobs still report to their clients before they are cut off.
+        renderThread.join();
+        for (auto& connection : connections) {
+            connection.first->socket.Shutdown();
+            connection.second.join();
+        }
+        listener.Close();
+        RemoveLocalSocket(path);
+        return 0;
+    }
+};
+
+// Sends the lines of standard input to the render server at
+// options.submitPath and prints its replies until every line and every job
+// it queued is answered. Fails if any line was rejected or any job failed.
+int SubmitJobs(const RenderOptions& options)
+{
+    Socket socket;
+    try {
+        socket = Socket::ConnectLocal(options.submitPath);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    bool ok = true;
+    int results = 0;  // queued jobs whose done or failed line is still to come
+    LineReader reader(socket);
+    auto readReply = [&](std::string& word) {
+        std::string reply;
+        if (!reader.ReadLine(reply)) return false;
+        std::cout << reply << std::endl;
+        word = reply.substr(0, reply.find(' '));
+        if (word == "queued") ++results;
+        if (word == "done" || word == "failed") --results;
+        if (word == "rejected" || word == "failed") ok = false;
+        return true;
+    };
+
+    // A line is sent only once the reply to the one before has been read,
+    // with any results that came first, so neither side can block writing
+    // into a full socket buffer while the other does the same.
+    bool connected = true;
+    std::string word;
+    for (std::string line; connected && std::getline(std::cin, line);) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        line += "\n";
+        connected = socket.Send(line.data(), line.size());
+        do {
+            connected = connected && readReply(word);
+        } while (connected && (word == "done" || word == "failed"));
+    }
+    while (connected && results > 0) connected = readReply(word);
+    if (!connected) {
+        std::cerr << options.submitPath << ": connection lost" << std::endl;
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
+
+// Renders the scene in both precisions and reports how far the float image
+// strays from the double one. The output is the image of the selected
+// precision.
+int ComparePrecision(Scene<double>& scene, Scene<float>& floatScene, const RenderOptions& options)
+{
+    const int width = options.width;
+    const int height = options.height;
+    std::vector<RgbColor> reference((size_t)width * height);
+    std::vector<RgbColor> image((size_t)width * height);
+    double doubleMs = RenderTimed(scene, &reference[0], options);
+    double floatMs = RenderTimed(floatScene, &image[0], options);
+
+    printf("double: %.1f ms, float: %.1f ms\n", doubleMs, floatMs);
+    PrintImageDifference(CompareImages(reference, image), width, reference.size());
 
+    auto& output = (options.precision == Precision::Float) ? image : reference;
+    SaveImage(&output[0], width, height, options.outputPath.c_str());
     return 0;
+}
+
+int main(int argc, char** argv)
+{
+    RenderOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    if (options.benchBvh) {
+        if (options.precision == Precision::Float) {
+            RunBvhBenchmark<float>(options);
+        } else {
+            RunBvhBenchmark<double>(options);
+        }
+        return 0;
+    }
+    if (options.benchGrid) {
+        if (options.precision == Precision::Float) {
+            RunGridBenchmark<float>(options);
+        } else {
+            RunGridBenchmark<double>(options);
+        }
+        return 0;
+    }
+    if (options.benchBuild) {
+        if (options.precision == Precision::Float) {
+            RunBuildBenchmark<float>(options);
+        } else {
+            RunBuildBenchmark<double>(options);
+        }
+        return 0;
+    }
+    if (options.benchReorder) {
+        if (options.precision == Precision::Float) {
+            RunReorderBenchmark<float>(options);
+        } else {
+            RunReorderBenchmark<double>(options);
+        }
+        return 0;
+    }
+    if (options.benchViews > 0) {
+        if (options.precision == Precision::Float) {
+            RunViewsBenchmark<float>(options);
+        } else {
+            RunViewsBenchmark<double>(options);
+        }
+        return 0;
+    }
+    if (options.bench) {
+        if (options.precision == Precision::Float) return RunBenchmarkSuite<float>(options);
+        return RunBenchmarkSuite<double>(options);
+    }
+    if (!options.workerAddress.empty()) {
+        return RunWorker(options);
+    }
+    if (!options.servePath.empty()) {
+        RenderServer server(options.servePath, options.threads);
+        return server.Run();
+    }
+    if (!options.submitPath.empty()) {
+        return SubmitJobs(options);
+    }
+
+    auto t1 = Clock::now();
+
+    std::unique_ptr<Scene<double>> scene;
+    std::unique_ptr<Scene<float>> floatScene;
+    Animation animation;
+    std::vector<View> views;
+    bool animate = !options.animationPath.empty();
+    try {
+        if (animate) {
+            animation = LoadAnimation(options.animationPath);
+        }
+        if (!options.viewsPath.empty()) {
+            views = LoadViews(options.viewsPath);
+        }
+        if (animate && !options.scenePath.empty() && !IsSceneCache(options.scenePath)) {
+            // The cache stores spheres in BVH order; animations count them in
+            // the order the text lists them.
+            scene = LoadSceneText(options.scenePath);
+        } else if (!options.scenePath.empty()) {
+            bool fromCache;
+            scene = LoadScene(options.scenePath, fromCache);
+            std::cout << "Scene " << (fromCache ? "mapped" : "parsed") << " in " << (int)MillisecondsSince(t1) << " ms" << std::endl;
+        } else {
+            scene = GenerateScene(options);
+        }
+        // Workers receive the scene as a scene cache; checked before any
+        // output is written or a worker is contacted.
+        if (!options.distributeAddresses.empty() && scene->HasInstances()) {
+            throw std::runtime_error(options.scenePath + ": --distribute cannot send scenes with instances");
+        }
+        if (options.hasCamera) {
+            scene->camera = Camera<double>(options.cameraPosition, options.cameraLookAt);
+        }
+        if (options.turntable > 0) {
+            views = TurntableViews(scene->camera, options.turntable);
+        }
+        if (!options.saveScenePath.empty()) {
+            SaveSceneText(*scene, options.saveScenePath);
+        }
+        if (options.precision == Precision::Float || options.comparePrecision) {
+            floatScene = ConvertScene<float>(*scene);
+        } else if (animate && scene->IsMapped()) {
+            // Mapped scenes have no things to move.
+            auto copy = ConvertScene<double>(*scene);
+            scene = std::move(copy);
+        }
+        if (animate) {
+            if (floatScene) return RenderAnimation(*floatScene, animation, options);
+            return RenderAnimation(*scene, animation, options);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (options.comparePrecision) {
+        return ComparePrecision(*scene, *floatScene, options);
+    }
+    if (options.verify) {
+        if (floatScene) return VerifyRender(*scene, *floatScene, options);
+        return VerifyRender(*scene, *scene, options);
+    }
+    if (!views.empty()) {
+        if (floatScene) return RenderViews(*floatScene, views, options, t1);
+        return RenderViews(*scene, views, options, t1);
+    }
+    if (!options.distributeAddresses.empty()) {
+        if (floatScene) return RenderDistributed(*scene, *floatScene, options, t1);
+        return RenderDistributed(*scene, *scene, options, t1);
+    }
+    if (floatScene) {
+        scene.reset();
+        return RenderScene(*floatScene, options, t1);
+    }
+    return RenderScene(*scene, options, t1);
 };
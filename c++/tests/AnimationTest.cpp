@@ -0,0 +1,116 @@
+// Regression tests for incremental animation rendering. Build and run from c++/:
+//   g++ -std=c++17 -O2 tests/AnimationTest.cpp -o AnimationTest && ./AnimationTest
+// The renderer is compiled in with its main renamed.
+#define main RayTracerMain
+#include "../RayTracer.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+const int Width = 96;
+const int Height = 96;
+
+// A light that moves every frame, a sphere that moves on frames 3 to 5 and
+// a camera that moves on frame 7.
+Animation TestAnimation()
+{
+    Animation animation;
+    animation.frames = 8;
+    animation.AddKey(Animation::LightTrack, 0, Animation::Key{ 0, Vector<double>(-2.0, 2.5, 0.0), Vector<double>() });
+    animation.AddKey(Animation::LightTrack, 0, Animation::Key{ 7, Vector<double>(2.0, 2.5, -1.0), Vector<double>() });
+    animation.AddKey(Animation::SphereTrack, 1, Animation::Key{ 2, Vector<double>(-1.0, 0.5, 1.5), Vector<double>() });
+    animation.AddKey(Animation::SphereTrack, 1, Animation::Key{ 5, Vector<double>(-0.4, 0.8, 1.0), Vector<double>() });
+    animation.AddKey(Animation::CameraTrack, 0, Animation::Key{ 6, Vector<double>(3.0, 2.0, 4.0), Vector<double>(-1.0, 0.5, 0.0) });
+    animation.AddKey(Animation::CameraTrack, 0, Animation::Key{ 7, Vector<double>(3.5, 2.0, 4.0), Vector<double>(-1.0, 0.5, 0.0) });
+    return animation;
+}
+
+// Every incremental frame must match a complete render of the same scene.
+void CheckFramesMatch(TraceSettings settings, const std::string& name)
+{
+    Animation animation = TestAnimation();
+    Scene<double> scene;
+    Scene<double> reference;
+    PrepareScene(scene, settings);
+    RayTracerEngine<double> rayTracer(scene, settings);
+    SceneAnimator<double> animator(scene, animation);
+    SceneAnimator<double> referenceAnimator(reference, animation);
+    IncrementalRenderer<double> renderer(scene, rayTracer, Width, Height);
+    ThreadPool pool(2);
+
+    bool same = true;
+    for (int frame = 0; frame < animation.frames; ++frame) {
+        SceneChanges<double> changes = animator.Apply(frame);
+        if (!changes.regions.empty()) PrepareScene(scene, settings);
+        renderer.Render(pool, changes);
+
+        referenceAnimator.Apply(frame);
+        TraceSettings referenceSettings = settings;
+        PrepareScene(reference, referenceSettings);
+        RayTracerEngine<double> referenceTracer(reference, referenceSettings);
+        std::vector<RgbColor> image((size_t)Width * Height);
+        referenceTracer.render(&image[0], Width, Height);
+        same = same && std::memcmp(&image[0], &renderer.Image()[0], image.size() * sizeof(RgbColor)) == 0;
+    }
+    Check(same, name + ": incremental frames match complete renders");
+}
+
+// Moving only a light traces no pixel from the camera again.
+void TestLightOnlyFramesReuseHits()
+{
+    Animation animation;
+    animation.frames = 4;
+    animation.AddKey(Animation::LightTrack, 2, Animation::Key{ 0, Vector<double>(1.5, 2.5, -1.5), Vector<double>() });
+    animation.AddKey(Animation::LightTrack, 2, Animation::Key{ 3, Vector<double>(0.5, 3.0, -0.5), Vector<double>() });
+
+    Scene<double> scene;
+    RayTracerEngine<double> rayTracer(scene);
+    SceneAnimator<double> animator(scene, animation);
+    IncrementalRenderer<double> renderer(scene, rayTracer, Width, Height);
+    ThreadPool pool(1);
+    for (int frame = 0; frame < animation.frames; ++frame) {
+        renderer.Render(pool, animator.Apply(frame));
+    }
+    Check(renderer.RetracedPixels() == (uint64_t)Width * Height, "only the first frame traces pixels");
+    Check(renderer.ReshadedPixels() > 0, "frames with a moved light shade pixels again");
+}
+
+void TestFramePath()
+{
+    Check(FramePath("out.bmp", 7) == "out-0007.bmp", "the frame number goes before the extension");
+    Check(FramePath("dir.v2/out", 12) == "dir.v2/out-0012", "a dot in a directory is not an extension");
+}
+
+}
+
+int main()
+{
+    TraceSettings objects;
+    CheckFramesMatch(objects, "objects");
+
+    TraceSettings pools;
+    pools.layout = SceneLayout::Pools;
+    pools.acceleration = Acceleration::Bvh;
+    CheckFramesMatch(pools, "pools with BVH");
+
+    TraceSettings grid;
+    grid.acceleration = Acceleration::Grid;
+    CheckFramesMatch(grid, "objects with grid");
+
+    TestLightOnlyFramesReuseHits();
+    TestFramePath();
+    if (failures > 0) return 1;
+    std::cout << "All animation tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,109 @@
+// Regression tests for BVH construction. Build and run from c++/:
+//   g++ -std=c++17 -O2 tests/BvhTest.cpp -o BvhTest && ./BvhTest
+// The renderer is compiled in with its main renamed.
+#define main RayTracerMain
+#include "../RayTracer.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// Boxes spaced further apart each time along x, so that every surface area
+// split cuts off only the outermost few and the tree degenerates to a chain.
+std::vector<BoundingBox<double>> SpreadBoxes(int count)
+{
+    std::vector<BoundingBox<double>> boxes;
+    double x = 1.0;
+    for (int i = 0; i < count; ++i) {
+        boxes.push_back(BoundingBox<double>(Vector<double>(x, 0.0, 0.0), Vector<double>(x + 0.5, 0.5, 0.5)));
+        x *= 1.1;
+    }
+    return boxes;
+}
+
+// The depth of the deepest leaf, and whether every leaf slot is covered once.
+int Depth(const Bvh<double>& bvh, size_t primitives, bool& covered)
+{
+    auto& nodes = bvh.Nodes();
+    std::vector<int> depth(nodes.size(), 0);
+    std::vector<int> slots(primitives, 0);
+    int deepest = 0;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].count > 0) {
+            for (int slot = nodes[i].start; slot < nodes[i].start + nodes[i].count; ++slot) ++slots[slot];
+            deepest = std::max(deepest, depth[i]);
+        } else {
+            depth[i + 1] = depth[nodes[i].start] = depth[i] + 1;
+        }
+    }
+    covered = std::all_of(slots.begin(), slots.end(), [](int n) { return n == 1; });
+    return deepest;
+}
+
+void CheckDepth(BvhSplit split, int threads)
+{
+    std::string name = std::string(BvhSplitName(split)) + " on " + std::to_string(threads) + " threads";
+    auto boxes = SpreadBoxes(3000);
+    ThreadPool pool(threads);
+    Bvh<double> bvh;
+    bvh.Build(boxes, &pool, split);
+    bool covered = false;
+    int depth = Depth(bvh, boxes.size(), covered);
+    Check(covered, name + ": every primitive is in one leaf");
+    Check(depth <= Bvh<double>::MaxDepth, name + ": no leaf is deeper than MaxDepth (" + std::to_string(depth) + ")");
+}
+
+void TestDepthLimit()
+{
+    for (BvhSplit split : { BvhSplit::Median, BvhSplit::Sah }) {
+        CheckDepth(split, 1);
+        CheckDepth(split, 4);
+    }
+}
+
+// Every split must produce the same tree on any number of threads.
+void TestThreadCountsAgree()
+{
+    Scene<double> scene(20000);
+    for (BvhSplit split : { BvhSplit::Median, BvhSplit::Sah }) {
+        std::vector<Bvh<double>::Node> reference;
+        std::vector<int> referenceOrder;
+        for (int threads : { 1, 3 }) {
+            ThreadPool pool(threads);
+            scene.BuildBvh(&pool, split);
+            auto& nodes = scene.bvh.Nodes();
+            auto& order = scene.bvh.Order();
+            if (reference.empty()) {
+                reference.assign(nodes.begin(), nodes.end());
+                referenceOrder.assign(order.begin(), order.end());
+                continue;
+            }
+            Check(nodes.size() == reference.size() &&
+                      std::memcmp(nodes.data(), reference.data(), nodes.size() * sizeof(reference[0])) == 0,
+                std::string(BvhSplitName(split)) + ": the tree is the same on 1 and 3 threads");
+            Check(std::equal(order.begin(), order.end(), referenceOrder.begin(), referenceOrder.end()),
+                std::string(BvhSplitName(split)) + ": the leaves hold the same primitives in the same order");
+        }
+    }
+}
+
+}
+
+int main()
+{
+    TestDepthLimit();
+    TestThreadCountsAgree();
+    if (failures > 0) return 1;
+    std::cout << "All BVH tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,214 @@
+// Regression tests for distributed rendering: range scheduling, message
+// validation and worker failures. Build and run from c++/:
+//   g++ -std=c++17 -O2 tests/DistributedTest.cpp -o DistributedTest -lpthread && ./DistributedTest
+// The renderer is compiled in with its main renamed.
+#define main RayTracerMain
+#include "../RayTracer.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+const std::string Address = "127.0.0.1:47391";
+
+// Both ends of a loopback connection, a connected to b.
+struct SocketPair
+{
+    Socket a, b;
+
+    explicit SocketPair(Socket& listener)
+    {
+        a = Socket::Connect(Address);
+        b = listener.Accept();
+    }
+};
+
+std::string SceneImage(int spheres)
+{
+    Scene<double> scene(spheres);
+    std::ostringstream stream;
+    WriteSceneCache(scene, stream, "scene", SceneSource());
+    return stream.str();
+}
+
+void TestRangesCoverTiles()
+{
+    TileScheduler scheduler(10, 3, 1);
+    Check(scheduler.RangeCount() == 4, "10 tiles make 4 ranges of up to 3");
+    uint32_t next = 0;
+    for (int range; (range = scheduler.Take(false)) >= 0;) {
+        RangeMessage message = scheduler.Get(range);
+        Check(message.first == next && message.count == std::min(3u, 10 - next), "ranges are taken in order, back to back");
+        next += message.count;
+        Check(scheduler.Complete(range), "the first copy of a range completes it");
+    }
+    Check(next == 10, "the ranges cover every tile");
+    Check(scheduler.Finished() && scheduler.Take(false) == TileScheduler::AllDone, "nothing is left once every range is done");
+}
+
+// A range of a failed worker is handed out again, and only the first copy
+// of a range to come back counts.
+void TestReleasedRangesReturn()
+{
+    TileScheduler scheduler(4, 2, 2);
+    int first = scheduler.Take(false);
+    int second = scheduler.Take(false);
+    Check(scheduler.Take(false) == TileScheduler::NoneReady, "nothing is ready while both ranges are out");
+    scheduler.Release(first);
+    Check(scheduler.Take(false) == first, "a released range is taken again");
+    Check(scheduler.Complete(second), "a range completes");
+    Check(scheduler.Complete(first), "the retaken range completes");
+    Check(scheduler.Finished(), "the frame finishes");
+
+    TileScheduler copies(2, 1, 2);
+    int range = copies.Take(false);
+    copies.Release(range);
+    Check(copies.Take(false) == range, "the released range comes back");
+    Check(copies.Complete(range), "its first copy counts");
+}
+
+void TestMessages(Socket& listener)
+{
+    SocketPair pair(listener);
+    MessageHeader header;
+    std::vector<char> payload;
+
+    RangeMessage range{ 3, 2 };
+    SendMessage(pair.a, MessageType::Range, &range, sizeof(range));
+    Check(ReceiveMessage(pair.b, header, payload, sizeof(range)) && header.type == (uint32_t)MessageType::Range &&
+              payload.size() == sizeof(range),
+        "a range message is received");
+
+    SendMessage(pair.a, MessageType::Range, &range, sizeof(range));
+    Check(!ReceiveMessage(pair.b, header, payload, sizeof(range) - 1), "a payload over the limit is refused");
+
+    SocketPair foreign(listener);
+    MessageHeader bad{ MessageMagic ^ 1, (uint32_t)MessageType::Range, sizeof(range) };
+    foreign.a.Send(&bad, sizeof(bad));
+    foreign.a.Send(&range, sizeof(range));
+    Check(!ReceiveMessage(foreign.b, header, payload, sizeof(range)), "a foreign header is refused");
+
+    // A payload that is announced but never sent allocates nothing much.
+    SocketPair cut(listener);
+    MessageHeader large{ MessageMagic, (uint32_t)MessageType::Pixels, (uint64_t)1 << 33 };
+    cut.a.Send(&large, sizeof(large));
+    cut.a.Send(&range, sizeof(range));
+    cut.a.Close();
+    Check(!ReceiveMessage(cut.b, header, payload, (uint64_t)1 << 34), "a truncated payload fails");
+    Check(payload.capacity() <= ((size_t)1 << 21), "a truncated payload is not allocated at its announced size");
+}
+
+// Sends a scene message with the given header and image from a thread, so
+// large images do not block on the socket buffer.
+bool ReceiveSent(Socket& listener, MessageType type, uint64_t size, const std::string& image, std::vector<char>& payload)
+{
+    SocketPair pair(listener);
+    std::thread sender([&] {
+        MessageHeader header{ MessageMagic, (uint32_t)type, size };
+        pair.a.Send(&header, sizeof(header));
+        pair.a.Send(image.data(), image.size());
+        pair.a.Shutdown();
+    });
+    bool received = ReceiveScene(pair.b, payload);
+    pair.b.Shutdown();
+    sender.join();
+    return received;
+}
+
+void TestSceneMessages(Socket& listener)
+{
+    std::string image = SceneImage(50);
+    std::vector<char> payload;
+    Check(ReceiveSent(listener, MessageType::Scene, image.size(), image, payload) && payload.size() == image.size() &&
+              std::memcmp(payload.data(), image.data(), image.size()) == 0,
+        "a scene cache image is received whole");
+    bool opens = true;
+    try {
+        OpenSceneCache(std::make_unique<MappedFile>(std::move(payload)), "received");
+    } catch (const std::exception&) {
+        opens = false;
+    }
+    Check(opens, "the received image opens");
+
+    Check(!ReceiveSent(listener, MessageType::Frame, image.size(), image, payload), "a scene of the wrong type is refused");
+    Check(!ReceiveSent(listener, MessageType::Scene, sizeof(SceneCacheHeader) - 1, image.substr(0, sizeof(SceneCacheHeader) - 1), payload),
+        "a scene shorter than a cache header is refused");
+    Check(!ReceiveSent(listener, MessageType::Scene, image.size() + 64, image, payload), "a scene whose size is not its cache's is refused");
+
+    // The size matches the header, but the header claims more spheres than
+    // pools index, so nothing past it is received.
+    std::string huge = image;
+    SceneCacheHeader cache;
+    std::memcpy(&cache, huge.data(), sizeof(cache));
+    for (int i = SphereCxSection; i <= SphereMaterialSection; ++i) cache.sections[i].count = (uint64_t)1 << 32;
+    LayOutSceneCache(cache);
+    std::memcpy(&huge[0], &cache, sizeof(cache));
+    Check(!ReceiveSent(listener, MessageType::Scene, cache.fileSize, huge.substr(0, sizeof(cache)), payload) &&
+              payload.capacity() <= ((size_t)1 << 21),
+        "a scene with more spheres than pools index is refused from its header");
+
+    std::string moved = image;
+    std::memcpy(&cache, moved.data(), sizeof(cache));
+    cache.sections[BvhNodeSection].offset += 64;
+    cache.fileSize += 64;
+    std::memcpy(&moved[0], &cache, sizeof(cache));
+    moved.append(64, '\0');
+    Check(!ReceiveSent(listener, MessageType::Scene, moved.size(), moved, payload), "a scene with sections out of place is refused");
+}
+
+// A worker that accepts the scene but never answers is given up on after
+// the timeout, and its ranges go back to the scheduler.
+void TestSilentWorkerTimesOut(Socket& listener)
+{
+    std::thread worker([&] {
+        Socket socket = listener.Accept();
+        std::vector<char> payload;
+        ReceiveScene(socket, payload);
+        char byte;
+        while (socket.ReceiveSome(&byte, 1) > 0) {}
+    });
+
+    std::string image = SceneImage(10);
+    TileGrid grid(64, 64, 16);
+    TileScheduler scheduler(grid.Count(), 4, 1);
+    std::vector<RgbColor> pixels(64 * 64);
+    WorkerDriver driver(Address, scheduler, grid, &pixels[0]);
+    FrameMessage frame = { 64, 64, 16, 0, 0, 0, 0, 0, 0, 0, 1.0f };
+    auto start = Clock::now();
+    driver.Run(image.data(), image.size(), frame, 1);
+    double ms = MillisecondsSince(start);
+    driver.Stop();
+    worker.join();
+
+    Check(driver.error.find("timed out") != std::string::npos, "the silent worker times out: " + driver.error);
+    Check(ms >= 900 && ms < 10000, "the worker is given up on after the timeout");
+    Check(driver.ranges == 0 && !scheduler.Finished(), "nothing came back from the silent worker");
+    int taken = 0;
+    for (int range; (range = scheduler.Take(false)) >= 0; ++taken) scheduler.Complete(range);
+    Check(taken == scheduler.RangeCount() && scheduler.Finished(), "every range of the silent worker is handed out again");
+}
+
+}
+
+int main()
+{
+    TestRangesCoverTiles();
+    TestReleasedRangesReturn();
+    Socket listener = Socket::Listen(Address);
+    TestMessages(listener);
+    TestSceneMessages(listener);
+    TestSilentWorkerTimesOut(listener);
+    if (failures > 0) return 1;
+    std::cout << "All distributed tests passed" << std::endl;
+    return 0;
+}
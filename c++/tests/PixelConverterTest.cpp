@@ -0,0 +1,109 @@
+// Regression tests for the linear to 8-bit pixel conversions. Build and run
+// from c++/:
+//   g++ -std=c++17 -O2 tests/PixelConverterTest.cpp -o PixelConverterTest && ./PixelConverterTest
+// The renderer is compiled in with its main renamed.
+#define main RayTracerMain
+#include "../RayTracer.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+const float Nan = std::numeric_limits<float>::quiet_NaN();
+const float Infinity = std::numeric_limits<float>::infinity();
+
+// Channels in [-0.5, 1.5) with NaN, infinities, zeros and exact levels mixed
+// in, so that every lane of a vector sees each of them somewhere.
+std::vector<LinearRgb> TestPixels(int count)
+{
+    const float special[] = { Nan, Infinity, -Infinity, -0.0f, 0.0f, 1.0f, -1.0f, 100.0f, 128.0f / 255.0f, 1e-30f, 1e30f };
+    const int specials = sizeof(special) / sizeof(special[0]);
+    std::vector<LinearRgb> pixels(count);
+    uint32_t state = 12345;
+    auto next = [&state] {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / float(1 << 24);
+    };
+    for (int i = 0; i < count; ++i) {
+        float* c = &pixels[i].r;
+        for (int k = 0; k < 3; ++k) {
+            int channel = 3 * i + k;
+            c[k] = (channel % 5 == 0) ? special[(channel / 5) % specials] : next() * 2.0f - 0.5f;
+        }
+    }
+    return pixels;
+}
+
+bool SameBytes(const std::vector<RgbColor>& a, const std::vector<RgbColor>& b)
+{
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(RgbColor)) == 0;
+}
+
+// Every converter must give the bytes of the scalar one for any count and
+// start, and leave the pixel after the last one alone.
+void TestConvertersAgree()
+{
+    std::vector<LinearRgb> pixels = TestPixels(1100);
+    for (SimdIsa requested : { SimdIsa::Sse2, SimdIsa::Avx2 }) {
+        SimdIsa isa = SupportedSimdIsa(requested);
+        if (isa != requested) {
+            std::cout << "skipping " << SimdIsaName(requested) << ": not supported" << std::endl;
+            continue;
+        }
+        PixelConverter convert = GetPixelConverter(isa);
+        std::string name = SimdIsaName(isa);
+        for (float scale : { 255.0f, 255.0f * 2.5f, 0.0f }) {
+            for (int start : { 0, 1, 3 }) {
+                std::vector<int> counts = { 1003, 1024, 1097 };
+                for (int count = 0; count <= 17; ++count) counts.push_back(count);
+
+                bool same = true;
+                for (int count : counts) {
+                    const RgbColor sentinel{ 1, 2, 3, 4 };
+                    std::vector<RgbColor> expected(count + 1, sentinel), actual(count + 1, sentinel);
+                    ConvertPixelsScalar(&pixels[start], &expected[0], count, scale);
+                    convert(&pixels[start], &actual[0], count, scale);
+                    same = same && SameBytes(expected, actual);
+                }
+                Check(same, name + " converts like the scalar code at scale " + std::to_string(scale) + ", start "
+                        + std::to_string(start));
+            }
+        }
+    }
+}
+
+void TestSpecialValues()
+{
+    std::vector<LinearRgb> pixels = {
+        { Nan, Infinity, -Infinity },
+        { -0.25f, 1.5f, 1.0f },
+        { 0.5f, 0.999f, 0.0f },
+    };
+    std::vector<RgbColor> out(pixels.size());
+    ConvertPixelsScalar(&pixels[0], &out[0], (int)pixels.size(), 255.0f);
+    Check(out[0].r == 0 && out[0].g == 255 && out[0].b == 0, "NaN and -inf become 0, +inf becomes 255");
+    Check(out[1].r == 0 && out[1].g == 255 && out[1].b == 255, "channels clamp to [0, 255]");
+    Check(out[2].r == 127 && out[2].g == 254 && out[2].b == 0, "scaled channels truncate");
+    Check(out[0].a == 255 && out[1].a == 255 && out[2].a == 255, "pixels are opaque");
+}
+
+}
+
+int main()
+{
+    TestConvertersAgree();
+    TestSpecialValues();
+    if (failures > 0) return 1;
+    std::cout << "All pixel converter tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Regression tests for the wavefront ray reordering keys. Build and run from c++/:
+//   g++ -std=c++17 -O2 tests/ReorderTest.cpp -o ReorderTest && ./ReorderTest
+// The renderer is compiled in with its main renamed.
+#define main RayTracerMain
+#include "../RayTracer.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// Rays from scattered origins in all eight direction octants.
+std::vector<Ray<double>> ScatteredRays(int count)
+{
+    std::vector<Ray<double>> rays;
+    uint32_t seed = 12345;
+    auto next = [&]() {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) / double(1 << 24);
+    };
+    for (int i = 0; i < count; ++i) {
+        Vector<double> start(next() * 10 - 5, next() * 10 - 5, next() * 10 - 5);
+        Vector<double> dir((i & 4) ? -0.3 : 0.3, (i & 2) ? -0.5 : 0.5, (i & 1) ? -0.8 : 0.8);
+        rays.push_back(Ray<double>(start, dir.Norm()));
+    }
+    return rays;
+}
+
+// The rays in the order of their sorted keys.
+std::vector<int> SortedOrder(const std::vector<Ray<double>>& rays)
+{
+    BoundingBox<double> bounds;
+    for (auto& ray : rays) bounds.Extend(ray.start);
+    std::vector<uint64_t> keys;
+    for (size_t i = 0; i < rays.size(); ++i) keys.push_back(ReorderKey(rays[i], bounds, (uint32_t)i));
+    std::sort(keys.begin(), keys.end());
+    std::vector<int> order;
+    for (uint64_t key : keys) order.push_back((int)(key & ReorderIndexMask));
+    return order;
+}
+
+int Octant(const Ray<double>& ray)
+{
+    return (ray.dir.x < 0 ? 4 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 1 : 0);
+}
+
+// Rays that differ only in the sign of their x direction must land in
+// separate runs, as must every octant.
+void TestOctantsFormRuns()
+{
+    std::vector<Ray<double>> rays = ScatteredRays(4096);
+    std::vector<int> order = SortedOrder(rays);
+
+    std::vector<int> sorted = order;
+    std::sort(sorted.begin(), sorted.end());
+    bool permutation = true;
+    for (int i = 0; i < (int)sorted.size(); ++i) permutation = permutation && sorted[i] == i;
+    Check(permutation, "the sorted keys hold every ray index once");
+
+    int xChanges = 0;
+    int octantChanges = 0;
+    for (size_t i = 1; i < order.size(); ++i) {
+        const Ray<double>& a = rays[order[i - 1]];
+        const Ray<double>& b = rays[order[i]];
+        if ((a.dir.x < 0) != (b.dir.x < 0)) ++xChanges;
+        if (Octant(a) != Octant(b)) ++octantChanges;
+    }
+    Check(xChanges == 1, "rays with opposite x directions sort into two runs");
+    Check(octantChanges == 7, "each direction octant sorts into one run");
+}
+
+// Within an octant, rays are ordered by the Morton code of their origin.
+void TestOriginOrder()
+{
+    std::vector<Ray<double>> rays;
+    Vector<double> dir = Vector<double>(1, 1, 1).Norm();
+    for (int x : { 3, 0, 2, 1 }) rays.push_back(Ray<double>(Vector<double>(x, 0, 0), dir));
+    std::vector<int> order = SortedOrder(rays);
+    Check(order == std::vector<int>({ 1, 3, 2, 0 }), "rays in one octant sort by origin");
+}
+
+}
+
+int main()
+{
+    TestOctantsFormRuns();
+    TestOriginOrder();
+    if (failures > 0) return 1;
+    std::cout << "All reorder tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,176 @@
+// Regression tests for scene cache validation. Build and run from c++/:
+//   g++ -std=c++17 -O2 tests/SceneCacheTest.cpp -o SceneCacheTest && ./SceneCacheTest
+// The renderer is compiled in with its main renamed.
+#define main RayTracerMain
+#include "../RayTracer.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+const std::string CachePath = (std::filesystem::temp_directory_path() / "SceneCacheTest.cache").string();
+
+std::vector<char> WriteCache(int spheres)
+{
+    Scene<double> scene(spheres);
+    SaveSceneCache(scene, CachePath, SceneSource());
+    std::ifstream file(CachePath, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Returns the error MapSceneCache reports for image, or "" if it maps.
+std::string OpenError(const std::vector<char>& image)
+{
+    {
+        std::ofstream file(CachePath, std::ios::binary | std::ios::trunc);
+        file.write(image.data(), image.size());
+    }
+    try {
+        MapSceneCache(CachePath);
+        return "";
+    } catch (const std::runtime_error& e) {
+        return e.what();
+    }
+}
+
+// Replaces the BVH of a cache image with nodes, which must not be more than
+// the image has room for.
+void ReplaceBvh(std::vector<char>& image, const std::vector<Bvh<double>::Node>& nodes)
+{
+    SceneCacheHeader header;
+    std::memcpy(&header, image.data(), sizeof(header));
+    auto& section = header.sections[BvhNodeSection];
+    if (nodes.size() > section.count) throw std::logic_error("cache image too small for the BVH");
+    section.count = nodes.size();
+    std::memcpy(image.data(), &header, sizeof(header));
+    std::memcpy(image.data() + section.offset, nodes.data(), nodes.size() * sizeof(nodes[0]));
+}
+
+void TestValidCacheOpens()
+{
+    Check(OpenError(WriteCache(1000)).empty(), "a cache written by SaveSceneCache maps");
+}
+
+const Bvh<double>::Node Leaf{ BoundingBox<double>(), 0, 1 };
+
+Bvh<double>::Node Interior(int right)
+{
+    return Bvh<double>::Node{ BoundingBox<double>(), right, 0 };
+}
+
+// Checks that a cache whose BVH is replaced by nodes fails with error, or
+// opens if error is empty.
+void CheckBvh(const std::vector<Bvh<double>::Node>& nodes, const std::string& error, const std::string& what)
+{
+    std::vector<char> image = WriteCache(2000);
+    ReplaceBvh(image, nodes);
+    std::string actual = OpenError(image);
+    Check(error.empty() ? actual.empty() : actual.find(error) != std::string::npos, what);
+}
+
+// A node with two parents would be traversed once per path; a ladder of
+// them makes traversal exponential within the depth limit.
+void TestSharedChild()
+{
+    // Root -> 1, 2; node 1 -> 2, 3: node 2 has two parents.
+    CheckBvh({ Interior(2), Interior(3), Leaf, Leaf }, "corrupt BVH node", "a node with two parents is rejected");
+
+    // Rung k is nodes 3k and 3k + 1, which both have the first node of the
+    // next rung as their right child.
+    const int rungs = 20;
+    std::vector<Bvh<double>::Node> nodes;
+    for (int k = 0; k < rungs; ++k) {
+        int next = 3 * (k + 1);
+        nodes.push_back(Interior(next));  // 3k: left 3k + 1, right next
+        nodes.push_back(Interior(next));  // 3k + 1: left 3k + 2, right next
+        nodes.push_back(Leaf);            // 3k + 2
+    }
+    nodes.push_back(Leaf);
+    CheckBvh(nodes, "corrupt BVH node", "a ladder of shared nodes is rejected");
+}
+
+void TestUnreferencedNode()
+{
+    CheckBvh({ Interior(2), Leaf, Leaf, Leaf }, "corrupt BVH node", "a node without a parent is rejected");
+}
+
+// A chain of depth interior nodes, each with a leaf as its right child.
+std::vector<Bvh<double>::Node> Chain(int depth)
+{
+    std::vector<Bvh<double>::Node> nodes;
+    for (int i = 0; i < depth; ++i) nodes.push_back(Interior(depth + 1 + i));
+    nodes.resize(2 * depth + 1, Leaf);
+    return nodes;
+}
+
+void TestDepthLimit()
+{
+    const int maxDepth = Bvh<double>::MaxDepth;
+    CheckBvh(Chain(maxDepth), "", "leaves at exactly MaxDepth are accepted");
+    CheckBvh(Chain(maxDepth + 1), "corrupt BVH node", "a BVH deeper than MaxDepth is rejected");
+}
+
+// Instanced scenes have no cache form: writing one fails with a clear
+// message, a text scene with instances is parsed without a cache, and
+// --distribute, which sends scene caches, refuses them before rendering.
+void TestInstancedScenes()
+{
+    auto scene = MakeInstancedScene<double>(5, 4);
+    Check(scene->HasInstances(), "a generated instanced scene has instances");
+    std::string error;
+    try {
+        std::ostringstream stream;
+        WriteSceneCache(*scene, stream, "instanced", SceneSource());
+    } catch (const std::runtime_error& e) {
+        error = e.what();
+    }
+    Check(error.find("no instances") != std::string::npos, "an instanced scene is not written as a cache");
+
+    std::string textPath = (std::filesystem::temp_directory_path() / "SceneCacheTestInstances.txt").string();
+    SaveSceneText(*scene, textPath);
+    bool fromCache = true;
+    auto loaded = LoadScene(textPath, fromCache);
+    Check(!fromCache && loaded->HasInstances() && !std::filesystem::exists(textPath + ".cache"),
+        "a text scene with instances is parsed and no cache is written");
+
+    std::string outputPath = (std::filesystem::temp_directory_path() / "SceneCacheTestInstances.bmp").string();
+    std::vector<std::string> arguments = { "RayTracer", "--scene", textPath, "--distribute", "127.0.0.1:1", "--save-scene",
+        outputPath + ".txt", "--output", outputPath };
+    std::vector<char*> argv;
+    for (auto& argument : arguments) argv.push_back(&argument[0]);
+    Check(RayTracerMain((int)argv.size(), argv.data()) == 1 && !std::filesystem::exists(outputPath + ".txt"),
+        "--distribute refuses a scene file with instances before writing anything");
+
+    arguments = { "RayTracer", "--instances", "4", "--distribute", "127.0.0.1:1" };
+    argv.clear();
+    for (auto& argument : arguments) argv.push_back(&argument[0]);
+    RenderOptions options;
+    Check(!ParseOptions((int)argv.size(), argv.data(), options), "--distribute refuses --instances");
+
+    std::filesystem::remove(textPath);
+}
+
+}
+
+int main()
+{
+    TestValidCacheOpens();
+    TestSharedChild();
+    TestUnreferencedNode();
+    TestDepthLimit();
+    TestInstancedScenes();
+    std::filesystem::remove(CachePath);
+    if (failures > 0) return 1;
+    std::cout << "All scene cache tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,57 @@
+// Regression tests for --verify exit codes. Build and run from c++/:
+//   g++ -std=c++17 -O2 tests/VerifyTest.cpp -o VerifyTest -lpthread && ./VerifyTest
+// The renderer is compiled in with its main renamed.
+#define main RayTracerMain
+#include "../RayTracer.cpp"
+#undef main
+
+namespace
+{
+
+int failures = 0;
+
+void Check(bool condition, const std::string& what)
+{
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+const std::string OutputPath = (std::filesystem::temp_directory_path() / "VerifyTest.bmp").string();
+const std::string HeatmapPath = (std::filesystem::temp_directory_path() / "VerifyTest-heatmap.bmp").string();
+
+// Runs the renderer with --verify and arguments, and returns its exit code.
+int Verify(std::vector<std::string> arguments)
+{
+    std::vector<std::string> command = { "RayTracer", "--size", "100", "100", "--verify", "--output", OutputPath };
+    command.insert(command.end(), arguments.begin(), arguments.end());
+    std::vector<char*> argv;
+    for (auto& argument : command) argv.push_back(&argument[0]);
+    return RayTracerMain((int)argv.size(), argv.data());
+}
+
+void TestExitCodes()
+{
+    Check(Verify({}) == 0, "the reference path itself verifies with exit code 0");
+    Check(std::filesystem::exists(OutputPath) && std::filesystem::exists(HeatmapPath), "the image and its heatmap are written");
+    Check(Verify({ "--packets", "avx2" }) == 0, "packets give the reference image");
+
+    // Float silhouettes move by a pixel here and there, far more than a level.
+    Check(Verify({ "--precision", "float" }) == 2, "pixels over --verify-threshold fail with exit code 2");
+    Check(Verify({ "--precision", "float", "--verify-threshold", "255" }) == 0, "a threshold above every pixel passes");
+    Check(Verify({ "--precision", "float", "--max-error", "255" }) == 0, "--max-error replaces the threshold as the budget");
+    Check(Verify({ "--max-error", "0", "--verify-threshold", "0" }) == 0, "an identical image passes a zero budget");
+}
+
+}
+
+int main()
+{
+    TestExitCodes();
+    std::filesystem::remove(OutputPath);
+    std::filesystem::remove(HeatmapPath);
+    if (failures > 0) return 1;
+    std::cout << "All verify tests passed" << std::endl;
+    return 0;
+}